@@ -0,0 +1,315 @@
+/*******************************************************************************
+**                                  LibChaos                                  **
+**                             zparcel/bench.cpp                              **
+**                          See COPYRIGHT and LICENSE                         **
+*******************************************************************************/
+#include "zparcel.h"
+#include "zclock.h"
+#include "zexception.h"
+#include "zfile.h"
+#include "zjson.h"
+#include "zlog.h"
+#include "zoptions.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+
+#if defined(__linux__)
+    #include <fcntl.h>
+    #include <unistd.h>
+#endif
+
+using namespace LibChaos;
+
+//! Bytes in each blob stored by the insert workloads.
+#define BENCH_BLOB_SIZE 64
+//! Ids fetched over and over by the hot lookup workload.
+#define BENCH_HOT_IDS 1024
+//! Ids in each multi-get.
+#define BENCH_BATCH 256
+//! Files stored and extracted by the file workloads.
+#define BENCH_FILES 8
+
+static const ZParcel::parcelopt benchopt = (ZParcel::parcelopt)(ZParcel::OPT_TAIL_EXTEND | ZParcel::OPT_CRC32C | ZParcel::OPT_DATA_CRC);
+
+//! Process I/O counters.
+struct IoCount {
+    zu64 syscalls;  // Read and write system calls
+    zu64 written;   // Bytes passed to write system calls
+};
+
+static IoCount ioCount(){
+    IoCount io = { 0, 0 };
+#if defined(__linux__)
+    std::ifstream in("/proc/self/io");
+    std::string key;
+    zu64 value;
+    while(in >> key >> value){
+        if(key == "syscr:" || key == "syscw:")
+            io.syscalls += value;
+        else if(key == "wchar:")
+            io.written += value;
+    }
+#endif
+    return io;
+}
+
+//! Write the file at \a path back and drop it from the OS page cache, so the next reads go to the disk.
+static bool evictFile(ZPath path){
+#if defined(__linux__)
+    const int fd = ::open(path.str().cc(), O_RDONLY);
+    if(fd < 0)
+        return false;
+    const bool ok = (::fsync(fd) == 0 && ::posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) == 0);
+    ::close(fd);
+    return ok;
+#else
+    return false;
+#endif
+}
+
+//! Result of one workload.
+struct Result {
+    ZString name;
+    zu64 ops;
+    double secs;
+    double p50;         // Microseconds
+    double p99;         // Microseconds
+    zu64 syscalls;
+    zu64 written;
+    zu64 bytes;         // Object bytes moved, for throughput of file workloads
+    zu64 filesize;      // Parcel size after the workload
+};
+
+/*! Run \a op for \a count operations, timing each one, with the parcel at \a path.
+ *  \a op returns false on failure, which ends the benchmark.
+ */
+static Result measure(ZString name, ZPath path, zu64 count, zu64 bytes, const std::function<bool(zu64)> &op){
+    std::vector<double> lat;
+    lat.reserve(count);
+    const IoCount start = ioCount();
+    ZClock clock;
+    for(zu64 i = 0; i < count; ++i){
+        const auto t0 = std::chrono::steady_clock::now();
+        if(!op(i))
+            throw ZException("bench: " + name + " failed");
+        lat.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t0).count());
+    }
+    Result res;
+    res.name = name;
+    res.ops = count;
+    res.secs = clock.getSecs();
+    const IoCount end = ioCount();
+    res.syscalls = end.syscalls - start.syscalls;
+    res.written = end.written - start.written;
+    res.bytes = bytes;
+
+    std::sort(lat.begin(), lat.end());
+    res.p50 = (count ? lat[count / 2] : 0);
+    res.p99 = (count ? lat[MIN(count - 1, count * 99 / 100)] : 0);
+
+    ZFile file(path, ZFile::READ);
+    res.filesize = (file.isOpen() ? file.fileSize() : 0);
+    return res;
+}
+
+static ZUID makeId(zu64 hi, zu64 lo){
+    zbyte raw[ZUID_SIZE];
+    ZBinary::encbeu64(raw, hi);
+    ZBinary::encbeu64(raw + 8, lo);
+    ZUID id;
+    id.fromRaw(raw);
+    return id;
+}
+
+//! Blob of \a size bytes, the same for each \a seed.
+static ZBinary makeBlob(zu64 size, zu64 seed){
+    ZBinary blob;
+    blob.resize(size);
+    std::mt19937_64 rng(seed);
+    for(zu64 i = 0; i < size; i += 8){
+        zbyte word[8];
+        ZBinary::encbeu64(word, rng());
+        memcpy(blob.raw() + i, word, MIN((zu64)8, size - i));
+    }
+    return blob;
+}
+
+static bool ok(ZParcel::parcelerror err){
+    if(err != ZParcel::OK)
+        ELOG("bench: " << ZParcel::errorStr(err));
+    return (err == ZParcel::OK);
+}
+
+//! Insert \a ids into a new parcel at \a path.
+static Result benchInsert(ZString name, ZPath path, const std::vector<ZUID> &ids){
+    ::remove(path.str().cc());
+    ZParcel parcel;
+    if(!ok(parcel.create(path, benchopt)))
+        throw ZException("bench: create failed");
+    const ZBinary blob = makeBlob(BENCH_BLOB_SIZE, 1);
+    return measure(name, path, ids.size(), 0, [&](zu64 i){
+        return ok(parcel.storeBlob(ids[i], blob));
+    });
+}
+
+static void report(const Result &res, ZJSON &json){
+    const double ops = (res.ops ? (double)res.ops : 1);
+    LOG(res.name << ": " << res.ops << " ops in " << res.secs << " sec, " << (res.ops / res.secs) << " ops/sec, p50 " <<
+        res.p50 << " us, p99 " << res.p99 << " us, " << (res.syscalls / ops) << " syscalls/op, " <<
+        (res.written / ops) << " bytes written/op" <<
+        (res.bytes ? ", " + ZString::ItoS((zu64)(res.bytes / res.secs / (1 << 20))) + " MiB/sec" : ZString()));
+
+    ZJSON &obj = json[res.name];
+    obj["ops"] = ZJSON((double)res.ops);
+    obj["secs"] = ZJSON(res.secs);
+    obj["ops_per_sec"] = ZJSON(res.ops / res.secs);
+    obj["p50_us"] = ZJSON(res.p50);
+    obj["p99_us"] = ZJSON(res.p99);
+    obj["syscalls_per_op"] = ZJSON(res.syscalls / ops);
+    obj["bytes_written_per_op"] = ZJSON(res.written / ops);
+    obj["bytes_per_sec"] = ZJSON(res.bytes / res.secs);
+    obj["file_size"] = ZJSON((double)res.filesize);
+}
+
+static int bench(ZPath path, zu64 count, ZString jsonpath){
+    ZJSON json;
+    std::mt19937_64 rng(2);
+
+    // Inserts, with ids in order, in random order, and time-ordered with random low bits
+    std::vector<ZUID> seq;
+    std::vector<ZUID> rnd;
+    std::vector<ZUID> tim;
+    for(zu64 i = 0; i < count; ++i){
+        seq.push_back(makeId(0, i + 1));
+        rnd.push_back(makeId(rng(), rng()));
+        tim.push_back(makeId(((zu64)0x01 << 56) + i * 10007, rng()));
+    }
+    report(benchInsert("insert_sequential", path, seq), json["workloads"]);
+    report(benchInsert("insert_time", path, tim), json["workloads"]);
+    report(benchInsert("insert_random", path, rnd), json["workloads"]);
+
+    // Lookups in the random parcel, each id once with nothing cached, then a small set over and over
+    std::vector<ZUID> order = rnd;
+    std::shuffle(order.begin(), order.end(), rng);
+    if(!evictFile(path))
+        ELOG("bench: could not evict " << path << " from the page cache, lookup_cold reads are cached");
+    {
+        ZParcel parcel;
+        if(!ok(parcel.open(path)))
+            return EXIT_FAILURE;
+        report(measure("lookup_cold", path, count, 0, [&](zu64 i){
+            return (parcel.fetchBlob(order[i]).size() == BENCH_BLOB_SIZE);
+        }), json["workloads"]);
+        const zu64 hot = MIN((zu64)BENCH_HOT_IDS, count);
+        report(measure("lookup_hot", path, count, 0, [&](zu64 i){
+            return (parcel.fetchBlob(order[i % hot]).size() == BENCH_BLOB_SIZE);
+        }), json["workloads"]);
+    }
+    {
+        ZParcel parcel;
+        if(!ok(parcel.open(path)))
+            return EXIT_FAILURE;
+        ZArray<ZUID> ids;
+        ZArray<ZBinary> out;
+        report(measure("multi_get", path, count / BENCH_BATCH, 0, [&](zu64 i){
+            ids.clear();
+            for(zu64 j = 0; j < BENCH_BATCH; ++j)
+                ids.push(order[(i * BENCH_BATCH + j) % count]);
+            return ok(parcel.fetchMany(ids, out));
+        }), json["workloads"]);
+    }
+
+    // Churn: remove a random object and store a new one of random size, reusing the freed space
+    {
+        ZParcel parcel;
+        if(!ok(parcel.open(path)))
+            return EXIT_FAILURE;
+        std::vector<ZUID> live = rnd;
+        report(measure("churn", path, count, 0, [&](zu64 i){
+            const zu64 k = rng() % live.size();
+            if(!ok(parcel.removeObject(live[k])))
+                return false;
+            live[k] = makeId(rng(), rng());
+            return ok(parcel.storeBlob(live[k], makeBlob(32 + rng() % 2048, i)));
+        }), json["workloads"]);
+        report(measure("update_uint", path, count, 0, [&](zu64 i){
+            return ok(parcel.updateUint(live[i % live.size()], i));
+        }), json["workloads"]);
+    }
+
+    // Large files in and out
+    const zu64 fsize = MAX((zu64)1 << 16, MIN((zu64)1 << 26, count * 256));
+    const ZPath src = path.str() + ".src";
+    const ZPath dst = path.str() + ".out";
+    {
+        const ZBinary data = makeBlob(fsize, 3);
+        ZFile file(src, ZFile::WRITE);
+        if(!file.isOpen() || file.write(data.raw(), data.size()) != data.size())
+            throw ZException("bench: failed to write " + src.str());
+    }
+    {
+        ::remove(path.str().cc());
+        ZParcel parcel;
+        if(!ok(parcel.create(path, benchopt)))
+            return EXIT_FAILURE;
+        std::vector<ZUID> files;
+        for(zu64 i = 0; i < BENCH_FILES; ++i)
+            files.push_back(makeId(rng(), rng()));
+        report(measure("file_ingest", path, BENCH_FILES, BENCH_FILES * fsize, [&](zu64 i){
+            return ok(parcel.storeFile(files[i], src));
+        }), json["workloads"]);
+        report(measure("file_extract", path, BENCH_FILES, BENCH_FILES * fsize, [&](zu64 i){
+            ZUID nameid;
+            ZUID dataid;
+            return ok(parcel.fetchFile(files[i], nameid, dataid)) && ok(parcel.fetchBlobTo(dataid, dst));
+        }), json["workloads"]);
+    }
+    ::remove(src.str().cc());
+    ::remove(dst.str().cc());
+    ::remove(path.str().cc());
+
+    if(!jsonpath.isEmpty()){
+        json["count"] = ZJSON((double)count);
+        const ZString str = json.encode();
+        ZFile file(jsonpath, ZFile::WRITE);
+        if(!file.isOpen() || file.write((const zbyte *)str.cc(), str.size()) != str.size()){
+            ELOG("bench: failed to write " << jsonpath);
+            return EXIT_FAILURE;
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+const ZArray<ZOptions::OptDef> optdef = {};
+
+int main(int argc, char **argv){
+    ZLog::logLevelStdOut(ZLog::INFO, "%log%");
+    ZLog::logLevelStdErr(ZLog::ERRORS, "%time% (%file%:%line%) - %log%");
+
+    try {
+        ZOptions options(optdef);
+        if(!options.parse(argc, argv) || options.getArgs().size() < 1 || options.getArgs().size() > 3){
+            LOG("Usage: zparcel-bench <parcel file> [count] [json file]");
+            return -1;
+        }
+        auto args = options.getArgs();
+        const zu64 count = (args.size() > 1 ? args[1].toUint() : 100000);
+        if(count < BENCH_BATCH){
+            LOG("Count must be at least " << BENCH_BATCH);
+            return -1;
+        }
+        return bench(args[0], count, (args.size() > 2 ? args[2] : ZString()));
+
+    } catch(ZException err){
+        ELOG(err.what());
+        return EXIT_FAILURE;
+    }
+}
@@ -4,10 +4,17 @@
 **                          See COPYRIGHT and LICENSE                         **
 *******************************************************************************/
 #include "main.h"
+#include "zparcelcodec.h"
 #include "zexception.h"
 #include "zlog.h"
 #include "zoptions.h"
 
+#include <random>
+
+#if defined(__unix__) || defined(__APPLE__)
+    #include <sys/stat.h>
+#endif
+
 using namespace LibChaos;
 
 static const ZMap<ZString, ZParcel::objtype> nametotype = {
@@ -38,6 +45,14 @@ static const ZMap<ZString, ZParcel::objtype> nametotype = {
     { "file",   ZParcel::FILEOBJ },
 };
 
+//! Open parcel for writing, with positional I/O if possible.
+ZParcel::parcelerror openWrite(ZParcel &parcel, ZFile *file){
+    auto err = parcel.open(file->path());
+    if(err == ZParcel::ERR_OPEN)
+        err = parcel.open(file);
+    return err;
+}
+
 ZUID argNewUID(ZString str){
     if(str == "time")
         return ZUID(ZUID::TIME);
@@ -46,78 +61,115 @@ ZUID argNewUID(ZString str){
     return ZUID(str);
 }
 
+//! Open parcel for reading, mapped if possible.
+ZParcel::parcelerror openRead(ZParcel &parcel, ZFile *file){
+    auto err = parcel.openMapped(file->path());
+    if(err == ZParcel::ERR_OPEN)
+        err = openWrite(parcel, file);
+    return err;
+}
+
 int cmd_create(ZFile *file, ZArray<ZString> args){
-    ZParcel parcel;
-    auto err = parcel.create(file, ZParcel::OPT_TAIL_EXTEND);
-    if(err != ZParcel::OK){
-        LOG("FAIL - " << ZParcel::errorStr(err));
-        return EXIT_FAILURE;
+    // The version is optional, and only a number
+    ZParcel::parceltype version = ZParcel::VERSION2;
+    zu64 first = 0;
+    if(args.size() && args[0].isInteger()){
+        const zu64 num = args[0].toUint();
+        if(num != ZParcel::VERSION1 && num != ZParcel::VERSION2){
+            ELOG("FAIL - Version must be " << (int)ZParcel::VERSION1 << " or " << (int)ZParcel::VERSION2);
+            LOG("Usage: zparcel <file> create [version] [classes] [compress] [dedup] [journal]");
+            return -4;
+        }
+        version = (ZParcel::parceltype)num;
+        first = 1;
+    }
+    int opt = ZParcel::OPT_TAIL_EXTEND | ZParcel::OPT_CRC32C | ZParcel::OPT_DATA_CRC;
+    for(zu64 i = first; i < args.size(); ++i){
+        if(args[i] == "classes"){
+            opt |= ZParcel::OPT_SIZE_CLASSES;
+        } else if(args[i] == "compress"){
+            opt |= ZParcel::OPT_COMPRESS;
+        } else if(args[i] == "dedup"){
+            opt |= ZParcel::OPT_DEDUP;
+        } else if(args[i] == "journal"){
+            opt |= ZParcel::OPT_JOURNAL;
+        } else {
+            ELOG("FAIL - Unknown option \"" << args[i] << "\"");
+            LOG("Usage: zparcel <file> create [version] [classes] [compress] [dedup] [journal]");
+            return -4;
+        }
     }
 
-    LOG("OK - Create " << file->path());
-    return EXIT_SUCCESS;
-}
-
-int cmd_list(ZFile *file, ZArray<ZString> args){
     ZParcel parcel;
-    auto err = parcel.open(file);
+    auto err = parcel.create(file->path(), (ZParcel::parcelopt)opt, version);
     if(err != ZParcel::OK){
         LOG("FAIL - " << ZParcel::errorStr(err));
         return EXIT_FAILURE;
     }
 
-    parcel.listObjects();
-
+    LOG("OK - Create " << file->path());
     return EXIT_SUCCESS;
 }
 
-int cmd_store(ZFile *file, ZArray<ZString> args){
-    ZUID uid = argNewUID(args[0]);
-    ZString stype = args[1];
-    ZString value = args[2];
-
-    if(uid == ZUID_NIL){
-        ELOG("FAIL - Invalid UUID");
-        return EXIT_FAILURE;
+int cmd_list(ZFile *file, ZArray<ZString> args){
+    ZUID from;
+    ZUID to;
+    if(args.size()){
+        from = args[0];
+        to = (args.size() > 1 ? ZUID(args[1]) : from);
+        if(from == ZUID_NIL || to == ZUID_NIL){
+            ELOG("FAIL - Invalid UUID");
+            return EXIT_FAILURE;
+        }
     }
 
     ZParcel parcel;
-    auto err = parcel.open(file);
+    auto err = openRead(parcel, file);
     if(err != ZParcel::OK){
         LOG("FAIL - " << ZParcel::errorStr(err));
         return EXIT_FAILURE;
     }
 
-    if(!nametotype.contains(stype)){
-        LOG("FAIL - Unknown type");
+    ZParcel::Scan scan = (args.size() ? parcel.scan(from, to) : parcel.scan());
+    ZParcel::ScanEntry entry;
+    while(scan.next(entry))
+        LOG(entry.id.str() << " " << ZParcel::typeName(entry.type));
+    if(scan.error() != ZParcel::OK){
+        LOG("FAIL - " << ZParcel::errorStr(scan.error()));
         return EXIT_FAILURE;
     }
 
-    auto type = nametotype[stype];
+    return EXIT_SUCCESS;
+}
+
+/*! Store \a value parsed as \a type in \a parcel, a ZParcel or ZParcelBuilder.
+ *  \return False if the value is invalid, otherwise the store result is written at \a err.
+ */
+template <typename P> bool storeValue(P &parcel, ZUID uid, ZParcel::objtype type, ZString value, ZParcel::parcelerror *err){
     switch(type){
         case ZParcel::BOOLOBJ:
-            err = parcel.storeBool(uid, (value == "true" ? true : false));
+            *err = parcel.storeBool(uid, (value == "true" ? true : false));
             break;
         case ZParcel::UINTOBJ:
-            err = parcel.storeUint(uid, value.toUint());
+            *err = parcel.storeUint(uid, value.toUint());
             break;
         case ZParcel::SINTOBJ:
-            err = parcel.storeSint(uid, value.tint());
+            *err = parcel.storeSint(uid, value.tint());
             break;
         case ZParcel::FLOATOBJ:
-            err = parcel.storeFloat(uid, value.toFloat());
+            *err = parcel.storeFloat(uid, value.toFloat());
             break;
         case ZParcel::ZUIDOBJ:
-            err = parcel.storeZUID(uid, value);
+            *err = parcel.storeZUID(uid, value);
             break;
         case ZParcel::BLOBOBJ: {
             ZBinary bin;
             ZFile::readBinary(value, bin);
-            err = parcel.storeBlob(uid, bin);
+            *err = parcel.storeBlob(uid, bin);
             break;
         }
         case ZParcel::STRINGOBJ:
-            err = parcel.storeString(uid, value);
+            *err = parcel.storeString(uid, value);
             break;
         case ZParcel::LISTOBJ: {
             ZList<ZUID> list;
@@ -126,26 +178,98 @@ int cmd_store(ZFile *file, ZArray<ZString> args){
                 ZUID id(it.get());
                 if(id == ZUID_NIL){
                     LOG("FAIL - Invalid UUID");
-                    return EXIT_FAILURE;
+                    return false;
                 }
                 list.push(id);
             }
-            err = parcel.storeList(uid, list);
+            *err = parcel.storeList(uid, list);
             break;
         }
-        case ZParcel::FILEOBJ: {
-            ZClock clock;
-            err = parcel.storeFile(uid, value);
-            LOG("Store Time: " << clock.getSecs() << " sec");
+        case ZParcel::FILEOBJ:
+            *err = parcel.storeFile(uid, value);
             break;
-        }
 
         default:
             LOG("FAIL - Unknown type");
-            return EXIT_FAILURE;
-            break;
+            return false;
+    }
+    return true;
+}
+
+int cmd_listtype(ZFile *file, ZArray<ZString> args){
+    if(!nametotype.contains(args[0])){
+        LOG("FAIL - Unknown type");
+        return EXIT_FAILURE;
+    }
+
+    ZParcel parcel;
+    parcel.setIndexes(ZParcel::INDEX_TYPE);
+    auto err = openRead(parcel, file);
+    if(err != ZParcel::OK){
+        LOG("FAIL - " << ZParcel::errorStr(err));
+        return EXIT_FAILURE;
+    }
+
+    ZArray<ZUID> ids;
+    err = parcel.listByType(nametotype[args[0]], ids);
+    if(err != ZParcel::OK){
+        LOG("FAIL - " << ZParcel::errorStr(err));
+        return EXIT_FAILURE;
+    }
+    for(zu64 i = 0; i < ids.size(); ++i)
+        LOG(ids[i].str());
+    return EXIT_SUCCESS;
+}
+
+int cmd_find(ZFile *file, ZArray<ZString> args){
+    ZParcel parcel;
+    parcel.setIndexes(ZParcel::INDEX_NAME);
+    auto err = openRead(parcel, file);
+    if(err != ZParcel::OK){
+        LOG("FAIL - " << ZParcel::errorStr(err));
+        return EXIT_FAILURE;
     }
 
+    ZArray<ZUID> ids;
+    err = parcel.findByName(args[0], ids);
+    if(err != ZParcel::OK){
+        LOG("FAIL - " << ZParcel::errorStr(err));
+        return EXIT_FAILURE;
+    }
+    for(zu64 i = 0; i < ids.size(); ++i)
+        LOG(ids[i].str());
+    return EXIT_SUCCESS;
+}
+
+int cmd_store(ZFile *file, ZArray<ZString> args){
+    ZUID uid = argNewUID(args[0]);
+    ZString stype = args[1];
+    ZString value = args[2];
+
+    if(uid == ZUID_NIL){
+        ELOG("FAIL - Invalid UUID");
+        return EXIT_FAILURE;
+    }
+
+    ZParcel parcel;
+    auto err = openWrite(parcel, file);
+    if(err != ZParcel::OK){
+        LOG("FAIL - " << ZParcel::errorStr(err));
+        return EXIT_FAILURE;
+    }
+
+    if(!nametotype.contains(stype)){
+        LOG("FAIL - Unknown type");
+        return EXIT_FAILURE;
+    }
+
+    auto type = nametotype[stype];
+    ZClock clock;
+    if(!storeValue(parcel, uid, type, value, &err))
+        return EXIT_FAILURE;
+    if(type == ZParcel::FILEOBJ)
+        LOG("Store Time: " << clock.getSecs() << " sec");
+
     if(err != ZParcel::OK){
         ELOG("FAIL - Failed to store: " << ZParcel::errorStr(err));
         return EXIT_FAILURE;
@@ -155,6 +279,91 @@ int cmd_store(ZFile *file, ZArray<ZString> args){
     return EXIT_SUCCESS;
 }
 
+int cmd_storedir(ZFile *file, ZArray<ZString> args){
+    ZParcel parcel;
+    auto err = openWrite(parcel, file);
+    if(err != ZParcel::OK){
+        LOG("FAIL - " << ZParcel::errorStr(err));
+        return EXIT_FAILURE;
+    }
+
+    ZClock clock;
+    ZArray<ZUID> ids;
+    ZArray<ZPath> paths;
+    ZArray<ZParcel::parcelerror> errors;
+    err = parcel.storeDirectory(args[0], ids, paths, &errors);
+    for(zu64 i = 0; i < errors.size(); ++i){
+        if(errors[i] == ZParcel::OK)
+            LOG("OK " << ids[i].str() << " " << paths[i]);
+        else
+            ELOG("FAIL - " << paths[i] << ": " << ZParcel::errorStr(errors[i]));
+    }
+    LOG("Stored " << ids.size() << " files in " << clock.getSecs() << " sec");
+
+    if(err != ZParcel::OK){
+        LOG("FAIL - " << ZParcel::errorStr(err));
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+int cmd_import(ZFile *file, ZArray<ZString> args){
+    ZBinary manifest;
+    if(!ZFile::readBinary(args[0], manifest)){
+        LOG("FAIL - Failed to read " << args[0]);
+        return EXIT_FAILURE;
+    }
+
+    ZParcelBuilder builder;
+    auto err = builder.create(file->path(), (ZParcel::parcelopt)(ZParcel::OPT_TAIL_EXTEND | ZParcel::OPT_CRC32C | ZParcel::OPT_DATA_CRC));
+    if(err != ZParcel::OK){
+        LOG("FAIL - " << ZParcel::errorStr(err));
+        return EXIT_FAILURE;
+    }
+
+    // One object per line: <id> <type> <value>, separated by tabs
+    ZClock clock;
+    auto lines = ZString(manifest.raw(), manifest.size()).explode('\n');
+    for(zu64 i = 0; i < lines.size(); ++i){
+        ZString line = lines[i];
+        if(line.size() && line[line.size() - 1] == '\r')
+            line = ZString(line.cc(), line.size() - 1);
+        if(line.size() == 0 || line[0] == '#')
+            continue;
+
+        auto fields = line.explode('\t');
+        if(fields.size() != 3){
+            LOG("FAIL - Line " << i + 1 << ": expected <id> <type> <value>");
+            return EXIT_FAILURE;
+        }
+        ZUID uid = argNewUID(fields[0]);
+        if(uid == ZUID_NIL){
+            LOG("FAIL - Line " << i + 1 << ": Invalid UUID");
+            return EXIT_FAILURE;
+        }
+        if(!nametotype.contains(fields[1])){
+            LOG("FAIL - Line " << i + 1 << ": Unknown type");
+            return EXIT_FAILURE;
+        }
+        if(!storeValue(builder, uid, nametotype[fields[1]], fields[2], &err))
+            return EXIT_FAILURE;
+        if(err != ZParcel::OK){
+            ELOG("FAIL - Line " << i + 1 << ": Failed to store: " << ZParcel::errorStr(err));
+            return EXIT_FAILURE;
+        }
+    }
+
+    zu64 count = builder.count();
+    err = builder.finish();
+    if(err != ZParcel::OK){
+        ELOG("FAIL - Failed to build: " << ZParcel::errorStr(err));
+        return EXIT_FAILURE;
+    }
+
+    LOG("OK - Import " << count << " objects in " << clock.getSecs() << " sec");
+    return EXIT_SUCCESS;
+}
+
 int cmd_fetch(ZFile *file, ZArray<ZString> args){
     ZUID uid = args[0];
     if(uid == ZUID_NIL){
@@ -163,7 +372,7 @@ int cmd_fetch(ZFile *file, ZArray<ZString> args){
     }
 
     ZParcel parcel;
-    auto err = parcel.open(file);
+    auto err = openRead(parcel, file);
     if(err != ZParcel::OK){
         LOG("FAIL - " << ZParcel::errorStr(err));
         return EXIT_FAILURE;
@@ -199,7 +408,11 @@ int cmd_fetch(ZFile *file, ZArray<ZString> args){
             break;
         case ZParcel::BLOBOBJ: {
             ZFile sout(ZFile::STDOUT);
-            sout.write(parcel.fetchBlob(uid));
+            err = parcel.fetchBlobTo(uid, sout);
+            if(err != ZParcel::OK){
+                ELOG("FAIL - " << ZParcel::errorStr(err));
+                return EXIT_FAILURE;
+            }
             break;
         }
         case ZParcel::FILEOBJ: {
@@ -213,30 +426,16 @@ int cmd_fetch(ZFile *file, ZArray<ZString> args){
                 return EXIT_FAILURE;
             }
 
-            ZFile ofile(path, ZFile::WRITE);
-            if(!ofile.isOpen()){
-                LOG("FAIL - Failed to open for output");
-                return EXIT_FAILURE;
-            }
-
             ZClock clock;
-            ZBinary blob = parcel.fetchBlob(did);
-            LOG("Read Time: " << clock.getSecs() << " sec");
+            err = parcel.fetchBlobTo(did, ZPath(path));
+            LOG("Fetch Time: " << clock.getSecs() << " sec");
 
-            if(ofile.write(blob) != blob.size()){
-                LOG("FAIL - Writing file failed");
+            if(err != ZParcel::OK){
+                LOG("FAIL - Writing file failed: " << ZParcel::errorStr(err));
                 return EXIT_FAILURE;
             }
 
             LOG("OK - " << path);
-
-//            ZBinary buff;
-//            while(!accessor->atEnd()){
-//                buff.resize(1 << 15);
-//                zu64 len = accessor->read(buff.raw(), buff.size());
-//                buff.resize(len);
-//                ZASSERT(ofile.write(buff), "write failed");
-//            }
             break;
         }
         default:
@@ -255,7 +454,7 @@ int cmd_show(ZFile *file, ZArray<ZString> args){
     }
 
     ZParcel parcel;
-    auto err = parcel.open(file);
+    auto err = openRead(parcel, file);
     if(err != ZParcel::OK){
         LOG("FAIL - " << ZParcel::errorStr(err));
         return EXIT_FAILURE;
@@ -338,7 +537,7 @@ int cmd_root(ZFile *file, ZArray<ZString> args){
     }
 
     ZParcel parcel;
-    auto err = parcel.open(file);
+    auto err = openWrite(parcel, file);
     if(err != ZParcel::OK){
         LOG("FAIL - " << ZParcel::errorStr(err));
         return EXIT_FAILURE;
@@ -366,7 +565,7 @@ int cmd_remove(ZFile *file, ZArray<ZString> args){
     }
 
     ZParcel parcel;
-    auto err = parcel.open(file);
+    auto err = openWrite(parcel, file);
     if(err != ZParcel::OK){
         LOG("FAIL - " << ZParcel::errorStr(err));
         return EXIT_FAILURE;
@@ -382,9 +581,612 @@ int cmd_remove(ZFile *file, ZArray<ZString> args){
     return EXIT_SUCCESS;
 }
 
+int cmd_verify(ZFile *file, ZArray<ZString> args){
+    ZParcel parcel;
+    auto err = openRead(parcel, file);
+    if(err != ZParcel::OK){
+        LOG("FAIL - " << ZParcel::errorStr(err));
+        return EXIT_FAILURE;
+    }
+
+    ZClock clock;
+    ZParcel::VerifyReport report;
+    err = parcel.verify(&report);
+
+    for(zu64 i = 0; i < report.errors.size(); ++i){
+        const ZParcel::VerifyError &verr = report.errors[i];
+        LOG("0x" << ZString::ItoS(verr.offset, 16) << " " << (verr.id == ZUID_NIL ? ZString("-") : verr.id.str()) << " " << ZParcel::errorStr(verr.err));
+    }
+    LOG(report.objects << " objects, " << report.nodes << " index nodes, " << report.freenodes << " free nodes, " <<
+        report.payloads << " data nodes (" << report.bytes << " bytes) in " << clock.getSecs() << " sec");
+
+    if(err != ZParcel::OK){
+        LOG("FAIL - " << report.errors.size() << " errors");
+        return EXIT_FAILURE;
+    }
+    LOG("OK");
+    return EXIT_SUCCESS;
+}
+
+int cmd_compact(ZFile *file, ZArray<ZString> args){
+    ZParcel parcel;
+    auto err = openWrite(parcel, file);
+    if(err != ZParcel::OK){
+        LOG("FAIL - " << ZParcel::errorStr(err));
+        return EXIT_FAILURE;
+    }
+
+    ZClock clock;
+    ZParcel::CompactReport report;
+    err = parcel.compact(&report);
+    if(err != ZParcel::OK){
+        LOG("FAIL - " << ZParcel::errorStr(err));
+        return EXIT_FAILURE;
+    }
+
+    LOG(report.objects << " objects, " << report.removed << " removed nodes dropped, " << report.moved << " data nodes moved (" <<
+        report.bytes << " bytes), " << report.oldsize << " -> " << report.newsize << " bytes in " << clock.getSecs() << " sec");
+    LOG("OK");
+    return EXIT_SUCCESS;
+}
+
+int cmd_pack(ZFile *file, ZArray<ZString> args){
+    ZParcel parcel;
+    auto err = openRead(parcel, file);
+    if(err != ZParcel::OK){
+        LOG("FAIL - " << ZParcel::errorStr(err));
+        return EXIT_FAILURE;
+    }
+
+    ZClock clock;
+    err = parcel.pack(args[0]);
+    if(err != ZParcel::OK){
+        LOG("FAIL - " << ZParcel::errorStr(err));
+        return EXIT_FAILURE;
+    }
+    LOG("OK - Pack " << args[0] << " in " << clock.getSecs() << " sec");
+    return EXIT_SUCCESS;
+}
+
+int cmd_stats(ZFile *file, ZArray<ZString> args){
+    // Free space is only loaded for writing
+    ZParcel parcel;
+    auto err = openWrite(parcel, file);
+    if(err != ZParcel::OK){
+        LOG("FAIL - " << ZParcel::errorStr(err));
+        return EXIT_FAILURE;
+    }
+
+    ZParcel::ShapeReport shape;
+    err = parcel.shape(&shape);
+    if(err != ZParcel::OK){
+        LOG("FAIL - " << ZParcel::errorStr(err));
+        return EXIT_FAILURE;
+    }
+    LOG(shape.objects << " objects, " << shape.nodes << " index nodes, height " << shape.height << ", mean depth " <<
+        shape.depth << ", balance " << shape.balance << (shape.fill > 0 ? ", page fill " + ZString::ItoS((zu64)(shape.fill * 100)) + "%" : ZString()));
+    LOG(shape.freenodes << " free nodes, " << shape.freebytes << " of " << shape.size << " bytes free, largest " <<
+        shape.freemax << ", fragmentation " << shape.fragmentation);
+
+    // Look up every object once with a cold cache, so the counters show what a lookup costs
+    ZArray<ZUID> ids;
+    ZParcel::Scan scan = parcel.scan();
+    ZParcel::ScanEntry entry;
+    while(scan.next(entry))
+        ids.push(entry.id);
+    if(scan.error() != ZParcel::OK){
+        LOG("FAIL - " << ZParcel::errorStr(scan.error()));
+        return EXIT_FAILURE;
+    }
+    parcel.resetStats();
+    ZClock clock;
+    for(zu64 i = 0; i < ids.size(); ++i)
+        parcel.getType(ids[i]);
+    const double secs = clock.getSecs();
+
+    const ZParcel::Stats st = parcel.stats();
+    LOG(ids.size() << " lookups in " << secs << " sec, " << st.lookups << " searched the index, visiting " <<
+        (st.lookups ? (double)st.depth / st.lookups : 0) << " nodes each");
+    for(zu64 d = 0; d < ZParcel::STATS_DEPTHS; ++d){
+        if(st.depths[d])
+            LOG("  depth " << d << (d == ZParcel::STATS_DEPTHS - 1 ? "+" : "") << ": " << st.depths[d]);
+    }
+    const zu64 cached = st.cachehits + st.cachemisses;
+    LOG(st.nodereads << " index nodes read from the file, " << st.poolhits << " from the node pool, cache hit rate " <<
+        (cached ? (double)st.cachehits / cached : 0));
+    LOG(st.reads << " reads (" << st.readbytes << " bytes), " << st.writes << " writes (" << st.writebytes << " bytes), " <<
+        st.crcs << " checksums (" << st.crcbytes << " bytes) in " << (st.crcnsec / 1e9) << " sec");
+    LOG("OK");
+    return EXIT_SUCCESS;
+}
+
+/*! Round trip random, repetitive and low-entropy data through the payload codec, and decode
+ *  truncated and corrupt blocks and blocks into short buffers, which must fail inside the buffer.
+ */
+bool testCodec(){
+    // Bytes past the output buffer, which decoding must not touch
+    const zu64 guard = 64;
+    std::mt19937 rng(15);
+    const zu64 sizes[] = { 0, 1, 5, 12, 13, 100, 4096, 65535, 65536, 70000 };
+    for(zu64 kind = 0; kind < 4; ++kind){
+        for(zu64 size : sizes){
+            ZBinary data(size);
+            for(zu64 i = 0; i < size; ++i){
+                switch(kind){
+                    case 0: data[i] = (zbyte)rng(); break;              // Incompressible
+                    case 1: data[i] = (zbyte)("zparcel "[i % 8]); break; // Repetitive
+                    case 2: data[i] = (zbyte)(rng() % 3); break;        // Low entropy
+                    default: data[i] = (zbyte)(i / 1000); break;        // Long runs
+                }
+            }
+
+            ZBinary comp(ZParcelCodec::bound(size));
+            const zu64 clen = ZParcelCodec::compress(data.raw(), size, comp.raw());
+            if(clen > comp.size()){
+                ELOG("FAIL codec bound " << kind << " " << size);
+                return false;
+            }
+
+            // Decode into a buffer of \a dsize bytes followed by the guard
+            ZBinary out(size + guard);
+            auto decode = [&](const zbyte *src, zu64 len, zu64 dsize, bool *guarded){
+                memset(out.raw(), 0xa5, out.size());
+                const zu64 n = ZParcelCodec::decompress(src, len, out.raw(), dsize);
+                *guarded = true;
+                for(zu64 i = dsize; i < dsize + guard; ++i)
+                    *guarded = *guarded && (out[i] == 0xa5);
+                return n;
+            };
+            bool guarded;
+
+            if(decode(comp.raw(), clen, size, &guarded) != size || (size && memcmp(out.raw(), data.raw(), size)) || !guarded){
+                ELOG("FAIL codec round trip " << kind << " " << size);
+                return false;
+            }
+            if(size && (decode(comp.raw(), clen, size - 1, &guarded) != ZU64_MAX || !guarded)){
+                ELOG("FAIL codec short buffer " << kind << " " << size);
+                return false;
+            }
+            for(zu64 cut = 1; cut <= MIN(clen, (zu64)16); ++cut){
+                const zu64 n = decode(comp.raw(), clen - cut, size, &guarded);
+                if((size && n != ZU64_MAX && n >= size) || !guarded){
+                    ELOG("FAIL codec truncated " << kind << " " << size << " " << cut);
+                    return false;
+                }
+            }
+            for(zu64 r = 0; clen && r < 32; ++r){
+                ZBinary bad(comp.raw(), clen);
+                bad[rng() % clen] ^= (zbyte)(1 + rng() % 255);
+                const zu64 n = decode(bad.raw(), clen, size, &guarded);
+                if((n != ZU64_MAX && n > size) || !guarded){
+                    ELOG("FAIL codec corrupt " << kind << " " << size);
+                    return false;
+                }
+            }
+        }
+    }
+    LOG("OK codec");
+    return true;
+}
+
+//! Write \a data to a new file at \a path.
+bool writeBinary(ZPath path, const ZBinary &data){
+    ZFile out(path, ZFile::WRITE);
+    return (out.isOpen() && out.write(data.raw(), data.size()) == data.size());
+}
+
+/*! Store objects in a journaled parcel at \a path, and keep its file and journal as they were
+ *  before and after the last store. Then open the earlier parcel with the later journal cut short,
+ *  corrupted and followed by garbage, which must replay every whole record and nothing after it.
+ */
+bool testJournal(ZPath path){
+    const ZPath wal = path.str() + ".wal";
+    const zu64 count = 20;
+    ZArray<ZUID> ids;
+    ZBinary base;
+    ZBinary log;
+    zu64 logsize;
+    {
+        ZParcel parcel;
+        auto err = parcel.create(path, (ZParcel::parcelopt)(ZParcel::OPT_TAIL_EXTEND | ZParcel::OPT_JOURNAL));
+        for(zu64 i = 0; err == ZParcel::OK && i <= count; ++i){
+            if(i == count){
+                // Records stay in the journal until it is checkpointed
+                if(!ZFile::readBinary(path, base) || !ZFile::readBinary(wal, log)){
+                    ELOG("FAIL journal copy");
+                    return false;
+                }
+                logsize = log.size();
+            }
+            ids.push(ZUID(ZUID::RANDOM));
+            err = parcel.storeUint(ids[i], i);
+        }
+        if(err != ZParcel::OK || !ZFile::readBinary(wal, log) || log.size() <= logsize){
+            ELOG("FAIL journal store " << ZParcel::errorStr(err));
+            return false;
+        }
+    }
+
+    // Journal contents, and whether the last store is replayed from them
+    struct Replay {
+        ZBinary journal;
+        bool last;
+    };
+    const zu64 rsize = log.size() - logsize;
+    ZArray<Replay> replays;
+    replays.push({ log, true });
+    for(zu64 cut : { (zu64)0, (zu64)1, rsize / 2, rsize - 1 })
+        replays.push({ ZBinary(log.raw(), logsize + cut), false });
+    ZBinary bad(log.raw(), log.size());
+    bad[logsize + rsize / 2] ^= 0x10;
+    replays.push({ bad, false });
+    std::mt19937 rng(25);
+    for(zu64 i = logsize; i < bad.size(); ++i)
+        bad[i] = (zbyte)rng();
+    replays.push({ bad, false });
+
+    for(zu64 j = 0; j < replays.size(); ++j){
+        const Replay &rep = replays[j];
+        if(!writeBinary(path, base) || !writeBinary(wal, rep.journal)){
+            ELOG("FAIL journal write");
+            return false;
+        }
+        ZParcel parcel;
+        auto err = parcel.open(path);
+        if(err != ZParcel::OK){
+            ELOG("FAIL journal replay " << j << ": " << ZParcel::errorStr(err));
+            return false;
+        }
+        for(zu64 i = 0; i < count; ++i){
+            if(parcel.fetchUint(ids[i]) != i){
+                ELOG("FAIL journal replay " << j << " lost " << ids[i].str());
+                return false;
+            }
+        }
+        if(parcel.exists(ids[count]) != rep.last || (rep.last && parcel.fetchUint(ids[count]) != count)){
+            ELOG("FAIL journal replay " << j << " last record");
+            return false;
+        }
+        ZParcel::VerifyReport report;
+        err = parcel.verify(&report);
+        if(err != ZParcel::OK){
+            ELOG("FAIL journal replay " << j << " verify: " << ZParcel::errorStr(err));
+            return false;
+        }
+    }
+    LOG("OK journal replay");
+    return true;
+}
+
+/*! Store, update, append to, remove, compact, reopen and pack objects in a new parcel at \a path,
+ *  checking every object and verifying the parcel after each step.
+ */
+bool testParcel(ZPath path, ZParcel::parceltype version, ZParcel::parcelopt opt){
+    const ZString name = ZString(version == ZParcel::VERSION1 ? "v1" : "v2") + " opt " + ZString::ItoS((zu64)opt);
+    std::mt19937 rng(29);
+    auto random = [&rng](zu64 size){
+        ZBinary data(size);
+        for(zu64 i = 0; i < size; ++i)
+            data[i] = (zbyte)rng();
+        return data;
+    };
+
+    struct Object {
+        ZUID id;
+        ZBinary blob;
+        bool live;
+    };
+    ZArray<Object> objs;
+    ZArray<Object> files;
+    ZArray<Object> streams;
+    ZUID listid(ZUID::RANDOM);
+    ZArray<ZUID> list;
+
+    auto fail = [&name](const char *step, ZString what){
+        ELOG("FAIL parcel " << name << " " << step << ": " << what);
+        return false;
+    };
+    auto check = [&](ZParcel &parcel, const char *step){
+        for(zu64 i = 0; i < objs.size(); ++i){
+            const Object &obj = objs[i];
+            if(parcel.exists(obj.id) != obj.live)
+                return fail(step, obj.id.str() + (obj.live ? " lost" : " not removed"));
+            if(!obj.live)
+                continue;
+            const ZBinary blob = parcel.fetchBlob(obj.id);
+            if(blob.size() != obj.blob.size() || (blob.size() && memcmp(blob.raw(), obj.blob.raw(), blob.size())))
+                return fail(step, obj.id.str() + " bad data");
+        }
+        for(zu64 i = 0; i < files.size(); ++i){
+            ZUID nameid;
+            ZUID dataid;
+            if(parcel.fetchFile(files[i].id, nameid, dataid) != ZParcel::OK)
+                return fail(step, files[i].id.str() + " file lost");
+            const ZBinary blob = parcel.fetchBlob(dataid);
+            if(blob.size() != files[i].blob.size() || (blob.size() && memcmp(blob.raw(), files[i].blob.raw(), blob.size())))
+                return fail(step, files[i].id.str() + " bad file data");
+        }
+        // Streamed to a writer and to a file
+        const ZPath out = path.str() + ".out";
+        for(zu64 i = 0; i < streams.size(); ++i){
+            const ZBinary &want = streams[i].blob;
+            ZBinary blob;
+            auto err = parcel.fetchBlobTo(streams[i].id, blob);
+            if(err != ZParcel::OK || blob.size() != want.size() || (blob.size() && memcmp(blob.raw(), want.raw(), blob.size())))
+                return fail(step, streams[i].id.str() + " bad streamed data");
+            blob.clear();
+            err = parcel.fetchBlobTo(streams[i].id, out);
+            if(err != ZParcel::OK || !ZFile::readBinary(out, blob) || blob.size() != want.size() ||
+               (blob.size() && memcmp(blob.raw(), want.raw(), blob.size())))
+                return fail(step, streams[i].id.str() + " bad streamed file");
+        }
+        ZList<ZUID> children = parcel.fetchList(listid);
+        zu64 n = 0;
+        for(auto it = children.begin(); it.more(); ++it, ++n){
+            if(n >= list.size() || it.get().compare(list[n]) != 0)
+                return fail(step, "bad list");
+        }
+        if(n != list.size())
+            return fail(step, "bad list size");
+        ZParcel::VerifyReport report;
+        auto err = parcel.verify(&report);
+        if(err != ZParcel::OK)
+            return fail(step, ZString("verify ") + ZParcel::errorStr(err));
+        return true;
+    };
+    // Data node of \a id, or a zero size if it has none
+    auto node = [](ZParcel &parcel, ZUID id){
+        ZParcel::Scan scan = parcel.scan();
+        ZParcel::ScanEntry entry;
+        while(scan.next(entry)){
+            if(entry.id == id)
+                return entry;
+        }
+        entry.offset = ZU64_MAX;
+        entry.size = 0;
+        return entry;
+    };
+    auto store = [&](ZParcel &parcel, const ZBinary &blob){
+        Object obj = { ZUID(ZUID::RANDOM), blob, true };
+        objs.push(obj);
+        return parcel.storeBlob(obj.id, blob);
+    };
+
+    ZParcel parcel;
+    auto err = parcel.create(path, (ZParcel::parcelopt)(ZParcel::OPT_TAIL_EXTEND | opt), version);
+    if(err != ZParcel::OK)
+        return fail("create", ZParcel::errorStr(err));
+
+    // Freed neighbors coalesce, whichever is freed last
+    for(zu64 i = 0; err == ZParcel::OK && i < 4; ++i)
+        err = store(parcel, random(3000));
+    if(err != ZParcel::OK)
+        return fail("store", ZParcel::errorStr(err));
+    // The first data node follows the initial index, the rest are appended at the tail
+    const ZParcel::ScanEntry first = node(parcel, objs[1].id);
+    const ZParcel::ScanEntry second = node(parcel, objs[2].id);
+    const ZParcel::ScanEntry third = node(parcel, objs[3].id);
+    if(first.offset + first.size != second.offset || second.offset + second.size != third.offset)
+        return fail("coalesce", "data nodes not adjacent");
+    const zu64 span = third.offset + third.size - first.offset;
+    for(zu64 i : { 1, 3, 2 }){
+        objs[i].live = false;
+        err = parcel.removeObject(objs[i].id);
+        if(err != ZParcel::OK)
+            return fail("coalesce", ZParcel::errorStr(err));
+    }
+    ZParcel::ShapeReport shape;
+    err = parcel.shape(&shape);
+    if(err != ZParcel::OK || shape.freemax < span)
+        return fail("coalesce", ZString::ItoS(shape.freemax) + " free of " + ZString::ItoS(span));
+
+    // Small and large blobs, and a list
+    for(zu64 i = 0; err == ZParcel::OK && i < 200; ++i)
+        err = store(parcel, random(i % 10 == 0 ? 20000 + rng() % 50000 : rng() % 3000));
+    for(zu64 i = 0; i < 3; ++i)
+        list.push(ZUID(ZUID::RANDOM));
+    ZList<ZUID> children;
+    for(zu64 i = 0; i < list.size(); ++i)
+        children.push(list[i]);
+    if(err == ZParcel::OK)
+        err = parcel.storeList(listid, children);
+    if(err != ZParcel::OK)
+        return fail("store", ZParcel::errorStr(err));
+    if(!check(parcel, "store"))
+        return false;
+
+    // Smaller data is written over the data node, larger data moves
+    err = store(parcel, random(2000));
+    const zu64 before = node(parcel, objs.back().id).offset;
+    objs.back().blob = random(1600);
+    if(err == ZParcel::OK)
+        err = parcel.updateBlob(objs.back().id, objs.back().blob);
+    if(err != ZParcel::OK || node(parcel, objs.back().id).offset != before)
+        return fail("update", "not in place");
+    objs[10].blob = random(40000);
+    err = parcel.updateBlob(objs[10].id, objs[10].blob);
+    if(err != ZParcel::OK)
+        return fail("update", ZParcel::errorStr(err));
+    if(!check(parcel, "update"))
+        return false;
+
+    // One child at a time, then several, each resealing the list in OPT_DATA_CRC parcels
+    for(zu64 i = 0; err == ZParcel::OK && i < 40; ++i){
+        ZList<ZUID> more;
+        for(zu64 j = 0; j < (i % 8 == 7 ? 5 : 1); ++j){
+            more.push(ZUID(ZUID::RANDOM));
+            list.push(more[j]);
+        }
+        err = parcel.appendList(listid, more);
+    }
+    if(err != ZParcel::OK)
+        return fail("append", ZParcel::errorStr(err));
+    if(!check(parcel, "append"))
+        return false;
+
+    ZBinary text;
+    for(zu64 i = 0; i < 2000; ++i)
+        text.write(ZString("zparcel test file text ") + ZString::ItoS(i % 10) + "\n");
+
+    // Blobs in the index entry, compressed, and longer than one copy chunk
+    ZBinary longer = random(5 << 19);
+    const ZBinary streamed[] = { random(4), text, longer };
+    for(zu64 i = 0; err == ZParcel::OK && i < 3; ++i){
+        Object obj = { ZUID(ZUID::RANDOM), streamed[i], true };
+        streams.push(obj);
+        err = parcel.storeBlob(obj.id, obj.blob);
+    }
+    if(err != ZParcel::OK)
+        return fail("stream", ZParcel::errorStr(err));
+    // Only VERSION2 inlines and compresses data
+    const bool compress = (version == ZParcel::VERSION2 && (opt & ZParcel::OPT_COMPRESS));
+    if((version == ZParcel::VERSION2) != (node(parcel, streams[0].id).offset == ZU64_MAX) ||
+       compress != node(parcel, streams[1].id).compressed)
+        return fail("stream", "not stored as expected");
+    if(!check(parcel, "stream"))
+        return false;
+
+    // A directory of random, compressible, empty and duplicate files, stored on the I/O threads
+    const ZString dir = path.str() + ".dir";
+    const ZBinary dup = random(200000);
+    const ZBinary contents[] = { dup, text, ZBinary(), dup, random(500) };
+    const ZString names[] = { "/a.bin", "/b.txt", "/c.bin", "/sub/d.bin", "/sub/e.bin" };
+#if defined(__unix__) || defined(__APPLE__)
+    ::mkdir(dir.cc(), 0755);
+    ::mkdir((dir + "/sub").cc(), 0755);
+#endif
+    for(zu64 i = 0; i < 5; ++i){
+        if(!writeBinary(dir + names[i], contents[i]))
+            return fail("files", "write " + dir + names[i]);
+    }
+    ZArray<ZUID> fileids;
+    ZArray<ZPath> filepaths;
+    ZArray<ZParcel::parcelerror> errors;
+    err = parcel.storeDirectory(dir, fileids, filepaths, &errors);
+    if(err != ZParcel::OK)
+        return fail("files", ZParcel::errorStr(err));
+    if(fileids.size() != 5 || errors.size() != 5)
+        return fail("files", ZString::ItoS(fileids.size()) + " files stored");
+    // Walked in name order
+    for(zu64 i = 0; i < 5; ++i){
+        Object file = { fileids[i], contents[i], true };
+        files.push(file);
+    }
+    if(!check(parcel, "files"))
+        return false;
+    ZUID nameid;
+    ZUID dataid;
+    ZUID dupid;
+    parcel.fetchFile(files[0].id, nameid, dataid);
+    parcel.fetchFile(files[3].id, nameid, dupid);
+    if(((opt & ZParcel::OPT_DEDUP) != 0) != (node(parcel, dataid).offset == node(parcel, dupid).offset))
+        return fail("files", "duplicate files");
+
+    // A taken id and a missing file store nothing, while the rest of the files are stored
+    ZArray<ZUID> moreids = { files[0].id, ZUID(ZUID::RANDOM), ZUID(ZUID::RANDOM) };
+    ZArray<ZPath> morepaths = { dir + names[4], dir + "/missing", dir + names[1] };
+    err = parcel.storeFiles(moreids, morepaths, &errors);
+    if(err != ZParcel::ERR_EXISTS || errors.size() != 3 ||
+       errors[0] != ZParcel::ERR_EXISTS || errors[1] != ZParcel::ERR_OPEN || errors[2] != ZParcel::OK)
+        return fail("files", ZString("errors ") + ZParcel::errorStr(err));
+    if(parcel.exists(moreids[1]))
+        return fail("files", "missing file stored");
+    Object more = { moreids[2], text, true };
+    files.push(more);
+    // The failed id can be used again
+    err = parcel.storeFile(moreids[1], dir + names[4]);
+    if(err != ZParcel::OK)
+        return fail("files", ZParcel::errorStr(err));
+    Object retry = { moreids[1], contents[4], true };
+    files.push(retry);
+    if(!check(parcel, "files"))
+        return false;
+
+    if(opt & ZParcel::OPT_DEDUP){
+        // Shared data nodes are freed with the last object using them
+        const ZBinary shared = random(5000);
+        for(zu64 i = 0; err == ZParcel::OK && i < 3; ++i)
+            err = store(parcel, shared);
+        const zu64 n = objs.size();
+        const zu64 offset = node(parcel, objs[n - 1].id).offset;
+        if(err != ZParcel::OK || node(parcel, objs[n - 3].id).offset != offset || node(parcel, objs[n - 2].id).offset != offset)
+            return fail("dedup", "not shared");
+        for(zu64 i = n - 3; err == ZParcel::OK && i < n - 1; ++i){
+            objs[i].live = false;
+            err = parcel.removeObject(objs[i].id);
+        }
+        if(err == ZParcel::OK)
+            err = store(parcel, shared);
+        if(err != ZParcel::OK || node(parcel, objs.back().id).offset != offset)
+            return fail("dedup", "shared node freed early");
+        if(!check(parcel, "dedup"))
+            return false;
+    }
+
+    // Every third object
+    for(zu64 i = 3; err == ZParcel::OK && i < objs.size(); i += 3){
+        if(objs[i].live){
+            objs[i].live = false;
+            err = parcel.removeObject(objs[i].id);
+        }
+    }
+    if(err != ZParcel::OK)
+        return fail("remove", ZParcel::errorStr(err));
+    if(!check(parcel, "remove"))
+        return false;
+
+    ZParcel::CompactReport report;
+    err = parcel.compact(&report);
+    if(err != ZParcel::OK)
+        return fail("compact", ZParcel::errorStr(err));
+    if(report.newsize >= report.oldsize)
+        return fail("compact", "no space freed");
+    if(!check(parcel, "compact"))
+        return false;
+
+    parcel.close();
+    err = parcel.open(path);
+    if(err != ZParcel::OK)
+        return fail("reopen", ZParcel::errorStr(err));
+    if(!check(parcel, "reopen"))
+        return false;
+
+    const ZPath packpath = path.str() + ".pack";
+    err = parcel.pack(packpath);
+    if(err != ZParcel::OK)
+        return fail("pack", ZParcel::errorStr(err));
+    if(parcel.pack(path) != ZParcel::ERR_OPEN)
+        return fail("pack", "packed over itself");
+    ZParcel packed;
+    err = packed.openMapped(packpath);
+    if(err != ZParcel::OK)
+        return fail("pack", ZParcel::errorStr(err));
+    if(!check(packed, "pack"))
+        return false;
+
+    LOG("OK parcel " << name);
+    return true;
+}
+
 int cmd_test(ZFile *file, ZArray<ZString> args){
+    if(!testCodec())
+        return EXIT_FAILURE;
+    if(!testJournal(file->path().str() + ".journal"))
+        return EXIT_FAILURE;
+    const ZParcel::parcelopt opts[] = {
+        (ZParcel::parcelopt)(ZParcel::OPT_CRC32C | ZParcel::OPT_DATA_CRC),
+        (ZParcel::parcelopt)(ZParcel::OPT_SIZE_CLASSES | ZParcel::OPT_DEDUP | ZParcel::OPT_DATA_CRC),
+        (ZParcel::parcelopt)(ZParcel::OPT_COMPRESS | ZParcel::OPT_JOURNAL),
+    };
+    for(ZParcel::parceltype version : { ZParcel::VERSION1, ZParcel::VERSION2 }){
+        for(ZParcel::parcelopt opt : opts){
+            if(!testParcel(file->path().str() + "." + ZString::ItoS((zu64)version) + "." + ZString::ItoS((zu64)opt), version, opt))
+                return EXIT_FAILURE;
+        }
+    }
+
     ZParcel parcel;
-    auto err = parcel.create(file, ZParcel::OPT_TAIL_EXTEND);
+    auto err = parcel.create(file, (ZParcel::parcelopt)(ZParcel::OPT_TAIL_EXTEND | ZParcel::OPT_CRC32C | ZParcel::OPT_DATA_CRC));
     if(err != ZParcel::OK){
         ELOG("Failed to open: " << ZParcel::errorStr(err));
         return EXIT_FAILURE;
@@ -409,6 +1211,33 @@ int cmd_test(ZFile *file, ZArray<ZString> args){
         LOG(it.get().str() << " " << parcel.fetchString(it.get()));
     }
 
+    // Time-ordered ids arrive sorted, stored in one batch
+    ZList<ZUID> tids;
+    parcel.beginBatch();
+    for(zu64 i = 0; i < 1000; ++i){
+        ZUID id(ZUID::TIME);
+        tids.push(id);
+        err = parcel.storeUint(id, i);
+        if(err != ZParcel::OK){
+            ELOG("FAIL " << ZParcel::errorStr(err));
+            return EXIT_FAILURE;
+        }
+    }
+    err = parcel.commitBatch();
+    if(err != ZParcel::OK){
+        ELOG("FAIL " << ZParcel::errorStr(err));
+        return EXIT_FAILURE;
+    }
+
+    zu64 i = 0;
+    for(auto it = tids.begin(); it.more(); ++it, ++i){
+        if(parcel.fetchUint(it.get()) != i){
+            ELOG("FAIL " << it.get().str() << " bad value");
+            return EXIT_FAILURE;
+        }
+    }
+    LOG("OK " << tids.size() << " time-ordered objects");
+
 //    parcel.listObjects();
 
     return EXIT_SUCCESS;
@@ -426,13 +1255,21 @@ struct CmdEntry {
 };
 
 const ZMap<ZString, CmdEntry> cmds = {
-    { "create", { cmd_create,   0, true,  "zparcel <file> create" } },
-    { "list",   { cmd_list,     0, true,  "zparcel <file> list" } },
+    { "create", { cmd_create,   5, false, "zparcel <file> create [version] [classes] [compress] [dedup] [journal]" } },
+    { "list",   { cmd_list,     2, false, "zparcel <file> list [from] [to]" } },
+    { "list-type", { cmd_listtype, 1, true, "zparcel <file> list-type <type>" } },
+    { "find",   { cmd_find,     1, true,  "zparcel <file> find <name>" } },
     { "store",  { cmd_store,    3, true,  "zparcel <file> store <id> <type> <value>" } },
+    { "store-dir", { cmd_storedir, 1, true, "zparcel <file> store-dir <dir>" } },
+    { "import", { cmd_import,   1, true,  "zparcel <file> import <manifest>" } },
     { "fetch",  { cmd_fetch,    1, true,  "zparcel <file> fetch <id>" } },
     { "show",   { cmd_show,     1, true,  "zparcel <file> show <id>" } },
     { "remove", { cmd_remove,   1, true,  "zparcel <file> remove <id>" } },
     { "root",   { cmd_root,     0, false, "zparcel <file> root [id]" } },
+    { "verify", { cmd_verify,   0, true,  "zparcel <file> verify" } },
+    { "compact", { cmd_compact, 0, true,  "zparcel <file> compact" } },
+    { "pack",   { cmd_pack,     1, true,  "zparcel <file> pack <out>" } },
+    { "stats",  { cmd_stats,    0, true,  "zparcel <file> stats" } },
     { "test",   { cmd_test,     0, true,  "zparcel <file> test" } },
 };
 
@@ -13,6 +13,7 @@
 #include "zlog.h"
 
 #include "zparcel.h"
+#include "zparcelbuilder.h"
 
 #include <cstdlib>
 
@@ -4,20 +4,94 @@
 **                          See COPYRIGHT and LICENSE                         **
 *******************************************************************************/
 #include "zparcel.h"
+#include "zparcelcodec.h"
+#include "zparcelchecksum.h"
 #include "zmap.h"
 #include "zlog.h"
 #include "zerror.h"
 
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+    #define ZPARCEL_POSIX 1
+    #include <fcntl.h>
+    #include <unistd.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <dirent.h>
+#endif
+#if defined(__linux__)
+    #include <sys/sendfile.h>
+#endif
+
 static LibChaos::zu32 ZPARCEL_MAGIC         = 0x5a504152;
 static LibChaos::zu32 ZPARCEL_TREE_MAGIC    = 0x54524545;
 static LibChaos::zu32 ZPARCEL_FREE_MAGIC    = 0x66726565;
 static LibChaos::zu32 ZPARCEL_OBJT_MAGIC    = 0x4f424a54;
+static LibChaos::zu32 ZPARCEL_PAGE_MAGIC    = 0x50414745;
+static LibChaos::zu32 ZPARCEL_BINS_MAGIC    = 0x42494e53;
+static LibChaos::zu32 ZPARCEL_BNOD_MAGIC    = 0x6662696e;
+static LibChaos::zu32 ZPARCEL_WAL_MAGIC     = 0x57414c52;
+static LibChaos::zu32 ZPARCEL_PACK_MAGIC    = 0x5041434b;
 
 #define ZPARCEL_SIG "ZPARCEL"
 #define ZPARCEL_SIG_LEN 7
 
 #define ZPARCEL_MAX_DEPTH 128
 #define ZPARCEL_INIT_PAD 4096
+#define ZPARCEL_COPY_CHUNK (1 << 20)
+//! Writes at least this large bypass the batch buffer, unless the parcel is journaled.
+#define ZPARCEL_BATCH_DIRECT (1 << 14)
+//! Default object info cache limit.
+#define ZPARCEL_CACHE_ENTRIES (1 << 16)
+//! Default number of tree levels kept in the node pool.
+#define ZPARCEL_POOL_LEVELS 8
+//! Payload reads in fetchMany() separated by at most this much are merged.
+#define ZPARCEL_MERGE_GAP (1 << 12)
+//! Leaf pages read ahead together by a scan.
+#define ZPARCEL_SCAN_PAGES 16
+//! Objects read at a time by a scan of a VERSION1 parcel.
+#define ZPARCEL_SCAN_BATCH 4096
+//! List children read at a time by a list reader, or by fetchList().
+#define ZPARCEL_LIST_CHUNK 4096
+//! Number of I/O threads, and so the number of reads kept in flight.
+#define ZPARCEL_IO_THREADS 16
+//! Compressed payloads are split in independent chunks of this much data.
+#define ZPARCEL_COMPRESS_CHUNK (1 << 16)
+//! Default compression policy.
+#define ZPARCEL_COMPRESS_PCT 90
+#define ZPARCEL_COMPRESS_MIN 256
+//! Chunk header bit for data stored uncompressed.
+#define ZPARCEL_CHUNK_RAW 0x80000000
+//! Journal file name suffix.
+#define ZPARCEL_WAL_SUFFIX ".wal"
+//! Suffix of the file pack() writes before renaming it over its path.
+#define ZPARCEL_TMP_SUFFIX ".tmp"
+//! The journal is emptied once it grows past this much and every record is applied.
+#define ZPARCEL_WAL_CHECKPOINT (1 << 26)
+//! Alignment of the packed id table head, and its distance to the first entry.
+#define ZPARCEL_PACK_ALIGN 64
+//! Shards of the hot path counters, threads are spread over them.
+#define ZPARCEL_STATS_SHARDS 16
 
 #define CHECK_COMMON(STR) if(_state != OPEN){ \
     throw ZException(ZString(STR) + ": parcel not open"); \
@@ -30,10 +104,1032 @@ static LibChaos::zu32 ZPARCEL_OBJT_MAGIC    = 0x4f424a54;
     } \
 }
 
+#define CHECK_WRITE if(_readonly){ \
+    return ERR_READONLY; \
+}
+
 #define HEX(A) (ZString("0x") + ZString::ItoS((zu64)(A), 16))
 
 namespace LibChaos {
 
+struct ZParcel::PagePath {
+    zu16 depth;
+    zu64 page[ZPARCEL_MAX_DEPTH];
+    zu16 index[ZPARCEL_MAX_DEPTH];
+};
+
+struct ZParcel::ParcelInfoCache {
+    struct Hash {
+        size_t operator()(const ZUID &id) const {
+            return (size_t)(ZBinary::decbeu64(id.raw()) ^ (ZBinary::decbeu64(id.raw() + 8) * 0x9e3779b97f4a7c15ULL));
+        }
+    };
+    struct Equal {
+        bool operator()(const ZUID &a, const ZUID &b) const {
+            return (a.compare(b) == 0);
+        }
+    };
+    typedef std::list<std::pair<ZUID, ObjectInfo>> LRUList;
+
+    //! Approximate memory used by one entry, with list and table overhead.
+    static const zu64 ENTRY_SIZE = sizeof(LRUList::value_type) + 6 * sizeof(void *);
+
+    ParcelInfoCache() : maxentries(ZPARCEL_CACHE_ENTRIES), maxbytes(0), hits(0), misses(0), evictions(0){}
+
+    bool get(const ZUID &id, ObjectInfo *info){
+        std::lock_guard<std::mutex> guard(mutex);
+        auto it = table.find(id);
+        if(it == table.end()){
+            ++misses;
+            return false;
+        }
+        // Move to front
+        lru.splice(lru.begin(), lru, it->second);
+        *info = it->second->second;
+        ++hits;
+        return true;
+    }
+    void put(const ZUID &id, const ObjectInfo &info){
+        std::lock_guard<std::mutex> guard(mutex);
+        auto it = table.find(id);
+        if(it != table.end()){
+            it->second->second = info;
+            lru.splice(lru.begin(), lru, it->second);
+            return;
+        }
+        lru.emplace_front(id, info);
+        table.emplace(id, lru.begin());
+        trim();
+    }
+    void erase(const ZUID &id){
+        std::lock_guard<std::mutex> guard(mutex);
+        auto it = table.find(id);
+        if(it == table.end())
+            return;
+        lru.erase(it->second);
+        table.erase(it);
+    }
+    void clear(){
+        std::lock_guard<std::mutex> guard(mutex);
+        lru.clear();
+        table.clear();
+    }
+    void limit(zu64 entries, zu64 bytes){
+        std::lock_guard<std::mutex> guard(mutex);
+        maxentries = entries;
+        maxbytes = bytes;
+        trim();
+    }
+    void resetStats(){
+        std::lock_guard<std::mutex> guard(mutex);
+        hits = 0;
+        misses = 0;
+        evictions = 0;
+    }
+    void stats(CacheStats *st){
+        std::lock_guard<std::mutex> guard(mutex);
+        st->hits = hits;
+        st->misses = misses;
+        st->evictions = evictions;
+        st->entries = table.size();
+        st->bytes = st->entries * ENTRY_SIZE;
+    }
+    //! Evict least recently used entries until within limits.
+    void trim(){
+        while(!lru.empty() && ((maxentries && table.size() > maxentries) ||
+                               (maxbytes && table.size() * ENTRY_SIZE > maxbytes))){
+            table.erase(lru.back().first);
+            lru.pop_back();
+            ++evictions;
+        }
+    }
+
+    //! Held by each method, lookups move entries so readers need it too.
+    std::mutex mutex;
+    //! Most recently used first.
+    LRUList lru;
+    std::unordered_map<ZUID, LRUList::iterator, Hash, Equal> table;
+
+    zu64 maxentries;
+    zu64 maxbytes;
+    zu64 hits;
+    zu64 misses;
+    zu64 evictions;
+};
+
+struct ZParcel::ParcelNodePool {
+    ParcelNodePool() : levels(ZPARCEL_POOL_LEVELS){}
+
+    bool get(zu64 offset, zbyte *dest, zu64 size){
+        std::lock_guard<std::mutex> guard(mutex);
+        auto it = nodes.find(offset);
+        if(it == nodes.end() || it->second.size() != size)
+            return false;
+        memcpy(dest, it->second.raw(), size);
+        return true;
+    }
+    void put(zu64 offset, const zbyte *src, zu64 size){
+        std::lock_guard<std::mutex> guard(mutex);
+        ZBinary &node = nodes[offset];
+        node.resize(size);
+        memcpy(node.raw(), src, size);
+    }
+    //! Apply a write to any pooled nodes it overlaps.
+    void mirror(zu64 offset, const zbyte *src, zu64 size){
+        std::lock_guard<std::mutex> guard(mutex);
+        if(nodes.empty())
+            return;
+        const zu64 end = offset + size;
+        auto it = nodes.upper_bound(offset);
+        if(it != nodes.begin())
+            --it;
+        for(; it != nodes.end() && it->first < end; ++it){
+            const zu64 start = MAX(it->first, offset);
+            const zu64 stop = MIN(it->first + it->second.size(), end);
+            if(stop > start)
+                memcpy(it->second.raw() + (start - it->first), src + (start - offset), stop - start);
+        }
+    }
+
+    bool checked(zu64 offset){
+        std::lock_guard<std::mutex> guard(mutex);
+        return verified.count(offset) != 0;
+    }
+    void check(zu64 offset){
+        std::lock_guard<std::mutex> guard(mutex);
+        verified.insert(offset);
+    }
+    //! Forget verified offsets, so every node is checked again.
+    void recheck(){
+        std::lock_guard<std::mutex> guard(mutex);
+        verified.clear();
+    }
+
+    void clear(){
+        std::lock_guard<std::mutex> guard(mutex);
+        nodes.clear();
+        verified.clear();
+    }
+    zu64 size(){
+        std::lock_guard<std::mutex> guard(mutex);
+        return nodes.size();
+    }
+
+    //! Readers fill the pool, so it has its own lock.
+    std::mutex mutex;
+    //! Verified node contents by file offset.
+    std::map<zu64, ZBinary> nodes;
+    //! Offsets of nodes already verified, for VERIFY_ONCE.
+    std::unordered_set<zu64> verified;
+    zu16 levels;
+};
+
+/*! Hot path counters, kept in one shard per thread so updates from different threads
+ *  do not contend. Shards are summed when read. Updates are relaxed, counts are only
+ *  exact once the threads counting them are done.
+ */
+struct ZParcel::ParcelStats {
+    enum counter {
+        LOOKUPS, DEPTH, NODEREADS, POOLHITS,
+        ALLOCS, FREEALLOCS, SPLITS, SLACK,
+        READS, READBYTES, WRITES, WRITEBYTES,
+        CRCS, CRCBYTES, CRCNSEC,
+        COUNTERS
+    };
+    struct Shard {
+        std::atomic<zu64> count[COUNTERS];
+        std::atomic<zu64> depths[STATS_DEPTHS];
+        // Keep shards in separate cache lines
+        char pad[64];
+    };
+
+    ParcelStats(){
+        reset();
+    }
+
+    void add(counter c, zu64 n = 1){
+        shard().count[c].fetch_add(n, std::memory_order_relaxed);
+    }
+    //! Count a lookup that visited \a depth index nodes.
+    void lookup(zu64 depth){
+        Shard &sh = shard();
+        sh.count[LOOKUPS].fetch_add(1, std::memory_order_relaxed);
+        sh.count[DEPTH].fetch_add(depth, std::memory_order_relaxed);
+        sh.depths[MIN(depth, STATS_DEPTHS - 1)].fetch_add(1, std::memory_order_relaxed);
+    }
+    //! Count a checksum of \a size bytes, started at \a start.
+    void crc(zu64 size, std::chrono::steady_clock::time_point start){
+        const zu64 nsec = (zu64)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        Shard &sh = shard();
+        sh.count[CRCS].fetch_add(1, std::memory_order_relaxed);
+        sh.count[CRCBYTES].fetch_add(size, std::memory_order_relaxed);
+        sh.count[CRCNSEC].fetch_add(nsec, std::memory_order_relaxed);
+    }
+
+    void sum(Stats *st) const {
+        zu64 total[COUNTERS] = {};
+        memset(st->depths, 0, sizeof(st->depths));
+        for(zu64 i = 0; i < ZPARCEL_STATS_SHARDS; ++i){
+            for(zu64 c = 0; c < COUNTERS; ++c)
+                total[c] += shards[i].count[c].load(std::memory_order_relaxed);
+            for(zu64 d = 0; d < STATS_DEPTHS; ++d)
+                st->depths[d] += shards[i].depths[d].load(std::memory_order_relaxed);
+        }
+        st->lookups = total[LOOKUPS];
+        st->depth = total[DEPTH];
+        st->nodereads = total[NODEREADS];
+        st->poolhits = total[POOLHITS];
+        st->allocs = total[ALLOCS];
+        st->freeallocs = total[FREEALLOCS];
+        st->splits = total[SPLITS];
+        st->slack = total[SLACK];
+        st->reads = total[READS];
+        st->readbytes = total[READBYTES];
+        st->writes = total[WRITES];
+        st->writebytes = total[WRITEBYTES];
+        st->crcs = total[CRCS];
+        st->crcbytes = total[CRCBYTES];
+        st->crcnsec = total[CRCNSEC];
+    }
+    void reset(){
+        for(zu64 i = 0; i < ZPARCEL_STATS_SHARDS; ++i){
+            for(zu64 c = 0; c < COUNTERS; ++c)
+                shards[i].count[c].store(0, std::memory_order_relaxed);
+            for(zu64 d = 0; d < STATS_DEPTHS; ++d)
+                shards[i].depths[d].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    //! Shard of the calling thread, the same one for every parcel.
+    Shard &shard(){
+        static std::atomic<zu32> threads(0);
+        static thread_local const zu32 slot = threads.fetch_add(1, std::memory_order_relaxed) % ZPARCEL_STATS_SHARDS;
+        return shards[slot];
+    }
+
+    Shard shards[ZPARCEL_STATS_SHARDS];
+};
+
+struct ZParcel::ParcelFreeMap {
+    struct Span {
+        zu64 size;
+        zu64 next;
+        zu64 prev;
+    };
+
+    void add(zu64 offset, zu64 size, zu64 next, zu64 prev){
+        spans[offset] = { size, next, prev };
+        bysize.emplace(size, offset);
+    }
+    void erase(zu64 offset){
+        auto it = spans.find(offset);
+        auto range = bysize.equal_range(it->second.size);
+        for(auto i = range.first; i != range.second; ++i){
+            if(i->second == offset){
+                bysize.erase(i);
+                break;
+            }
+        }
+        spans.erase(it);
+    }
+    void clear(){
+        spans.clear();
+        bysize.clear();
+    }
+    //! Get offset of the smallest free node of at least \a size, or ZU64_MAX.
+    zu64 fit(zu64 size) const {
+        auto it = bysize.lower_bound(size);
+        return (it == bysize.end() ? ZU64_MAX : it->second);
+    }
+
+    //! Free nodes by offset, with their links in the on-disk list or bin.
+    std::map<zu64, Span> spans;
+    //! Free node offsets by size.
+    std::multimap<zu64, zu64> bysize;
+};
+
+struct ZParcel::ParcelIndex {
+    struct Less {
+        bool operator()(const ZUID &a, const ZUID &b) const {
+            return (a.compare(b) < 0);
+        }
+    };
+    typedef std::set<ZUID, Less> IdSet;
+
+    void addName(const ZUID &id, const ZString &name){
+        const std::string key(name.cc(), name.size());
+        names[key].insert(id);
+        files[id] = key;
+    }
+    void erase(const ZUID &id, objtype type){
+        auto t = types.find(type);
+        if(t != types.end()){
+            t->second.erase(id);
+            if(t->second.empty())
+                types.erase(t);
+        }
+        auto f = files.find(id);
+        if(f != files.end()){
+            auto n = names.find(f->second);
+            n->second.erase(id);
+            if(n->second.empty())
+                names.erase(n);
+            files.erase(f);
+        }
+    }
+    void clear(){
+        types.clear();
+        names.clear();
+        files.clear();
+    }
+
+    //! Object ids by type.
+    std::map<objtype, IdSet> types;
+    //! File object ids by file name.
+    std::map<std::string, IdSet> names;
+    //! File names by file object id, for removes.
+    std::unordered_map<ZUID, std::string, ParcelInfoCache::Hash, ParcelInfoCache::Equal> files;
+};
+
+//! Shared blob data nodes of an OPT_DEDUP parcel, rebuilt from the index on open.
+struct ZParcel::ParcelDedup {
+    typedef std::pair<zu64, zu32> Key;  // Content length and CRC32C
+
+    struct Node {
+        zu64 size;
+        bool compressed;
+        zu64 refs;      // Objects referring to the node
+        bool hashed;
+        Key key;
+    };
+
+    ParcelDedup() : filled(true){}
+
+    //! Count a reference to the data node of \a info. New nodes are hashed by the caller, or by _dedupFill().
+    void add(const ObjectInfo &info){
+        auto it = nodes.find(info.data.offset);
+        if(it != nodes.end()){
+            it->second.refs++;
+            return;
+        }
+        Node &node = nodes[info.data.offset];
+        node.size = info.data.size;
+        node.compressed = info.compressed;
+        node.refs = 1;
+        node.hashed = false;
+    }
+    void hash(zu64 offset, const Key &key){
+        auto it = nodes.find(offset);
+        if(it == nodes.end() || it->second.hashed)
+            return;
+        it->second.hashed = true;
+        it->second.key = key;
+        byhash.insert({ key, offset });
+    }
+    /*! Drop a reference to the data node at \a offset.
+     *  \return True if other objects still refer to it.
+     */
+    bool release(zu64 offset){
+        auto it = nodes.find(offset);
+        if(it == nodes.end())
+            return false;
+        if(--it->second.refs)
+            return true;
+        if(it->second.hashed){
+            auto range = byhash.equal_range(it->second.key);
+            for(auto h = range.first; h != range.second; ++h){
+                if(h->second == offset){
+                    byhash.erase(h);
+                    break;
+                }
+            }
+        }
+        nodes.erase(it);
+        return false;
+    }
+    //! True if more than one object refers to the data node at \a offset.
+    bool shared(zu64 offset) const {
+        auto it = nodes.find(offset);
+        return (it != nodes.end() && it->second.refs > 1);
+    }
+    ObjectInfo info(zu64 offset, const Node &node) const {
+        ObjectInfo info;
+        memset(&info, 0, sizeof(info));
+        info.type = BLOBOBJ;
+        info.compressed = node.compressed;
+        info.data.offset = offset;
+        info.data.size = node.size;
+        return info;
+    }
+    void clear(){
+        nodes.clear();
+        byhash.clear();
+        filled = true;
+    }
+
+    //! Blob data nodes by offset.
+    std::unordered_map<zu64, Node> nodes;
+    //! Offsets of hashed data nodes by contents.
+    std::multimap<Key, zu64> byhash;
+    //! Every counted node has been hashed.
+    bool filled;
+};
+
+struct ZParcel::ParcelBuild {
+    struct Entry {
+        zbyte raw[ParcelPage::LEAF_SIZE];
+    };
+
+    ParcelBuild() : offset(0){}
+
+    //! Leaf entries of the stored objects, in the order stored.
+    std::vector<Entry> entries;
+    //! Payload data not yet written, starting at \a offset.
+    ZBinary stage;
+    zu64 offset;
+};
+
+//! Reader-writer lock for the parcel. Waiting writers block new readers.
+struct ZParcel::ParcelLock {
+    ParcelLock() : readers(0), writers(0), writing(false){}
+
+    void lockShared(){
+        std::unique_lock<std::mutex> lk(mutex);
+        cond.wait(lk, [this]{ return !writing && writers == 0; });
+        ++readers;
+    }
+    void unlockShared(){
+        std::lock_guard<std::mutex> lk(mutex);
+        if(--readers == 0)
+            cond.notify_all();
+    }
+    void lock(){
+        std::unique_lock<std::mutex> lk(mutex);
+        ++writers;
+        cond.wait(lk, [this]{ return !writing && readers == 0; });
+        --writers;
+        writing = true;
+    }
+    void unlock(){
+        std::lock_guard<std::mutex> lk(mutex);
+        writing = false;
+        cond.notify_all();
+    }
+
+    struct Shared {
+        Shared(ParcelLock *l) : lock(l){ lock->lockShared(); }
+        ~Shared(){ lock->unlockShared(); }
+        ParcelLock *lock;
+    };
+    struct Exclusive {
+        Exclusive(ParcelLock *l) : lock(l){ lock->lock(); }
+        ~Exclusive(){ lock->unlock(); }
+        ParcelLock *lock;
+    };
+
+    std::mutex mutex;
+    std::condition_variable cond;
+    zu64 readers;
+    zu64 writers;
+    bool writing;
+    //! Serializes seek and read or write on the shared file accessor.
+    std::mutex io;
+};
+
+//! Worker threads for background fetches and parallel reads. Threads are started on first use.
+struct ZParcel::ParcelIOPool {
+    ParcelIOPool() : stop(false){}
+    ~ParcelIOPool(){
+        {
+            std::lock_guard<std::mutex> lk(mutex);
+            stop = true;
+        }
+        cond.notify_all();
+        for(auto &t : threads)
+            t.join();
+    }
+
+    void submit(std::function<void()> task){
+        std::lock_guard<std::mutex> lk(mutex);
+        if(threads.empty()){
+            for(zu64 i = 0; i < ZPARCEL_IO_THREADS; ++i)
+                threads.emplace_back([this]{ run(); });
+        }
+        tasks.push_back(std::move(task));
+        cond.notify_one();
+    }
+
+    /*! Call \a fn for each index below \a count, on the worker threads and the calling thread.
+     *  The caller takes work too, so this finishes even if every worker is busy.
+     */
+    void parallel(zu64 count, const std::function<void(zu64)> &fn){
+        if(count == 0)
+            return;
+        struct State {
+            std::atomic<zu64> next;
+            std::atomic<zu64> done;
+            std::mutex mutex;
+            std::condition_variable cond;
+        };
+        std::shared_ptr<State> st = std::make_shared<State>();
+        st->next = 0;
+        st->done = 0;
+        // Workers that start after all work is taken only touch the shared state
+        const std::function<void(zu64)> *pfn = &fn;
+        auto work = [st, pfn, count]{
+            for(zu64 i; (i = st->next++) < count; ){
+                (*pfn)(i);
+                if(++st->done == count){
+                    std::lock_guard<std::mutex> lk(st->mutex);
+                    st->cond.notify_all();
+                }
+            }
+        };
+        for(zu64 i = 1; i < MIN(count, (zu64)ZPARCEL_IO_THREADS); ++i)
+            submit(work);
+        work();
+
+        std::unique_lock<std::mutex> lk(st->mutex);
+        st->cond.wait(lk, [&st, count]{ return st->done == count; });
+    }
+
+    void run(){
+        for(;;){
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lk(mutex);
+                cond.wait(lk, [this]{ return stop || !tasks.empty(); });
+                if(tasks.empty())
+                    return;
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+            task();
+        }
+    }
+
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::deque<std::function<void()>> tasks;
+    std::vector<std::thread> threads;
+    bool stop;
+};
+
+struct ZParcel::ParcelBatch {
+    ParcelBatch() : depth(0), header(false), direct(false){}
+
+    zu64 depth;
+    bool header;
+    //! Journaled writes went straight to the file, which is synced before they are logged.
+    bool direct;
+    //! Dirty extents by file offset, never overlapping.
+    std::map<zu64, ZBinary> extents;
+};
+
+//! Journal next to a parcel file. Records are appended under the parcel lock and synced outside it.
+struct ZParcel::ParcelJournal {
+    struct Record {
+        zu64 lsn;
+        std::map<zu64, ZBinary> extents;
+    };
+
+    ParcelJournal() : fd(-1), on(false), size(0), tail(0), written(0), synced(0), syncing(false), failed(false){}
+
+    int fd;
+    //! Write operations are logged. Off while building.
+    bool on;
+    //! Bytes in the journal file.
+    zu64 size;
+    /*! Highest tail pointer of any logged state. No state a replay can produce refers to space past it,
+     *  so data written there skips the journal.
+     */
+    zu64 tail;
+    //! Logged extents not yet applied to the parcel file, merged, and read over it.
+    std::map<zu64, ZBinary> overlay;
+
+    //! Guards the fields below.
+    std::mutex mutex;
+    std::condition_variable cond;
+    //! Sequence numbers of the last record appended and the last record synced.
+    zu64 written;
+    zu64 synced;
+    bool syncing;
+    //! A sync failed. Records after the last synced one are never synced or applied, only replayed if they made it.
+    bool failed;
+    //! Logged records not yet applied to the parcel file, oldest first.
+    std::deque<Record> records;
+};
+
+//! Id table of a VERSION3 parcel, in the mapping or read into memory.
+struct ZParcel::ParcelPack {
+    ParcelPack() : table(nullptr), count(0), offset(0){}
+
+    void clear(){
+        table = nullptr;
+        count = 0;
+        offset = 0;
+        buff.clear();
+    }
+
+    //! Entries in Eytzinger order. Entry k has children 2k and 2k + 1, counting from one.
+    const zbyte *table;
+    zu64 count;
+    //! File offset of the table.
+    zu64 offset;
+    ZBinary buff;
+};
+
+/*! Exclusive lock for a write operation.
+ *  In journaled parcels, the writes made under it are one transaction, which done() logs and
+ *  waits for, and which is rolled back if the operation fails or leaves early.
+ */
+struct ZParcel::ParcelWrite {
+    ParcelWrite(ZParcel *p) : parcel(p), locked(true){ parcel->_lock->lock(); }
+    ~ParcelWrite(){
+        if(locked){
+            parcel->_txnAbort();
+            parcel->_lock->unlock();
+        }
+    }
+
+    //! Unlock, and wait until the operation is durable if it succeeded. Returns \a err or the journal error.
+    parcelerror done(parcelerror err){
+        zu64 lsn = 0;
+        if(err == OK)
+            err = parcel->_txnLog(&lsn);
+        else
+            parcel->_txnAbort();
+        locked = false;
+        parcel->_lock->unlock();
+
+        if(lsn){
+            // Concurrent operations wait for the same sync
+            err = parcel->_walSync(lsn);
+            if(err != OK){
+                // The record may or may not be in the journal, and later ones build on it, so writes stop
+                ParcelLock::Exclusive guard(parcel->_lock);
+                if(!parcel->_readonly)
+                    ELOG("ZParcel: journal sync failed, parcel is read-only until reopened");
+                parcel->_readonly = true;
+                return err;
+            }
+            if(parcel->_walDue()){
+                ParcelLock::Exclusive guard(parcel->_lock);
+                parcelerror aerr = parcel->_walApply();
+                if(aerr == OK && parcel->_wal->records.empty() && parcel->_wal->size >= ZPARCEL_WAL_CHECKPOINT)
+                    aerr = parcel->_walCheckpoint();
+                if(aerr != OK)
+                    ELOG("ZParcel: journal apply failed: " << errorStr(aerr));
+            }
+        }
+        return err;
+    }
+
+    ZParcel *parcel;
+    bool locked;
+};
+
+/*! Big-endian unsigned integer field of an on-disk record.
+ *  Stored as bytes, so records have no padding and need no alignment.
+ */
+template <typename T> struct ParcelBE {
+    operator T() const {
+        T val = 0;
+        for(unsigned i = 0; i < sizeof(T); ++i)
+            val = (T)((val << 8) | raw[i]);
+        return val;
+    }
+    ParcelBE &operator=(T val){
+        for(unsigned i = sizeof(T); i > 0; --i){
+            raw[i - 1] = (zbyte)val;
+            val = (T)(val >> 8);
+        }
+        return *this;
+    }
+
+    zbyte raw[sizeof(T)];
+};
+
+// On-disk node layouts, read and written whole on the stack
+
+struct HeaderRecord {
+    char sig[ZPARCEL_SIG_LEN];
+    zu8 version;
+    ParcelBE<zu32> flags;
+    ParcelBE<zu64> treehead;
+    ParcelBE<zu64> freehead;
+    ParcelBE<zu64> freetail;
+    ParcelBE<zu64> tailptr;
+    zbyte root[ZUID_SIZE];
+    ParcelBE<zu32> crc;
+};
+
+struct TreeRecord {
+    ParcelBE<zu32> magic;
+    zbyte uid[ZUID_SIZE];
+    ParcelBE<zu64> lnode;
+    ParcelBE<zu64> rnode;
+    zu8 type;
+    zu8 extra;
+    ParcelBE<zu32> crc;
+    zbyte payload[16];
+};
+
+struct FreeRecord {
+    ParcelBE<zu32> magic;
+    ParcelBE<zu64> next;
+    ParcelBE<zu64> size;
+    ParcelBE<zu32> crc;
+};
+
+struct BinTableRecord {
+    ParcelBE<zu32> magic;
+    ParcelBE<zu64> head[64];
+    ParcelBE<zu32> crc;
+};
+
+struct BinNodeRecord {
+    ParcelBE<zu32> magic;
+    ParcelBE<zu64> next;
+    ParcelBE<zu64> prev;
+    ParcelBE<zu64> size;
+    ParcelBE<zu32> crc;
+};
+
+//! Page head, followed by the entries.
+struct PageRecord {
+    ParcelBE<zu32> magic;
+    zu8 level;
+    zu8 flags;
+    ParcelBE<zu16> count;
+    ParcelBE<zu64> next;
+    ParcelBE<zu32> crc;
+};
+
+//! Journal record head, followed by \a count extents in \a size bytes, each a JournalExtent and its data.
+struct JournalRecord {
+    ParcelBE<zu32> magic;
+    ParcelBE<zu32> count;
+    ParcelBE<zu64> size;
+    //! CRC32C of the whole record.
+    ParcelBE<zu32> crc;
+};
+
+struct JournalExtent {
+    ParcelBE<zu64> offset;
+    ParcelBE<zu64> size;
+};
+
+//! Packed id table head. The entries start ZPARCEL_PACK_ALIGN bytes after it.
+struct PackRecord {
+    ParcelBE<zu32> magic;
+    ParcelBE<zu64> count;
+    //! CRC32C of the entries.
+    ParcelBE<zu32> tablecrc;
+    ParcelBE<zu32> crc;
+};
+
+/*! Checksum node of \a size bytes at \a buff with the 4 byte field at \a field counted as zero.
+ *  Parcels created without OPT_CRC32C use CRC32, which is hashed from a copy.
+ */
+static zu32 nodeChecksum(zu32 flags, const zbyte *buff, zu64 size, zu64 field){
+    if(flags & ZParcel::OPT_CRC32C)
+        return ZParcelChecksum::node(buff, size, field);
+
+    ZBinary copy(buff, size);
+    memset(copy.raw() + field, 0, 4);
+    return ZHash<ZBinary, ZHashBase::CRC32>(copy).hash();
+}
+
+//! Append compressed chunk of \a size bytes at \a src to \a out, as a 4 byte header and data.
+static void encodeChunk(const zbyte *src, zu64 size, ZBinary &out){
+    const zu64 pos = out.size();
+    out.resize(pos + 4 + ZParcelCodec::bound(size));
+    zu64 len = ZParcelCodec::compress(src, size, out.raw() + pos + 4);
+    zu32 hdr = (zu32)len;
+    if(len >= size){
+        // Keep incompressible data as is
+        memcpy(out.raw() + pos + 4, src, size);
+        len = size;
+        hdr = (zu32)size | ZPARCEL_CHUNK_RAW;
+    }
+    ZBinary::encbeu32(out.raw() + pos, hdr);
+    out.resize(pos + 4 + len);
+}
+
+/*! Decode chunk from at most \a size bytes at \a src into exactly \a dsize bytes at \a dest.
+ *  \return Bytes of \a src used, or 0 if the chunk is corrupt.
+ */
+static LibChaos::zu64 decodeChunk(const zbyte *src, zu64 size, zbyte *dest, zu64 dsize){
+    if(size < 4)
+        return 0;
+    const zu32 hdr = ZBinary::decbeu32(src);
+    const zu64 len = (hdr & ~ZPARCEL_CHUNK_RAW);
+    if(len > size - 4)
+        return 0;
+    if(hdr & ZPARCEL_CHUNK_RAW){
+        if(len != dsize)
+            return 0;
+        memcpy(dest, src + 4, len);
+    } else if(ZParcelCodec::decompress(src + 4, len, dest, dsize) != dsize){
+        return 0;
+    }
+    return 4 + len;
+}
+
+/*! Decode length-prefixed payload of \a size bytes at \a ptr into \a out.
+ *  Compressed payloads have the decoded length, then the chunks.
+ */
+static ZParcel::parcelerror decodePayload(const zbyte *ptr, zu64 size, bool compressed, ZBinary *out){
+    if(size < 8)
+        return ZParcel::ERR_TRUNC;
+    const zu64 len = ZBinary::decbeu64(ptr);
+    if(!compressed){
+        if(len > size - 8)
+            return ZParcel::ERR_TRUNC;
+        *out = ZBinary(ptr + 8, len);
+        return ZParcel::OK;
+    }
+
+    // Every chunk has at least a header
+    if(len / ZPARCEL_COMPRESS_CHUNK >= (size - 8) / 4 + 1)
+        return ZParcel::ERR_DECODE;
+    out->resize(len);
+    const zbyte *src = ptr + 8;
+    zu64 rem = size - 8;
+    for(zu64 done = 0; done < len; ){
+        const zu64 n = MIN(len - done, (zu64)ZPARCEL_COMPRESS_CHUNK);
+        const zu64 used = decodeChunk(src, rem, out->raw() + done, n);
+        if(used == 0)
+            return ZParcel::ERR_DECODE;
+        src += used;
+        rem -= used;
+        done += n;
+    }
+    return ZParcel::OK;
+}
+
+//! Check if the files at \a a and \a b both hold the same \a size bytes.
+static bool sameFiles(const ZPath &a, const ZPath &b, zu64 size){
+    ZFile fa(a, ZFile::READ);
+    ZFile fb(b, ZFile::READ);
+    if(!fa.isOpen() || !fb.isOpen() || fa.fileSize() != size || fb.fileSize() != size)
+        return false;
+    ZBinary ba(MIN(size, (zu64)ZPARCEL_COPY_CHUNK));
+    ZBinary bb(ba.size());
+    for(zu64 pos = 0; pos < size; ){
+        const zu64 n = MIN(size - pos, ba.size());
+        if(fa.read(ba.raw(), n) != n || fb.read(bb.raw(), n) != n || memcmp(ba.raw(), bb.raw(), n) != 0)
+            return false;
+        pos += n;
+    }
+    return true;
+}
+
+//! Write \a size bytes from \a src at \a offset into \a extents, merging extents it overlaps.
+static void mergeExtent(std::map<zu64, ZBinary> &extents, zu64 offset, const zbyte *src, zu64 size){
+    const zu64 end = offset + size;
+    auto it = extents.upper_bound(offset);
+    if(it != extents.begin()){
+        auto prev = std::prev(it);
+        const zu64 pend = prev->first + prev->second.size();
+        if(pend >= end){
+            // Overwrite inside an extent
+            memcpy(prev->second.raw() + (offset - prev->first), src, size);
+            return;
+        }
+        if(pend > offset)
+            it = prev;
+    }
+
+    // Adjacent extents are left separate and coalesced when written
+    zu64 start = offset;
+    zu64 stop = end;
+    auto last = it;
+    for(; last != extents.end() && last->first < end; ++last){
+        start = MIN(start, last->first);
+        stop = MAX(stop, last->first + last->second.size());
+    }
+
+    ZBinary ext(stop - start);
+    for(auto i = it; i != last; ++i)
+        memcpy(ext.raw() + (i->first - start), i->second.raw(), i->second.size());
+    memcpy(ext.raw() + (offset - start), src, size);
+
+    extents.erase(it, last);
+    extents.emplace(start, std::move(ext));
+}
+
+//! First index in order of an Eytzinger layout of \a n entries, counting from one, or zero if empty.
+static LibChaos::zu64 eytzFirst(zu64 n){
+    zu64 k = (n ? 1 : 0);
+    while(k && 2 * k <= n)
+        k *= 2;
+    return k;
+}
+
+//! Index after \a k in order of an Eytzinger layout of \a n entries, or zero at the end.
+static LibChaos::zu64 eytzNext(zu64 k, zu64 n){
+    if(2 * k + 1 <= n){
+        // Leftmost of the right subtree
+        k = 2 * k + 1;
+        while(2 * k <= n)
+            k *= 2;
+        return k;
+    }
+    // First ancestor this is left of
+    while(k & 1)
+        k >>= 1;
+    return k >> 1;
+}
+
+//! Copy the parts of \a extents in the \a size bytes at \a offset over \a dest.
+static void overlayExtents(const std::map<zu64, ZBinary> &extents, zu64 offset, zbyte *dest, zu64 size){
+    const zu64 end = offset + size;
+    auto it = extents.upper_bound(offset);
+    if(it != extents.begin() && std::prev(it)->first + std::prev(it)->second.size() > offset)
+        --it;
+    for(; it != extents.end() && it->first < end; ++it){
+        const zu64 start = MAX(it->first, offset);
+        const zu64 stop = MIN(it->first + it->second.size(), end);
+        memcpy(dest + (start - offset), it->second.raw() + (start - it->first), stop - start);
+    }
+}
+
+//! Check if any of \a extents overlaps the \a size bytes at \a offset.
+static bool overlapsExtents(const std::map<zu64, ZBinary> &extents, zu64 offset, zu64 size){
+    auto it = extents.upper_bound(offset);
+    if(it != extents.begin() && std::prev(it)->first + std::prev(it)->second.size() > offset)
+        return true;
+    return (it != extents.end() && it->first < offset + size);
+}
+
+//! End of the bytes of \a extents that run on without a gap from \a offset, or \a offset if none cover it.
+static zu64 coveredExtents(const std::map<zu64, ZBinary> &extents, zu64 offset){
+    auto it = extents.upper_bound(offset);
+    if(it != extents.begin())
+        --it;
+    for(; it != extents.end() && it->first <= offset; ++it)
+        offset = MAX(offset, it->first + it->second.size());
+    return offset;
+}
+
+#if ZPARCEL_POSIX
+//! Sync the data of file \a fd, and the metadata needed to read it.
+static bool syncFd(int fd){
+#if defined(__linux__)
+    return (::fdatasync(fd) == 0);
+#else
+    return (::fsync(fd) == 0);
+#endif
+}
+
+//! Read all \a size bytes at \a offset in \a fd into \a dest.
+static bool readFd(int fd, zbyte *dest, zu64 size, zu64 offset){
+    for(zu64 done = 0; done < size; ){
+        ssize_t r = ::pread(fd, dest + done, size - done, offset + done);
+        if(r < 0 && errno == EINTR)
+            continue;
+        if(r <= 0)
+            return false;
+        done += r;
+    }
+    return true;
+}
+
+//! Sync the directory holding the file at \a path, so a file created there is kept.
+static bool syncDir(const ZString &path){
+    std::string dir = path.cc();
+    const size_t slash = dir.rfind('/');
+    dir = (slash == std::string::npos ? "." : (slash == 0 ? "/" : dir.substr(0, slash)));
+    int fd = ::open(dir.c_str(), O_RDONLY);
+    if(fd < 0)
+        return false;
+    const bool ok = (::fsync(fd) == 0);
+    ::close(fd);
+    return ok;
+}
+
+//! Append all \a size bytes at \a src to \a fd.
+static bool writeFd(int fd, const zbyte *src, zu64 size){
+    for(zu64 done = 0; done < size; ){
+        ssize_t r = ::write(fd, src + done, size - done);
+        if(r < 0 && errno == EINTR)
+            continue;
+        if(r <= 0)
+            return false;
+        done += r;
+    }
+    return true;
+}
+#endif
+
+static int pageKeyCompare(const zbyte *key, const ZUID &id){
+    ZUID uid;
+    uid.fromRaw(key);
+    return uid.compare(id);
+}
+
 static const ZMap<ZParcel::objtype, ZString> typetoname = {
     { ZParcel::NULLOBJ,   "null" },
     { ZParcel::UINTOBJ,   "uint" },
@@ -63,75 +1159,256 @@ static const ZMap<ZParcel::parcelerror, ZString> errtostr = {
     { ZParcel::ERR_VERSION,     "Bad file header version" },
     { ZParcel::ERR_MAX_DEPTH,   "Exceeded maximum tree depth" },
     { ZParcel::ERR_MAGIC,       "Bad object magic number" },
+    { ZParcel::ERR_READONLY,    "Parcel is read-only" },
+    { ZParcel::ERR_TYPE,        "Object has wrong type" },
+    { ZParcel::ERR_DECODE,      "Compressed payload is corrupt" },
 };
 
 // /////////////////////////////////////////////////////////////////////////////
 
-ZParcel::ZParcel() : _state(CLOSED), _file(nullptr), _header(nullptr){
+ZParcel::ZParcel() : _state(CLOSED), _file(nullptr), _header(nullptr), _bins(nullptr), _free(nullptr),
+    _cache(new ParcelInfoCache), _pool(new ParcelNodePool), _batch(nullptr), _build(nullptr),
+    _lock(new ParcelLock), _io(new ParcelIOPool), _index(new ParcelIndex), _indexes(INDEX_NONE), _dedup(new ParcelDedup),
+    _wal(new ParcelJournal), _pack(new ParcelPack), _stats(new ParcelStats), _readonly(false), _fd(-1),
+    _compresspct(0), _compressmin(ZPARCEL_COMPRESS_MIN), _verify(VERIFY_ALWAYS),
+    _mapfd(-1), _map(nullptr), _mapsize(0), _mapfile(nullptr){
 
 }
 
 ZParcel::~ZParcel(){
     close();
+    // Finish queued fetches before the rest goes away
+    delete _io;
+    delete _cache;
+    delete _pool;
+    delete _index;
+    delete _dedup;
+    delete _wal;
+    delete _pack;
+    delete _stats;
+    delete _lock;
 }
 
-ZParcel::parcelerror ZParcel::create(ZBlockAccessor *file, parcelopt opt){
-    close();
+ZParcel::parcelerror ZParcel::create(ZBlockAccessor *file, parcelopt opt, parceltype type){
+    if(type == UNKNOWN || type >= VERSION3)
+        return ERR_VERSION;
+
+    ParcelLock::Exclusive guard(_lock);
+    _close();
+    return _create(file, opt, type);
+}
+
+ZParcel::parcelerror ZParcel::create(ZPath path, parcelopt opt, parceltype type){
+    if(type == UNKNOWN || type >= VERSION3)
+        return ERR_VERSION;
+
+    ParcelLock::Exclusive guard(_lock);
+    _close();
+#if ZPARCEL_POSIX
+    _fd = ::open(path.str().cc(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(_fd < 0)
+        return ERR_OPEN;
+    // Records of an old parcel at this path must not be replayed into the new one
+    const ZString wal = path.str() + ZPARCEL_WAL_SUFFIX;
+    if(::unlink(wal.cc()) != 0 && errno != ENOENT)
+        return ERR_OPEN;
+    RETERR(_create(nullptr, opt, type));
+    if(opt & OPT_JOURNAL)
+        RETERR(_walStart(wal, true));
+    return OK;
+#else
+    return ERR_OPEN;
+#endif
+}
+
+ZParcel::parcelerror ZParcel::_create(ZBlockAccessor *file, parcelopt opt, parceltype type){
     _file = file;
     _header = new ParcelHeader(this, 0);
 
-    _header->version = VERSION1;
+    _header->version = type;
     _header->flags = opt;
     _header->treehead = ZU64_MAX;
-    _header->freehead = ParcelHeader::NODE_SIZE;
-    _header->freetail = ParcelHeader::NODE_SIZE;
-    _header->tailptr = ZPARCEL_INIT_PAD;
+    _header->freehead = ((opt & OPT_SIZE_CLASSES) ? ParcelHeader::NODE_SIZE : ZU64_MAX);
+    _header->freetail = ZU64_MAX;
     _header->root = ZUID_NIL;
+    _compresspct = ((opt & OPT_COMPRESS) ? ZPARCEL_COMPRESS_PCT : 0);
 
-    _file->seek(0);
     ZBinary pad;
     pad.fill(0, ZPARCEL_INIT_PAD);
-    _file->write(pad.raw(), pad.size());
-    _file->seek(0);
-    zu64 flsz = _file->available();
-    _file->seek(0);
+    RETERR(_writeAt(0, pad.raw(), pad.size()));
 
+    _header->tailptr = MAX(_fileSize(), (zu64)ZPARCEL_INIT_PAD);
     RETERR(_header->write());
 
-    const zu64 fsize = flsz - ParcelHeader::NODE_SIZE - ParcelFreeNode::NODE_SIZE;
-//    DLOG("Base free node " << fsize);
+    zu64 start = ParcelHeader::NODE_SIZE;
+    if(opt & OPT_SIZE_CLASSES){
+        // Bin table follows the header
+        _bins = new ParcelBinTable(this, _header->freehead);
+        for(zu8 i = 0; i < ParcelBinTable::BINS; ++i)
+            _bins->head[i] = ZU64_MAX;
+        RETERR(_bins->write());
+        start += ParcelBinTable::NODE_SIZE;
+    }
 
-    ParcelFreeNode fnode(this, ParcelHeader::NODE_SIZE);
-    fnode.size = fsize;
-    fnode.next = ZU64_MAX;
-    RETERR(fnode.write());
+    // The rest of the file is one free node
+    _free = new ParcelFreeMap;
+    RETERR(_freeLink(start, _header->tailptr - start));
 
     _state = OPEN;
     return OK;
 }
 
 ZParcel::parcelerror ZParcel::open(ZBlockAccessor *file){
-    close();
-    _file = file;
-    _header = new ParcelHeader(this, 0);
-
-    RETERR(_header->read());
-
-    if(_header->version > MAX_PARCELTYPE)
-        return ERR_VERSION;
+    ParcelLock::Exclusive guard(_lock);
+    _close();
+    return _open(file);
+}
 
-    _state = OPEN;
+ZParcel::parcelerror ZParcel::open(ZPath path){
+    ParcelLock::Exclusive guard(_lock);
+    _close();
+#if ZPARCEL_POSIX
+    _fd = ::open(path.str().cc(), O_RDWR);
+    if(_fd < 0)
+        return ERR_OPEN;
+    const ZString wal = path.str() + ZPARCEL_WAL_SUFFIX;
+    RETERR(_walRecover(wal));
+    RETERR(_open(nullptr));
+    if(_header->flags & OPT_JOURNAL)
+        RETERR(_walStart(wal, false));
     return OK;
+#else
+    return ERR_OPEN;
+#endif
 }
 
-void ZParcel::close(){
-    delete _header;
-    _state = CLOSED;
-}
+ZParcel::parcelerror ZParcel::openMapped(ZPath path){
+    ParcelLock::Exclusive guard(_lock);
+    _close();
+#if ZPARCEL_POSIX
+    // Records in the journal are not in the file until open(ZPath) replays them
+    struct stat st;
+    if(::stat((path.str() + ZPARCEL_WAL_SUFFIX).cc(), &st) == 0 && st.st_size > 0)
+        return ERR_OPEN;
+
+    int fd = ::open(path.str().cc(), O_RDONLY);
+    if(fd < 0)
+        return ERR_OPEN;
+
+    if(::fstat(fd, &st) != 0 || (zu64)st.st_size < ParcelHeader::NODE_SIZE){
+        ::close(fd);
+        return ERR_OPEN;
+    }
+
+    void *map = ::mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if(map == MAP_FAILED){
+        ::close(fd);
+        return ERR_OPEN;
+    }
+
+    _mapfd = fd;
+    _map = (const zbyte *)map;
+    _mapsize = st.st_size;
+    _mapfile = new ParcelMapAccessor(this);
+    _readonly = true;
+    return _open(_mapfile);
+#else
+    return ERR_OPEN;
+#endif
+}
+
+void ZParcel::close(){
+    ParcelLock::Exclusive guard(_lock);
+    _close();
+}
+
+void ZParcel::_close(){
+    // An unfinished build leaves the parcel empty
+    delete _build;
+    _build = nullptr;
+
+    if(_batch){
+        _batch->depth = 1;
+        parcelerror err = _commitBatch();
+        if(err != OK)
+            ELOG("ZParcel: batch commit on close failed: " << errorStr(err));
+    }
+    if(_wal->fd >= 0)
+        _walClose();
+
+    delete _header;
+    _header = nullptr;
+    delete _bins;
+    _bins = nullptr;
+    delete _free;
+    _free = nullptr;
+    _cache->clear();
+    _pool->clear();
+    _index->clear();
+    _dedup->clear();
+    _pack->clear();
+    _readonly = false;
+
+#if ZPARCEL_POSIX
+    if(_map){
+        ::munmap((void *)_map, _mapsize);
+        ::close(_mapfd);
+    }
+    if(_fd >= 0)
+        ::close(_fd);
+#endif
+    _fd = -1;
+    _file = nullptr;
+    delete _mapfile;
+    _mapfile = nullptr;
+    _map = nullptr;
+    _mapsize = 0;
+    _mapfd = -1;
+
+    _state = CLOSED;
+}
+
+ZParcel::parcelerror ZParcel::_open(ZBlockAccessor *file){
+    _file = file;
+    _header = new ParcelHeader(this, 0);
+
+    RETERR(_header->read());
+
+    if(_header->version == UNKNOWN || _header->version > MAX_PARCELTYPE)
+        return ERR_VERSION;
+    _compresspct = ((_header->flags & OPT_COMPRESS) ? ZPARCEL_COMPRESS_PCT : 0);
+
+    if(_header->version == VERSION3){
+        // Packed parcels have no free space and are never written
+        _readonly = true;
+        RETERR(_packLoad());
+        RETERR(_indexLoad());
+        _state = OPEN;
+        return OK;
+    }
+
+    if(_header->flags & OPT_SIZE_CLASSES){
+        _bins = new ParcelBinTable(this, _header->freehead);
+        RETERR(_bins->read());
+    }
+
+    // Free space and shared data nodes are only needed for writing
+    if(!_readonly){
+        RETERR(_freeLoad());
+        RETERR(_dedupLoad());
+    }
+    RETERR(_indexLoad());
+
+    _state = OPEN;
+    return OK;
+}
 
 // /////////////////////////////////////////////////////////////////////////////
 
 bool ZParcel::exists(ZUID id){
+    ParcelLock::Shared guard(_lock);
+    if(_state != OPEN)
+        return false;
     ObjectInfo info;
     parcelerror err = _getObjectInfo(id, &info);
     if(err != ZParcel::OK)
@@ -140,6 +1417,9 @@ bool ZParcel::exists(ZUID id){
 }
 
 ZParcel::objtype ZParcel::getType(ZUID id){
+    ParcelLock::Shared guard(_lock);
+    if(_state != OPEN)
+        return UNKNOWNOBJ;
     ObjectInfo info;
     parcelerror err = _getObjectInfo(id, &info);
     if(err != ZParcel::OK)
@@ -150,71 +1430,228 @@ ZParcel::objtype ZParcel::getType(ZUID id){
 // /////////////////////////////////////////////////////////////////////////////
 
 ZParcel::parcelerror ZParcel::storeNull(ZUID id){
+    ParcelWrite guard(this);
     CHECK_COMMON(__FUNCTION__);
-    return _storeObject(id, NULLOBJ, ZBinary());
+    return guard.done(_storeObject(id, NULLOBJ, ZBinary()));
 }
 
 ZParcel::parcelerror ZParcel::storeBool(ZUID id, bool bl){
+    ParcelWrite guard(this);
     CHECK_COMMON(__FUNCTION__);
     ZBinary data(1);
     data[0] = (bl ? 1 : 0);
-    return _storeObject(id, BOOLOBJ, data);
+    return guard.done(_storeObject(id, BOOLOBJ, data));
 }
 
 ZParcel::parcelerror ZParcel::storeUint(ZUID id, zu64 num){
+    ParcelWrite guard(this);
     CHECK_COMMON(__FUNCTION__);
     ZBinary data;
     data.writebeu64(num);
-    return _storeObject(id, UINTOBJ, data);
+    return guard.done(_storeObject(id, UINTOBJ, data));
 }
 
 ZParcel::parcelerror ZParcel::storeSint(ZUID id, zs64 num){
+    ParcelWrite guard(this);
     CHECK_COMMON(__FUNCTION__);
     ZBinary data;
     data.writebes64(num);
-    return _storeObject(id, SINTOBJ, data);
+    return guard.done(_storeObject(id, SINTOBJ, data));
 }
 
 ZParcel::parcelerror ZParcel::storeFloat(ZUID id, double num){
+    ParcelWrite guard(this);
     CHECK_COMMON(__FUNCTION__);
     ZBinary data;
     data.writedouble(num);
-    return _storeObject(id, FLOATOBJ, data);
+    return guard.done(_storeObject(id, FLOATOBJ, data));
 }
 
 ZParcel::parcelerror ZParcel::storeZUID(ZUID id, ZUID uid){
+    ParcelWrite guard(this);
     CHECK_COMMON(__FUNCTION__);
-    return _storeObject(id, ZUIDOBJ, uid.bin());
+    return guard.done(_storeObject(id, ZUIDOBJ, uid.bin()));
 }
 
 ZParcel::parcelerror ZParcel::storeBlob(ZUID id, ZBinary blob){
+    ParcelWrite guard(this);
     CHECK_COMMON(__FUNCTION__);
+    CHECK_WRITE;
     ZBinary bin;
     bin.writebeu64(blob.size());
     bin.write(blob);
-    return _storeObject(id, BLOBOBJ, bin);
+
+    // Short blobs are kept in the index
+    if(!(_header->flags & OPT_DEDUP) || (_header->version == VERSION2 && blob.size() <= ParcelPage::INLINE_MAX)){
+        zu8 flags = _compressData(bin);
+        return guard.done(_storeObject(id, BLOBOBJ, bin, 0, nullptr, flags));
+    }
+
+    const zu32 hash = _checksum(blob.raw(), blob.size());
+    ObjectInfo info;
+    parcelerror err = _dedupFind(blob.size(), hash, [&blob, this](const ObjectInfo &cand){
+        zu64 pos = 0;
+        bool same = true;
+        parcelerror rerr = _readContent(cand, [&](const zbyte *data, zu64 size){
+            same = (size <= blob.size() - pos && memcmp(blob.raw() + pos, data, size) == 0);
+            pos += size;
+            return same;
+        });
+        return (rerr == OK && same && pos == blob.size());
+    }, &info);
+    if(err == OK)
+        return guard.done(_storeShared(id, info));
+    if(err != ERR_NOEXIST)
+        return err;
+
+    zu8 flags = _compressData(bin);
+    info.type = BLOBOBJ;
+    info.inlined = false;
+    info.compressed = !!flags;
+    RETERR(_storeObject(id, BLOBOBJ, bin, 0, &info.data.offset, flags, &info.data.size));
+    _dedup->add(info);
+    _dedup->hash(info.data.offset, ParcelDedup::Key(blob.size(), hash));
+    return guard.done(OK);
 }
 
 ZParcel::parcelerror ZParcel::storeString(ZUID id, ZString str){
+    ParcelWrite guard(this);
     CHECK_COMMON(__FUNCTION__);
     ZBinary bin;
     bin.writebeu64(str.size());
     bin.write(str);
-    return _storeObject(id, STRINGOBJ, bin);
+    zu8 flags = _compressData(bin);
+    return guard.done(_storeObject(id, STRINGOBJ, bin, 0, nullptr, flags));
 }
 
 ZParcel::parcelerror ZParcel::storeList(ZUID id, ZList<ZUID> list){
+    ParcelWrite guard(this);
+    CHECK_COMMON(__FUNCTION__);
+    ZBinary bin;
+    bin.writebeu64(list.size());
+    for(auto it = list.begin(); it.more(); ++it)
+        bin.write(it.get().raw(), ZUID_SIZE);
+    return guard.done(_storeObject(id, LISTOBJ, bin));
+}
+
+ZParcel::parcelerror ZParcel::updateBool(ZUID id, bool bl){
+    ParcelWrite guard(this);
+    CHECK_COMMON(__FUNCTION__);
+    ZBinary data(1);
+    data[0] = (bl ? 1 : 0);
+    return guard.done(_updateObject(id, BOOLOBJ, data));
+}
+
+ZParcel::parcelerror ZParcel::updateUint(ZUID id, zu64 num){
+    ParcelWrite guard(this);
+    CHECK_COMMON(__FUNCTION__);
+    ZBinary data;
+    data.writebeu64(num);
+    return guard.done(_updateObject(id, UINTOBJ, data));
+}
+
+ZParcel::parcelerror ZParcel::updateSint(ZUID id, zs64 num){
+    ParcelWrite guard(this);
+    CHECK_COMMON(__FUNCTION__);
+    ZBinary data;
+    data.writebes64(num);
+    return guard.done(_updateObject(id, SINTOBJ, data));
+}
+
+ZParcel::parcelerror ZParcel::updateFloat(ZUID id, double num){
+    ParcelWrite guard(this);
+    CHECK_COMMON(__FUNCTION__);
+    ZBinary data;
+    data.writedouble(num);
+    return guard.done(_updateObject(id, FLOATOBJ, data));
+}
+
+ZParcel::parcelerror ZParcel::updateZUID(ZUID id, ZUID uid){
+    ParcelWrite guard(this);
+    CHECK_COMMON(__FUNCTION__);
+    return guard.done(_updateObject(id, ZUIDOBJ, uid.bin()));
+}
+
+ZParcel::parcelerror ZParcel::updateBlob(ZUID id, ZBinary blob){
+    ParcelWrite guard(this);
+    CHECK_COMMON(__FUNCTION__);
+    CHECK_WRITE;
+    ZBinary bin;
+    bin.writebeu64(blob.size());
+    bin.write(blob);
+
+    // Same as storeBlob()
+    if(!(_header->flags & OPT_DEDUP) || (_header->version == VERSION2 && blob.size() <= ParcelPage::INLINE_MAX)){
+        zu8 flags = _compressData(bin);
+        return guard.done(_updateObject(id, BLOBOBJ, bin, 0, nullptr, flags));
+    }
+
+    const zu32 hash = _checksum(blob.raw(), blob.size());
+    ObjectInfo info;
+    parcelerror err = _dedupFind(blob.size(), hash, [&blob, this](const ObjectInfo &cand){
+        zu64 pos = 0;
+        bool same = true;
+        parcelerror rerr = _readContent(cand, [&](const zbyte *data, zu64 size){
+            same = (size <= blob.size() - pos && memcmp(blob.raw() + pos, data, size) == 0);
+            pos += size;
+            return same;
+        });
+        return (rerr == OK && same && pos == blob.size());
+    }, &info);
+    if(err == OK)
+        return guard.done(_updateShared(id, info));
+    if(err != ERR_NOEXIST)
+        return err;
+
+    zu8 flags = _compressData(bin);
+    info.type = BLOBOBJ;
+    info.inlined = false;
+    info.compressed = !!flags;
+    RETERR(_updateObject(id, BLOBOBJ, bin, 0, &info.data.offset, flags, &info.data.size));
+    _dedup->add(info);
+    _dedup->hash(info.data.offset, ParcelDedup::Key(blob.size(), hash));
+    return guard.done(OK);
+}
+
+ZParcel::parcelerror ZParcel::updateString(ZUID id, ZString str){
+    ParcelWrite guard(this);
+    CHECK_COMMON(__FUNCTION__);
+    ZBinary bin;
+    bin.writebeu64(str.size());
+    bin.write(str);
+    zu8 flags = _compressData(bin);
+    return guard.done(_updateObject(id, STRINGOBJ, bin, 0, nullptr, flags));
+}
+
+ZParcel::parcelerror ZParcel::updateList(ZUID id, ZList<ZUID> list){
+    ParcelWrite guard(this);
     CHECK_COMMON(__FUNCTION__);
     ZBinary bin;
     bin.writebeu64(list.size());
     for(auto it = list.begin(); it.more(); ++it)
         bin.write(it.get().raw(), ZUID_SIZE);
-    return _storeObject(id, LISTOBJ, bin);
+    return guard.done(_updateObject(id, LISTOBJ, bin));
+}
+
+ZParcel::parcelerror ZParcel::appendList(ZUID id, ZList<ZUID> list){
+    ParcelWrite guard(this);
+    CHECK_COMMON(__FUNCTION__);
+    CHECK_WRITE;
+    ObjectInfo info;
+    RETERR(_getObjectInfo(id, &info));
+    if(info.type != LISTOBJ)
+        throw ZException("appendList called for wrong Object type");
+
+    ZBinary bin;
+    for(auto it = list.begin(); it.more(); ++it)
+        bin.write(it.get().raw(), ZUID_SIZE);
+    return guard.done(_listAppend(id, info, bin.raw(), bin.size()));
 }
 
 ZParcel::parcelerror ZParcel::storeFile(ZUID id, ZPath path){
+    ParcelWrite guard(this);
     CHECK_COMMON(__FUNCTION__);
-    parcelerror err;
+    CHECK_WRITE;
 
     // Open file
     ZFile infile(path, ZFile::READ);
@@ -223,54 +1660,293 @@ ZParcel::parcelerror ZParcel::storeFile(ZUID id, ZPath path){
     // Get filesize
     zu64 filesize = infile.fileSize();
 
+    ObjectInfo info;
+    parcelerror err = _getObjectInfo(id, &info);
+    if(err != ERR_NOEXIST)
+        return (err == OK ? ERR_EXISTS : err);
+
     // String object for name
     ZUID strid(ZUID::RANDOM);
-    ZString name = ZPath(path).relativeTo(ZPath::pwd()).str();  // Get relative path
-    err = storeString(strid, name);
-    if(err != OK)
-        return err;
+    RETERR(_storeFileName(strid, path));
 
     // Blob object for data
     ZUID dataid(ZUID::RANDOM);
-    ZBinary fbin;
-    fbin.writebeu64(filesize);
-    err = _storeObject(dataid, BLOBOBJ, fbin, filesize);
-    if(err != OK)
+    const bool dedup = !!(_header->flags & OPT_DEDUP);
+    zu8 flags;
+    zu64 dsize;
+    zu32 hash = 0;
+    _fileSizing(infile, filesize, &flags, &dsize, (dedup ? &hash : nullptr));
+
+    err = ERR_NOEXIST;
+    if(dedup){
+        err = _dedupFind(filesize, hash, [this, &path, filesize](const ObjectInfo &cand){
+            ZFile cmp(path, ZFile::READ);
+            return (cmp.isOpen() && _dedupSame(cand, cmp, filesize));
+        }, &info);
+    }
+    if(err == OK){
+        RETERR(_storeShared(dataid, info));
+    } else if(err == ERR_NOEXIST){
+        info.type = BLOBOBJ;
+        info.inlined = false;
+        info.compressed = !!flags;
+        RETERR(_storeFileData(dataid, filesize, dsize, flags, &info.data.offset, &info.data.size));
+        RETERR(_fileData(infile, path, filesize, flags, dsize, info.data.offset, info.data.size));
+        if(dedup){
+            _dedup->add(info);
+            _dedup->hash(info.data.offset, ParcelDedup::Key(filesize, hash));
+        }
+    } else {
         return err;
+    }
 
     // Add node with filename
-    ZBinary bin;
-    bin.write(strid.bin());
-    bin.write(dataid.bin());
-    err = _storeObject(id, FILEOBJ, bin);
-    if(err != OK)
-        return err;
+    return guard.done(_storeFileObject(id, strid, dataid));
+}
 
-    // Get data offset
-    ObjectInfo info;
-    err = _getObjectInfo(dataid, &info);
-    if(err != OK)
+ZParcel::parcelerror ZParcel::storeFiles(const ZArray<ZUID> &ids, const ZArray<ZPath> &paths, ZArray<parcelerror> *errors){
+    ParcelWrite guard(this);
+    CHECK_COMMON(__FUNCTION__);
+    CHECK_WRITE;
+    if(ids.size() != paths.size())
+        throw ZException("storeFiles: ids and paths differ in length");
+
+    struct Job {
+        zu64 filesize;
+        zu8 flags;
+        zu64 dsize;
+        zu32 hash;
+        //! Data node, new or shared with a stored object or with job \a from.
+        ObjectInfo info;
+        bool alloc;
+        bool shared;
+        zu64 from;
+        //! Indexed jobs using the new data node of this job.
+        zu64 users;
+        parcelerror err;
+    };
+    std::vector<Job> jobs(ids.size());
+    const bool dedup = !!(_header->flags & OPT_DEDUP);
+    const zu64 threads = MIN(jobs.size(), (zu64)ZPARCEL_IO_THREADS);
+
+    // Size, and compress to find the compressed size, on the I/O threads
+    std::atomic<zu64> next(0);
+    _io->parallel(threads, [&](zu64){
+        for(zu64 i; (i = next++) < jobs.size(); ){
+            jobs[i].alloc = false;
+            jobs[i].shared = false;
+            jobs[i].from = i;
+            jobs[i].users = 0;
+            ZFile infile(paths[i], ZFile::READ);
+            if(!infile.isOpen()){
+                jobs[i].err = ERR_OPEN;
+                continue;
+            }
+            jobs[i].filesize = infile.fileSize();
+            _fileSizing(infile, jobs[i].filesize, &jobs[i].flags, &jobs[i].dsize, (dedup ? &jobs[i].hash : nullptr));
+            jobs[i].err = OK;
+        }
+    });
+
+    // Allocate data nodes on this thread, in one batch, without indexing anything yet
+    if(!_batch)
+        _batch = new ParcelBatch;
+    _batch->depth++;
+    // Jobs with new data nodes, by contents, since their data is not written yet
+    std::multimap<ParcelDedup::Key, zu64> pending;
+    parcelerror err = OK;
+    for(zu64 i = 0; err == OK && i < jobs.size(); ++i){
+        Job &job = jobs[i];
+        if(job.err != OK)
+            continue;
+        // Nothing is stored for a file whose id is taken
+        job.err = _getObjectInfo(ids[i], &job.info);
+        if(job.err != ERR_NOEXIST){
+            if(job.err == OK)
+                job.err = ERR_EXISTS;
+            continue;
+        }
+        job.err = OK;
+        parcelerror found = ERR_NOEXIST;
+        if(dedup){
+            const ParcelDedup::Key key(job.filesize, job.hash);
+            const ZPath &path = paths[i];
+            found = _dedupFind(job.filesize, job.hash, [this, &path, &job](const ObjectInfo &cand){
+                ZFile cmp(path, ZFile::READ);
+                return (cmp.isOpen() && _dedupSame(cand, cmp, job.filesize));
+            }, &job.info);
+            auto range = pending.equal_range(key);
+            for(auto it = range.first; found == ERR_NOEXIST && it != range.second; ++it){
+                const Job &prev = jobs[it->second];
+                if(sameFiles(paths[it->second], path, job.filesize)){
+                    job.info = prev.info;
+                    job.from = it->second;
+                    found = OK;
+                }
+            }
+            if(found != OK && found != ERR_NOEXIST)
+                job.err = found;
+        }
+        if(job.err == OK && found == OK){
+            job.shared = true;
+        } else if(job.err == OK){
+            job.info.type = BLOBOBJ;
+            job.info.inlined = false;
+            job.info.compressed = !!job.flags;
+            err = _nodeAlloc(_objectSize(BLOBOBJ, 8 + job.dsize), &job.info.data.offset, &job.info.data.size);
+            if(err != OK){
+                job.err = err;
+                break;
+            }
+            job.alloc = true;
+            if(dedup)
+                pending.insert({ ParcelDedup::Key(job.filesize, job.hash), i });
+        }
+    }
+    // Data is written after this, straight to the file unless an outer batch is still open
+    if(err != OK){
+        _commitBatch();
+        return err;
+    }
+    RETERR(_commitBatch());
+
+    // Write data into the new nodes, on the I/O threads
+    next = 0;
+    _io->parallel((_batch ? 1 : threads), [&](zu64){
+        for(zu64 i; (i = next++) < jobs.size(); ){
+            Job &job = jobs[i];
+            if(job.err != OK || job.shared)
+                continue;
+            ZFile infile(paths[i], ZFile::READ);
+            if(!infile.isOpen()){
+                job.err = ERR_OPEN;
+                continue;
+            }
+            // Length first, like _storeFileData()
+            zbyte fbin[8];
+            ZBinary::encbeu64(fbin, job.filesize);
+            job.err = _writeAt(job.info.data.offset, fbin, 8);
+            if(job.err == OK)
+                job.err = _fileData(infile, paths[i], job.filesize, job.flags, job.dsize,
+                                    job.info.data.offset, job.info.data.size);
+        }
+    });
+
+    // Index the files whose data was written, in one batch
+    if(!_batch)
+        _batch = new ParcelBatch;
+    _batch->depth++;
+    for(zu64 i = 0; err == OK && i < jobs.size(); ++i){
+        Job &job = jobs[i];
+        if(job.err != OK)
+            continue;
+        if(job.shared && job.from != i && jobs[job.from].err != OK){
+            job.err = jobs[job.from].err;
+            continue;
+        }
+        // Earlier files in this call may have taken the id
+        ObjectInfo info;
+        job.err = _getObjectInfo(ids[i], &info);
+        if(job.err != ERR_NOEXIST){
+            if(job.err == OK)
+                job.err = ERR_EXISTS;
+            continue;
+        }
+        const ZUID strid(ZUID::RANDOM);
+        const ZUID dataid(ZUID::RANDOM);
+        err = _storeFileName(strid, paths[i]);
+        if(err == OK){
+            // Data nodes of new files are counted as shared nodes only in OPT_DEDUP parcels
+            if(dedup)
+                err = _storeShared(dataid, job.info);
+            else
+                err = _storeObject(dataid, BLOBOBJ, ZBinary(), 0, nullptr,
+                                   (job.info.compressed ? ParcelPage::ENTRY_COMPRESSED : 0), nullptr, &job.info);
+        }
+        if(err == OK)
+            err = _storeFileObject(ids[i], strid, dataid);
+        job.err = err;
+        if(err == OK)
+            jobs[job.from].users++;
+    }
+    // New data nodes that no file refers to are given back, and the others can be shared by later stores
+    for(zu64 i = 0; err == OK && i < jobs.size(); ++i){
+        const Job &job = jobs[i];
+        if(!job.alloc)
+            continue;
+        if(job.users == 0)
+            err = _nodeFree(job.info.data.offset, job.info.data.size);
+        else if(dedup)
+            _dedup->hash(job.info.data.offset, ParcelDedup::Key(job.filesize, job.hash));
+    }
+    if(err != OK){
+        _commitBatch();
         return err;
+    }
+    RETERR(_commitBatch());
+
+    // Files that failed do not undo the others
+    const parcelerror werr = guard.done(OK);
+    parcelerror first = OK;
+    if(errors)
+        errors->clear();
+    for(const Job &job : jobs){
+        const parcelerror jerr = (job.err == OK ? werr : job.err);
+        if(first == OK)
+            first = jerr;
+        if(errors)
+            errors->push(jerr);
+    }
+    return first;
+}
 
-    // Write file data
-    zu64 poff = info.data.offset + 8;
-    if(_file->seek(poff) != poff)
-        return ERR_SEEK;
-    ZBinary buff;
-    while(!infile.atEnd()){
-        buff.clear();
-        // Read 2^15 block
-        if(infile.read(buff, 1 << 15) == 0)
-            break;
-        if(_file->write(buff.raw(), buff.size()) == 0)
-            return ERR_WRITE;
+ZParcel::parcelerror ZParcel::storeDirectory(ZPath dir, ZArray<ZUID> &ids, ZArray<ZPath> &paths, ZArray<parcelerror> *errors){
+    ids.clear();
+    paths.clear();
+#if ZPARCEL_POSIX
+    // Walk the tree in name order, without following links
+    std::vector<std::string> dirs = { dir.str().cc() };
+    std::vector<std::string> files;
+    while(!dirs.empty()){
+        const std::string cur = dirs.back();
+        dirs.pop_back();
+        DIR *dh = ::opendir(cur.c_str());
+        if(dh == nullptr)
+            return ERR_OPEN;
+        std::vector<std::string> subdirs;
+        for(struct dirent *ent; (ent = ::readdir(dh)) != nullptr; ){
+            if(strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+                continue;
+            const std::string name = cur + "/" + ent->d_name;
+            struct stat st;
+            if(::lstat(name.c_str(), &st) != 0)
+                continue;
+            if(S_ISDIR(st.st_mode))
+                subdirs.push_back(name);
+            else if(S_ISREG(st.st_mode))
+                files.push_back(name);
+        }
+        ::closedir(dh);
+        // Visit subdirectories in order from the stack
+        std::sort(subdirs.rbegin(), subdirs.rend());
+        dirs.insert(dirs.end(), subdirs.begin(), subdirs.end());
     }
-    return OK;
+    std::sort(files.begin(), files.end());
+
+    for(const std::string &name : files){
+        ids.push(ZUID(ZUID::RANDOM));
+        paths.push(ZPath(ZString(name.c_str())));
+    }
+    return storeFiles(ids, paths, errors);
+#else
+    return ERR_OPEN;
+#endif
 }
 
 // /////////////////////////////////////////////////////////////////////////////
 
 bool ZParcel::fetchBool(ZUID id){
+    ParcelLock::Shared guard(_lock);
     CHECK_COMMON(__FUNCTION__);
     ObjectInfo info;
     auto err = _getObjectInfo(id, &info);
@@ -283,6 +1959,7 @@ bool ZParcel::fetchBool(ZUID id){
 }
 
 zu64 ZParcel::fetchUint(ZUID id){
+    ParcelLock::Shared guard(_lock);
     CHECK_COMMON(__FUNCTION__);
     ObjectInfo info;
     auto err = _getObjectInfo(id, &info);
@@ -295,6 +1972,7 @@ zu64 ZParcel::fetchUint(ZUID id){
 }
 
 zs64 ZParcel::fetchSint(ZUID id){
+    ParcelLock::Shared guard(_lock);
     CHECK_COMMON(__FUNCTION__);
     ObjectInfo info;
     auto err = _getObjectInfo(id, &info);
@@ -307,6 +1985,7 @@ zs64 ZParcel::fetchSint(ZUID id){
 }
 
 double ZParcel::fetchFloat(ZUID id){
+    ParcelLock::Shared guard(_lock);
     CHECK_COMMON(__FUNCTION__);
     ObjectInfo info;
     auto err = _getObjectInfo(id, &info);
@@ -319,6 +1998,7 @@ double ZParcel::fetchFloat(ZUID id){
 }
 
 ZUID ZParcel::fetchZUID(ZUID id){
+    ParcelLock::Shared guard(_lock);
     CHECK_COMMON(__FUNCTION__);
     ObjectInfo info;
     auto err = _getObjectInfo(id, &info);
@@ -333,6 +2013,7 @@ ZUID ZParcel::fetchZUID(ZUID id){
 }
 
 ZBinary ZParcel::fetchBlob(ZUID id){
+    ParcelLock::Shared guard(_lock);
     CHECK_COMMON(__FUNCTION__);
     ObjectInfo info;
     auto err = _getObjectInfo(id, &info);
@@ -341,16 +2022,47 @@ ZBinary ZParcel::fetchBlob(ZUID id){
     if(info.type != BLOBOBJ)
         throw ZException("fetchBlob called for wrong Object type");
 
-    if(_file->seek(info.data.offset) != info.data.offset)
-        throw ZException("fetchBlob seek error");
-
-    zu64 len = _file->readbeu64();
-    ZBinary bin(len);
-    _file->read(bin.raw(), bin.size());
+    ZBinary bin;
+    err = _readPayload(info, &bin);
+    if(err != OK)
+        throw ZException("fetchBlob failed to read blob " + errorStr(err));
     return bin;
 }
 
+const zbyte *ZParcel::fetchBlobView(ZUID id, zu64 *size){
+    ParcelLock::Shared guard(_lock);
+    CHECK_COMMON(__FUNCTION__);
+    if(!_map)
+        throw ZException("fetchBlobView: parcel not mapped");
+    ObjectInfo info;
+    auto err = _getObjectInfo(id, &info);
+    if(err != OK)
+        throw ZException("fetchBlobView failed object info " + errorStr(err));
+    if(info.type != BLOBOBJ)
+        throw ZException("fetchBlobView called for wrong Object type");
+
+    if(info.inlined){
+        const zbyte *ptr = _mapInline(id, info.tree);
+        if(ptr == nullptr)
+            throw ZException("fetchBlobView object truncated");
+        *size = info.inlen;
+        return ptr;
+    }
+    if(info.compressed)
+        throw ZException("fetchBlobView: object is compressed");
+
+    const zbyte *ptr = _mapView(info.data.offset, info.data.size);
+    if(ptr == nullptr)
+        throw ZException("fetchBlobView object truncated");
+    zu64 len = ZBinary::decbeu64(ptr);
+    if(len > info.data.size - 8)
+        throw ZException("fetchBlobView bad blob size");
+    *size = len;
+    return ptr + 8;
+}
+
 ZPointer<ZBlockAccessor> ZParcel::fetchBlobReader(ZUID id){
+    ParcelLock::Shared guard(_lock);
     CHECK_COMMON(__FUNCTION__);
     ObjectInfo info;
     auto err = _getObjectInfo(id, &info);
@@ -359,16 +2071,158 @@ ZPointer<ZBlockAccessor> ZParcel::fetchBlobReader(ZUID id){
     if(info.type != BLOBOBJ)
         throw ZException("fetchBlobReader called for wrong Object type");
 
-    if(_file->seek(info.data.offset) != info.data.offset)
-        throw ZException("fetchBlobReader seek error");
+    if(info.inlined)
+        return new ZBinary(info.payload, info.inlen);
+    if(info.compressed)
+        return new ParcelCompressedAccessor(this, info.data.offset, info.data.size);
 
+    ParcelObjectAccessor accessor(this, info.data.offset, info.data.size);
     zu64 floffset = info.data.offset + 8;
-    zu64 flsize = info.accessor->readbeu64();
+    zu64 flsize = accessor.readbeu64();
+    if(flsize > info.data.size - 8)
+        throw ZException("fetchBlobReader bad blob size");
 //    DLOG("Fetch blob " << id.str() << " " << HEX(floffset) << " " << flsize);
-    return new ParcelObjectAccessor(_file, floffset, flsize);
+    return new ParcelObjectAccessor(this, floffset, flsize);
+}
+
+ZParcel::parcelerror ZParcel::fetchBlobTo(ZUID id, ZWriter &out){
+    ParcelLock::Shared guard(_lock);
+    CHECK_COMMON(__FUNCTION__);
+    return _fetchBlobTo(id, out);
+}
+
+ZParcel::parcelerror ZParcel::_fetchBlobTo(ZUID id, ZWriter &out){
+    ObjectInfo info;
+    zu64 offset;
+    zu64 len;
+    RETERR(_blobRange(id, "fetchBlobTo", &info, &offset, &len));
+
+    if(info.inlined)
+        return (out.write(info.payload, info.inlen) == info.inlen ? OK : ERR_WRITE);
+
+    if(info.compressed){
+        // The reader throws on read errors and bad chunks
+        try {
+            ParcelCompressedAccessor reader(this, info.data.offset, info.data.size);
+            ZBinary buff(ZPARCEL_COMPRESS_CHUNK);
+            while(!reader.atEnd()){
+                zu64 n = reader.read(buff.raw(), buff.size());
+                if(out.write(buff.raw(), n) != n)
+                    return ERR_WRITE;
+            }
+        } catch(ZException &){
+            return ERR_READ;
+        }
+        return OK;
+    }
+
+    if(_map){
+        // Write straight from mapping
+        const zbyte *ptr = _mapView(offset, len);
+        if(ptr == nullptr)
+            return ERR_TRUNC;
+        if(out.write(ptr, len) != len)
+            return ERR_WRITE;
+        return OK;
+    }
+
+    if(len <= ZPARCEL_COPY_CHUNK){
+        ZBinary buff(len);
+        RETERR(_readAt(offset, buff.raw(), len));
+        return (out.write(buff.raw(), len) == len ? OK : ERR_WRITE);
+    }
+
+    // The next chunk is read on the I/O threads while the current one is written, or here if no thread took it yet
+    struct Chunk {
+        zu64 pos;
+        ZBinary buff;
+        parcelerror err;
+        std::atomic<bool> taken;
+        bool full;
+        std::mutex mutex;
+        std::condition_variable cond;
+    };
+    auto start = [this, offset, len](zu64 pos, bool ahead){
+        std::shared_ptr<Chunk> chunk = std::make_shared<Chunk>();
+        chunk->pos = pos;
+        chunk->buff.resize(MIN(len - pos, (zu64)ZPARCEL_COPY_CHUNK));
+        chunk->taken = false;
+        chunk->full = false;
+        if(ahead){
+            // Tasks that start after the chunk was taken do nothing
+            _io->submit([this, chunk, offset]{
+                if(chunk->taken.exchange(true))
+                    return;
+                const parcelerror err = _readAt(offset + chunk->pos, chunk->buff.raw(), chunk->buff.size());
+                std::lock_guard<std::mutex> lk(chunk->mutex);
+                chunk->err = err;
+                chunk->full = true;
+                chunk->cond.notify_all();
+            });
+        }
+        return chunk;
+    };
+    auto finish = [this, offset](Chunk &chunk){
+        if(!chunk.taken.exchange(true))
+            return _readAt(offset + chunk.pos, chunk.buff.raw(), chunk.buff.size());
+        std::unique_lock<std::mutex> lk(chunk.mutex);
+        chunk.cond.wait(lk, [&chunk]{ return chunk.full; });
+        return chunk.err;
+    };
+
+    parcelerror err = OK;
+    std::shared_ptr<Chunk> next = start(0, false);
+    while(next){
+        std::shared_ptr<Chunk> chunk = next;
+        next = nullptr;
+        err = finish(*chunk);
+        if(err != OK)
+            break;
+        const zu64 end = chunk->pos + chunk->buff.size();
+        if(end < len)
+            next = start(end, true);
+        if(out.write(chunk->buff.raw(), chunk->buff.size()) != chunk->buff.size()){
+            err = ERR_WRITE;
+            break;
+        }
+    }
+    // A read still running uses the parcel
+    if(next)
+        finish(*next);
+    return err;
+}
+
+ZParcel::parcelerror ZParcel::fetchBlobTo(ZUID id, ZPath path){
+    ParcelLock::Shared guard(_lock);
+    CHECK_COMMON(__FUNCTION__);
+#if ZPARCEL_POSIX
+    // Buffered batch writes and logged writes are not in the file yet
+    if(_mapfd >= 0 || (_fd >= 0 && !_batch && _wal->overlay.empty())){
+        ObjectInfo info;
+        zu64 offset;
+        zu64 len;
+        RETERR(_blobRange(id, __FUNCTION__, &info, &offset, &len));
+
+        if(!info.inlined && !info.compressed){
+            int fd = ::open(path.str().cc(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if(fd < 0)
+                return ERR_OPEN;
+            parcelerror err = _copyToFd(fd, offset, len);
+            if(::close(fd) != 0 && err == OK)
+                err = ERR_WRITE;
+            return err;
+        }
+    }
+#endif
+
+    ZFile ofile(path, ZFile::WRITE);
+    if(!ofile.isOpen())
+        return ERR_OPEN;
+    return _fetchBlobTo(id, ofile);
 }
 
 ZString ZParcel::fetchString(ZUID id){
+    ParcelLock::Shared guard(_lock);
     CHECK_COMMON(__FUNCTION__);
     ObjectInfo info;
     auto err = _getObjectInfo(id, &info);
@@ -377,16 +2231,15 @@ ZString ZParcel::fetchString(ZUID id){
     if(info.type != STRINGOBJ)
         throw ZException("fetchString called for wrong Object type");
 
-    if(_file->seek(info.data.offset) != info.data.offset)
-        throw ZException("fetchString seek error");
-
-    zu64 len = _file->readbeu64();
-    ZBinary bin(len);
-    _file->read(bin.raw(), bin.size());
-    return ZString(bin.raw(), len);
+    ZBinary bin;
+    err = _readPayload(info, &bin);
+    if(err != OK)
+        throw ZException("fetchString failed to read string " + errorStr(err));
+    return ZString(bin.raw(), bin.size());
 }
 
 ZList<ZUID> ZParcel::fetchList(ZUID id){
+    ParcelLock::Shared guard(_lock);
     CHECK_COMMON(__FUNCTION__);
     ObjectInfo info;
     auto err = _getObjectInfo(id, &info);
@@ -395,26 +2248,74 @@ ZList<ZUID> ZParcel::fetchList(ZUID id){
     if(info.type != LISTOBJ)
         throw ZException("fetchList called for wrong Object type");
 
-    if(_file->seek(info.data.offset) != info.data.offset)
-        throw ZException("fetchList seek error");
-
-    zu64 len = _file->readbeu64();
-    if(len * ZUID_SIZE > info.data.size)
+    zu64 len;
+    err = _listSize(info, &len);
+    if(err != OK)
         throw ZException("fetchList bad list size");
 
+    // Children read in chunks
     ZList<ZUID> list;
-    for(zu64 i = 0; i < len; ++i){
-        zbyte bin[ZUID_SIZE];
-        if(_file->read(bin, ZUID_SIZE) != ZUID_SIZE)
-            throw ZException("fetchList failed to read");
-        ZUID uid;
-        uid.fromRaw(bin);
-        list.push(uid);
+    ZArray<ZUID> chunk;
+    for(zu64 i = 0; i < len; i += ZPARCEL_LIST_CHUNK){
+        err = _listRead(info, i, ZPARCEL_LIST_CHUNK, chunk);
+        if(err != OK)
+            throw ZException("fetchList failed to read " + errorStr(err));
+        for(zu64 j = 0; j < chunk.size(); ++j)
+            list.push(chunk[j]);
     }
     return list;
 }
 
+zu64 ZParcel::fetchListSize(ZUID id){
+    ParcelLock::Shared guard(_lock);
+    CHECK_COMMON(__FUNCTION__);
+    ObjectInfo info;
+    auto err = _getObjectInfo(id, &info);
+    if(err != OK)
+        throw ZException("fetchListSize failed object info " + errorStr(err));
+    if(info.type != LISTOBJ)
+        throw ZException("fetchListSize called for wrong Object type");
+
+    zu64 len;
+    err = _listSize(info, &len);
+    if(err != OK)
+        throw ZException("fetchListSize bad list size");
+    return len;
+}
+
+ZParcel::parcelerror ZParcel::fetchListRange(ZUID id, zu64 start, zu64 count, ZArray<ZUID> &out){
+    ParcelLock::Shared guard(_lock);
+    CHECK_COMMON(__FUNCTION__);
+    out.clear();
+    ObjectInfo info;
+    RETERR(_getObjectInfo(id, &info));
+    if(info.type != LISTOBJ)
+        throw ZException("fetchListRange called for wrong Object type");
+    return _listRead(info, start, count, out);
+}
+
+ZParcel::ListReader ZParcel::listReader(ZUID id, zu64 start){
+    ParcelLock::Shared guard(_lock);
+    CHECK_COMMON(__FUNCTION__);
+    return ListReader(this, id, start);
+}
+
+bool ZParcel::ListReader::next(ZUID &uid){
+    while(_pos >= _batch.size()){
+        if(_done)
+            return false;
+        _err = _parcel->_listFill(this);
+        if(_err != OK){
+            _done = true;
+            return false;
+        }
+    }
+    uid = _batch[_pos++];
+    return true;
+}
+
 ZParcel::parcelerror ZParcel::fetchFile(ZUID id, ZUID &nameid, ZUID &dataid){
+    ParcelLock::Shared guard(_lock);
     CHECK_COMMON(__FUNCTION__);
     ObjectInfo info;
     auto err = _getObjectInfo(id, &info);
@@ -423,16 +2324,14 @@ ZParcel::parcelerror ZParcel::fetchFile(ZUID id, ZUID &nameid, ZUID &dataid){
     if(info.type != FILEOBJ)
         throw ZException("fetchFile called for wrong Object type");
 
-    if(_file->seek(info.data.offset) != info.data.offset)
-        throw ZException("fetchFile seek error");
-
+    ParcelObjectAccessor accessor(this, info.data.offset, info.data.size);
     zbyte nibin[ZUID_SIZE];
-    if(_file->read(nibin, ZUID_SIZE) != ZUID_SIZE)
+    if(accessor.read(nibin, ZUID_SIZE) != ZUID_SIZE)
         throw ZException("fetchFile failed to read");
     nameid.fromRaw(nibin);
 
     zbyte dibin[ZUID_SIZE];
-    if(_file->read(dibin, ZUID_SIZE) != ZUID_SIZE)
+    if(accessor.read(dibin, ZUID_SIZE) != ZUID_SIZE)
         throw ZException("fetchFile failed to read");
     dataid.fromRaw(dibin);
 
@@ -441,392 +2340,3739 @@ ZParcel::parcelerror ZParcel::fetchFile(ZUID id, ZUID &nameid, ZUID &dataid){
 
 // /////////////////////////////////////////////////////////////////////////////
 
+ZParcel::parcelerror ZParcel::fetchMany(const ZArray<ZUID> &ids, ZArray<ZBinary> &out, ZArray<parcelerror> *errors){
+    ParcelLock::Shared guard(_lock);
+    CHECK_COMMON(__FUNCTION__);
+    ZArray<ObjectInfo> infos;
+    ZArray<parcelerror> errs;
+    parcelerror err = _fetchMany(ids, BLOBOBJ, infos, errs, &out);
+    if(errors)
+        *errors = errs;
+    return err;
+}
+
+std::future<ZBinary> ZParcel::fetchBlobAsync(ZUID id){
+    auto task = std::make_shared<std::packaged_task<ZBinary()>>([this, id]{
+        return fetchBlob(id);
+    });
+    std::future<ZBinary> result = task->get_future();
+    _io->submit([task]{ (*task)(); });
+    return result;
+}
+
+std::future<ZParcel::parcelerror> ZParcel::fetchManyAsync(const ZArray<ZUID> &ids, ZArray<ZBinary> *out, ZArray<parcelerror> *errors){
+    auto task = std::make_shared<std::packaged_task<parcelerror()>>([this, ids, out, errors]{
+        return fetchMany(ids, *out, errors);
+    });
+    std::future<parcelerror> result = task->get_future();
+    _io->submit([task]{ (*task)(); });
+    return result;
+}
+
+ZParcel::parcelerror ZParcel::fetchManyString(const ZArray<ZUID> &ids, ZArray<ZString> &out, ZArray<parcelerror> *errors){
+    ParcelLock::Shared guard(_lock);
+    CHECK_COMMON(__FUNCTION__);
+    ZArray<ObjectInfo> infos;
+    ZArray<parcelerror> errs;
+    ZArray<ZBinary> bins;
+    parcelerror err = _fetchMany(ids, STRINGOBJ, infos, errs, &bins);
+    out.clear();
+    for(zu64 i = 0; i < bins.size(); ++i)
+        out.push(ZString(bins[i].raw(), bins[i].size()));
+    if(errors)
+        *errors = errs;
+    return err;
+}
+
+ZParcel::parcelerror ZParcel::fetchManyUint(const ZArray<ZUID> &ids, ZArray<zu64> &out, ZArray<parcelerror> *errors){
+    ParcelLock::Shared guard(_lock);
+    CHECK_COMMON(__FUNCTION__);
+    ZArray<ObjectInfo> infos;
+    ZArray<parcelerror> errs;
+    parcelerror err = _fetchMany(ids, UINTOBJ, infos, errs, nullptr);
+    out.clear();
+    for(zu64 i = 0; i < infos.size(); ++i)
+        out.push(errs[i] == OK ? ZBinary::decbeu64(infos[i].payload) : 0);
+    if(errors)
+        *errors = errs;
+    return err;
+}
+
+// /////////////////////////////////////////////////////////////////////////////
+
 ZParcel::parcelerror ZParcel::removeObject(ZUID id){
+    ParcelWrite guard(this);
     CHECK_COMMON(__FUNCTION__);
+    CHECK_WRITE;
+    if(_header->version == VERSION2){
+        PagePath path;
+        ParcelPage leaf(this, ZU64_MAX);
+        RETERR(_pageFind(_header->treehead, id, &path, &leaf));
+
+        ObjectInfo info;
+        _pageEntryInfo(leaf.entry(path.index[path.depth - 1]), &info);
+        leaf.removeEntry(path.index[path.depth - 1]);
+        RETERR(leaf.write());
+        _cache->erase(id);
+        _index->erase(id, info.type);
+
+        if(info.type >= BLOBOBJ && !info.inlined && !_dedup->release(info.data.offset)){
+            RETERR(_nodeFree(info.data.offset, info.data.size));
+        }
+        return guard.done(OK);
+    }
+
     ObjectInfo info;
     RETERR(_getObjectInfo(id, &info));
+    _cache->erase(id);
 
     ParcelTreeNode node(this, info.tree);
     RETERR(node.read());
     node.type = NULLOBJ;
     RETERR(node.write());
+    _index->erase(id, info.type);
 
-    if(info.type >= BLOBOBJ){
-        RETERR(_nodeFree(node.data.offset, node.data.size + node.extra));
+    if(info.type >= BLOBOBJ && !_dedup->release(node.data.offset)){
+        RETERR(_nodeFree(node.data.offset, node.data.size));
     }
 
-    return OK;
+    return guard.done(OK);
 }
 
 ZUID ZParcel::getRoot(){
+    ParcelLock::Shared guard(_lock);
     CHECK_COMMON(__FUNCTION__);
     return _header->root;
 }
 
 ZParcel::parcelerror ZParcel::setRoot(ZUID id){
+    ParcelWrite guard(this);
     CHECK_COMMON(__FUNCTION__);
+    CHECK_WRITE;
     _header->root = id;
     RETERR(_header->write());
-    return OK;
+    return guard.done(OK);
 }
 
 // /////////////////////////////////////////////////////////////////////////////
 
-void ZParcel::listObjects(){
-    _listStep(_header->treehead, 0);
-}
+ZParcel::parcelerror ZParcel::verify(VerifyReport *report){
+    ParcelLock::Shared guard(_lock);
+    CHECK_COMMON(__FUNCTION__);
 
-void ZParcel::_listStep(zu64 next, zu16 depth){
-    if(next == ZU64_MAX)
+    enum { INDEX, DATA, FREE };
+    struct Extent {
+        zu64 offset;
+        zu64 size;
+        ZUID id;
+        zu8 kind;
+        objtype type;
+        bool compressed;
+    };
+    std::vector<Extent> extents;
+    std::unordered_set<zu64> seen;
+
+    report->objects = 0;
+    report->nodes = 0;
+    report->freenodes = 0;
+    report->payloads = 0;
+    report->bytes = 0;
+    report->errors.clear();
+    auto fail = [report](const ZUID &id, zu64 offset, parcelerror err){
+        VerifyError verr;
+        verr.id = id;
+        verr.offset = offset;
+        verr.err = err;
+        report->errors.push(verr);
+    };
+    auto add = [&extents](zu64 offset, zu64 size, const ZUID &id, zu8 kind, objtype type, bool compressed){
+        Extent ext = { offset, size, id, kind, type, compressed };
+        extents.push_back(ext);
+    };
+
+    // Read every node from the file, even if it was verified before
+    _pool->recheck();
+
+    ParcelHeader header(this, 0);
+    parcelerror err = header.read();
+    if(err != OK)
+        fail(ZUID_NIL, 0, err);
+    add(0, ParcelHeader::NODE_SIZE, ZUID_NIL, INDEX, NULLOBJ, false);
+    if(_bins){
+        ParcelBinTable bins(this, _bins->offset);
+        err = bins.read();
+        if(err != OK)
+            fail(ZUID_NIL, _bins->offset, err);
+        add(_bins->offset, ParcelBinTable::NODE_SIZE, ZUID_NIL, INDEX, NULLOBJ, false);
+    }
+
+    // Index
+    if(_header->version == VERSION3){
+        // The table from the file, with ids in order
+        PackRecord rec;
+        err = _readAt(_header->treehead, (zbyte *)&rec, sizeof(rec));
+        if(err == OK && rec.magic != ZPARCEL_PACK_MAGIC)
+            err = ERR_MAGIC;
+        if(err == OK && _nodeChecksum(_header->flags, (const zbyte *)&rec, sizeof(rec), offsetof(PackRecord, crc)) != rec.crc)
+            err = ERR_CRC;
+        if(err == OK && rec.count != _pack->count)
+            err = ERR_TREE;
+        ZBinary table;
+        if(err == OK){
+            table.resize(_pack->count * ParcelPage::LEAF_SIZE);
+            err = _readAt(_pack->offset, table.raw(), table.size());
+        }
+        if(err == OK && _checksum(table.raw(), table.size()) != rec.tablecrc)
+            err = ERR_CRC;
+        if(err != OK){
+            fail(ZUID_NIL, _header->treehead, err);
+        } else {
+            ++report->nodes;
+            add(_header->treehead, ZPARCEL_PACK_ALIGN + table.size(), ZUID_NIL, INDEX, NULLOBJ, false);
+            const zbyte *prev = nullptr;
+            for(zu64 k = eytzFirst(_pack->count); k; k = eytzNext(k, _pack->count)){
+                const zbyte *entry = table.raw() + (k - 1) * ParcelPage::LEAF_SIZE;
+                ZUID id;
+                id.fromRaw(entry);
+                if(prev && pageKeyCompare(prev, id) >= 0)
+                    fail(id, _pack->offset + (k - 1) * ParcelPage::LEAF_SIZE, ERR_TREE);
+                prev = entry;
+                ObjectInfo info;
+                _pageEntryInfo(entry, &info);
+                ++report->objects;
+                if(info.type >= BLOBOBJ && !info.inlined)
+                    add(info.data.offset, info.data.size, id, DATA, info.type, info.compressed);
+            }
+        }
+    } else if(_header->version == VERSION2){
+        // Pages with the level each must have, unknown for the root
+        std::vector<std::pair<zu64, int>> stack;
+        if(_header->treehead != ZU64_MAX)
+            stack.push_back({ _header->treehead, -1 });
+        while(!stack.empty()){
+            const auto top = stack.back();
+            stack.pop_back();
+            if(!seen.insert(top.first).second){
+                fail(ZUID_NIL, top.first, ERR_TREE);
+                continue;
+            }
+
+            ParcelPage page(this, top.first);
+            err = page.read();
+            if(err == OK && top.second >= 0 && page.level != top.second)
+                err = ERR_TREE;
+            if(err != OK){
+                fail(ZUID_NIL, top.first, err);
+                continue;
+            }
+            ++report->nodes;
+            add(top.first, ParcelPage::PAGE_SIZE, ZUID_NIL, INDEX, NULLOBJ, false);
+
+            if(page.level){
+                for(zu16 i = 0; i <= page.count; ++i)
+                    stack.push_back({ page.child(i), page.level - 1 });
+                continue;
+            }
+            for(zu16 i = 0; i < page.count; ++i){
+                ObjectInfo info;
+                _pageEntryInfo(page.entry(i), &info);
+                ++report->objects;
+                if(info.type >= BLOBOBJ && !info.inlined){
+                    ZUID id;
+                    id.fromRaw(page.entry(i));
+                    add(info.data.offset, info.data.size, id, DATA, info.type, info.compressed);
+                }
+            }
+        }
+    } else {
+        // Tree nodes with their depth
+        std::vector<std::pair<zu64, zu64>> stack;
+        if(_header->treehead != ZU64_MAX)
+            stack.push_back({ _header->treehead, 0 });
+        while(!stack.empty()){
+            const auto top = stack.back();
+            stack.pop_back();
+            if(!seen.insert(top.first).second){
+                fail(ZUID_NIL, top.first, ERR_TREE);
+                continue;
+            }
+            if(top.second >= ZPARCEL_MAX_DEPTH){
+                fail(ZUID_NIL, top.first, ERR_MAX_DEPTH);
+                continue;
+            }
+
+            ParcelTreeNode node(this, top.first);
+            err = node.read();
+            if(err != OK){
+                fail(ZUID_NIL, top.first, err);
+                continue;
+            }
+            ++report->nodes;
+            add(top.first, ParcelTreeNode::NODE_SIZE + node.extra, node.uid, INDEX, NULLOBJ, false);
+
+            if(node.type != NULLOBJ)
+                ++report->objects;
+            if(node.type >= BLOBOBJ)
+                add(node.data.offset, node.data.size, node.uid, DATA, node.type, false);
+            if(node.lnode != ZU64_MAX)
+                stack.push_back({ node.lnode, top.second + 1 });
+            if(node.rnode != ZU64_MAX)
+                stack.push_back({ node.rnode, top.second + 1 });
+        }
+    }
+
+    // Free nodes, from the file like _freeLoad()
+    const zu8 lists = (_bins ? ParcelBinTable::BINS : 1);
+    for(zu8 b = 0; b < lists; ++b){
+        for(zu64 next = (_bins ? _bins->head[b] : _header->freehead); next != ZU64_MAX; ){
+            if(!seen.insert(next).second){
+                fail(ZUID_NIL, next, ERR_FREELIST);
+                break;
+            }
+            zu64 size;
+            zu64 link;
+            if(_bins){
+                ParcelBinNode node(this, next);
+                err = node.read();
+                size = node.size;
+                link = node.next;
+            } else {
+                ParcelFreeNode node(this, next);
+                err = node.read();
+                size = node.size;
+                link = node.next;
+            }
+            if(err != OK){
+                fail(ZUID_NIL, next, err);
+                break;
+            }
+            ++report->freenodes;
+            add(next, size, ZUID_NIL, FREE, NULLOBJ, false);
+            next = link;
+        }
+    }
+
+    // Nodes must not overlap or run past the tail
+    std::sort(extents.begin(), extents.end(), [](const Extent &a, const Extent &b){
+        return a.offset < b.offset;
+    });
+    std::vector<const Extent *> data;
+    const Extent *last = nullptr;
+    zu64 end = 0;
+    const bool dedup = !!(_header->flags & OPT_DEDUP);
+    for(const Extent &ext : extents){
+        if(ext.size > _header->tailptr || ext.offset > _header->tailptr - ext.size){
+            fail(ext.id, ext.offset, ERR_TRUNC);
+            continue;
+        }
+        // Shared data nodes are checked once
+        if(dedup && last && ext.kind == DATA && last->kind == DATA && ext.type == BLOBOBJ && last->type == BLOBOBJ &&
+                ext.offset == last->offset && ext.size == last->size && ext.compressed == last->compressed)
+            continue;
+        if(last && ext.offset < end)
+            fail(ext.id, ext.offset, (ext.kind == FREE || last->kind == FREE) ? ERR_FREELIST : ERR_TREE);
+        if(ext.offset + ext.size > end){
+            end = ext.offset + ext.size;
+            last = &ext;
+        }
+        if(ext.kind == DATA)
+            data.push_back(&ext);
+    }
+
+    // Data nodes in file order, so the threads read mostly sequentially
+    std::vector<parcelerror> results(data.size(), OK);
+    std::atomic<zu64> next(0);
+    std::atomic<zu64> bytes(0);
+    _io->parallel(MIN(data.size(), (zu64)ZPARCEL_IO_THREADS), [&](zu64){
+        ZBinary buff;
+        for(zu64 i; (i = next++) < data.size(); ){
+            const Extent *ext = data[i];
+            results[i] = _verifyPayload(ext->offset, ext->size, ext->type, ext->compressed, buff);
+            bytes += ext->size;
+        }
+    });
+    for(zu64 i = 0; i < data.size(); ++i){
+        if(results[i] != OK)
+            fail(data[i]->id, data[i]->offset, results[i]);
+    }
+    report->payloads = data.size();
+    report->bytes = bytes;
+
+    return (report->errors.size() ? report->errors[0].err : OK);
+}
+
+ZParcel::parcelerror ZParcel::compact(CompactReport *report){
+    ParcelWrite guard(this);
+    CHECK_COMMON(__FUNCTION__);
+    CHECK_WRITE;
+    if(_batch || _build)
+        throw ZException("compact: batch open");
+    // Data is copied around the journal, so no logged write may be waiting for it
+    if(_wal->on)
+        RETERR(_walCheckpoint());
+    return guard.done(_compact(report));
+}
+
+ZParcel::parcelerror ZParcel::_compact(CompactReport *report){
+
+    CompactReport rep;
+    rep.objects = 0;
+    rep.removed = 0;
+    rep.moved = 0;
+    rep.bytes = 0;
+    rep.oldsize = _fileSize();
+
+    // Live objects in UUID order
+    std::vector<ParcelBuild::Entry> entries;
+    RETERR(_walkEntries([&entries](const zbyte *entry){
+        ParcelBuild::Entry ent;
+        memcpy(ent.raw, entry, ParcelPage::LEAF_SIZE);
+        entries.push_back(ent);
+    }, &rep.removed));
+    rep.objects = entries.size();
+
+    // Data nodes in file order
+    struct Payload {
+        zu64 offset;
+        zu64 size;
+        zu64 entry;
+        zu64 node;
+    };
+    std::vector<Payload> payloads;
+    for(zu64 i = 0; i < entries.size(); ++i){
+        ObjectInfo info;
+        _pageEntryInfo(entries[i].raw, &info);
+        if(info.type >= BLOBOBJ && !info.inlined)
+            payloads.push_back({ info.data.offset, info.data.size, i, 0 });
+    }
+    std::sort(payloads.begin(), payloads.end(), [](const Payload &a, const Payload &b){
+        return a.offset < b.offset;
+    });
+
+    // Each data node once, objects may share one
+    struct Node {
+        zu64 offset;
+        zu64 size;
+    };
+    std::vector<Node> nodes;
+    const zu64 start = (_bins ? _bins->offset + ParcelBinTable::NODE_SIZE : ParcelHeader::NODE_SIZE);
+    zu64 end = start;
+    const bool dedup = !!(_header->flags & OPT_DEDUP);
+    for(zu64 i = 0; i < payloads.size(); ++i){
+        Payload &pl = payloads[i];
+        if(dedup && i && pl.offset == payloads[i - 1].offset && pl.size == payloads[i - 1].size){
+            pl.node = nodes.size() - 1;
+            continue;
+        }
+        if(pl.offset < end)
+            return ERR_TREE;
+        if(pl.size > _header->tailptr || pl.offset > _header->tailptr - pl.size)
+            return ERR_TRUNC;
+        end = pl.offset + pl.size;
+        pl.node = nodes.size();
+        nodes.push_back({ pl.offset, pl.size });
+    }
+
+    // Data already packed at the front stays, the rest moves down after it
+    zu64 keep = 0;
+    zu64 base = start;
+    while(keep < nodes.size() && nodes[keep].offset == base)
+        base += nodes[keep++].size;
+    std::vector<zu64> rel(nodes.size(), 0);
+    zu64 moving = 0;
+    for(zu64 i = keep; i < nodes.size(); ++i){
+        rel[i] = moving;
+        moving += nodes[i].size;
+    }
+
+    // Size of the dense index
+    const zu64 count = entries.size();
+    zu64 isize = count * ParcelTreeNode::NODE_SIZE;
+    if(_header->version == VERSION2){
+        zu64 pages = 0;
+        for(zu64 n = (count + ParcelPage::LEAF_MAX - 1) / ParcelPage::LEAF_MAX; n; n = (n > 1 ? (n + ParcelPage::INNER_MAX) / (ParcelPage::INNER_MAX + 1) : 0))
+            pages += n;
+        isize = pages * ParcelPage::PAGE_SIZE;
+    }
+
+    /* Nothing the header refers to is written until it no longer does. The moving data and an index
+     * of it are copied past everything referenced, to the free node at the tail or past the tail,
+     * and the header is switched to them. The data is then copied down into its old space, which
+     * the switch freed, followed by the final index, and the header is switched again. If the final
+     * index would overlap the staged copies, it is staged and switched to once more first.
+     */
+    const zu64 tail = _header->tailptr;
+    zu64 stage = tail;
+    if(!_free->spans.empty()){
+        auto last = std::prev(_free->spans.end());
+        if(last->first + last->second.size == tail)
+            stage = last->first;
+    }
+    const bool direct = (base + moving + isize <= stage);
+    const bool extend = (_header->flags & OPT_TAIL_EXTEND);
+    if(!extend && stage + moving + isize * (direct ? 1 : 2) > tail)
+        return ERR_NOFREE;
+
+    // Each switch syncs the nodes it refers to before the header, and the header before their space is reused
+    auto commit = [this]() -> parcelerror {
+        RETERR(_buildFlush());
+        if(!_fileSync())
+            return ERR_WRITE;
+        RETERR(_header->write());
+        RETERR(_buildFlush());
+        if(!_fileSync())
+            return ERR_WRITE;
+        _cache->clear();
+        _pool->clear();
+        return OK;
+    };
+
+    // Copy the moving data nodes to \a to in file order, and point their objects at the copies
+    std::vector<zu64> cur(nodes.size());
+    for(zu64 i = 0; i < nodes.size(); ++i)
+        cur[i] = nodes[i].offset;
+    ZBinary buff;
+    auto relocate = [&](zu64 to) -> parcelerror {
+        for(zu64 i = keep; i < nodes.size(); ){
+            // Runs of adjacent nodes are copied together
+            const zu64 src = cur[i];
+            zu64 len = nodes[i].size;
+            zu64 j = i + 1;
+            for(; j < nodes.size() && cur[j] == src + len; ++j)
+                len += nodes[j].size;
+            buff.resize(MIN(len, (zu64)ZPARCEL_COPY_CHUNK));
+            for(zu64 done = 0; done < len; ){
+                const zu64 n = MIN(len - done, buff.size());
+                RETERR(_readAt(src + done, buff.raw(), n));
+                if(!_fileWrite(to + rel[i] + done, buff.raw(), n))
+                    return ERR_WRITE;
+                done += n;
+            }
+            for(zu64 k = i; k < j; ++k)
+                cur[k] = to + rel[k];
+            i = j;
+        }
+        for(const Payload &pl : payloads)
+            ZBinary::encbeu64(_build->entries[pl.entry].raw + ZUID_SIZE + 2 + 8, cur[pl.node]);
+        return OK;
+    };
+
+    // Write the index densely at \a at, staged as sequential writes like a build
+    auto writeIndex = [&](zu64 at) -> parcelerror {
+        std::vector<ParcelBuild::Entry> &ents = _build->entries;
+        _header->tailptr = at;
+        if(_header->version == VERSION2){
+            zu64 head;
+            RETERR(_buildIndex(&head));
+            _header->treehead = head;
+            return OK;
+        }
+
+        // Balanced tree of nodes in UUID order, each range rooted at its middle
+        auto node = [at](zu64 i){ return at + i * ParcelTreeNode::NODE_SIZE; };
+        std::vector<std::pair<zu64, zu64>> links(count, { ZU64_MAX, ZU64_MAX });
+        std::vector<std::pair<zu64, zu64>> ranges;
+        if(count)
+            ranges.push_back({ 0, count });
+        while(!ranges.empty()){
+            const auto r = ranges.back();
+            ranges.pop_back();
+            const zu64 mid = r.first + (r.second - r.first) / 2;
+            if(r.first < mid){
+                links[mid].first = node(r.first + (mid - r.first) / 2);
+                ranges.push_back({ r.first, mid });
+            }
+            if(mid + 1 < r.second){
+                links[mid].second = node(mid + 1 + (r.second - mid - 1) / 2);
+                ranges.push_back({ mid + 1, r.second });
+            }
+        }
+
+        for(zu64 i = 0; i < count; ++i){
+            ParcelTreeNode tnode(this, node(i));
+            tnode.uid.fromRaw(ents[i].raw);
+            tnode.lnode = links[i].first;
+            tnode.rnode = links[i].second;
+            tnode.type = ents[i].raw[ZUID_SIZE];
+            tnode.extra = 0;
+            memcpy(tnode.payload, ents[i].raw + ZUID_SIZE + 2, 16);
+            if(tnode.type >= BLOBOBJ){
+                tnode.data.size = ZBinary::decbeu64(tnode.payload);
+                tnode.data.offset = ZBinary::decbeu64(tnode.payload + 8);
+            }
+            RETERR(tnode.write());
+        }
+        RETERR(_buildFlush());
+        _header->treehead = (count ? node(count / 2) : ZU64_MAX);
+        _header->tailptr = node(count);
+        return OK;
+    };
+
+    _build = new ParcelBuild;
+    _build->entries.swap(entries);
+
+    // Free nodes are overwritten from here on, so the free lists are dropped first. Until the end, free space is lost.
+    _free->clear();
+    if(_bins){
+        for(zu8 b = 0; b < ParcelBinTable::BINS; ++b)
+            _bins->head[b] = ZU64_MAX;
+    } else {
+        _header->freehead = ZU64_MAX;
+        _header->freetail = ZU64_MAX;
+    }
+    parcelerror err = (_bins ? _bins->write() : OK);
+    if(err == OK)
+        err = commit();
+
+    // Staged copies
+    if(err == OK)
+        err = relocate(stage);
+    if(err == OK)
+        err = writeIndex(stage + moving);
+    if(err == OK){
+        _header->tailptr = MAX(tail, _header->tailptr);
+        err = commit();
+    }
+
+    // Final copies
+    if(err == OK)
+        err = relocate(base);
+    if(err == OK && !direct){
+        err = writeIndex(stage + moving + isize);
+        if(err == OK){
+            _header->tailptr = MAX(tail, _header->tailptr);
+            err = commit();
+        }
+    }
+    if(err == OK)
+        err = writeIndex(base + moving);
+    if(err == OK){
+        // Keep the initial size, or the old size if the file cannot grow
+        end = _header->tailptr;
+        _header->tailptr = (extend ? MAX(end, (zu64)ZPARCEL_INIT_PAD) : MAX(end, rep.oldsize));
+        err = commit();
+    }
+    delete _build;
+    _build = nullptr;
+    if(err != OK){
+        // The file is as of the last switch, with the free space lost
+        _reloadState();
+        return err;
+    }
+
+    if(extend && !_fileTruncate(_header->tailptr))
+        return ERR_WRITE;
+    // The journal is empty, so the file is the only state left
+    _wal->tail = _header->tailptr;
+    if(_header->tailptr > end)
+        RETERR(_nodeFree(end, _header->tailptr - end));
+
+    // Hashed shared data nodes keep their hashes where they moved
+    std::unordered_map<zu64, zu64> moved;
+    for(zu64 i = 0; i < nodes.size(); ++i){
+        moved[nodes[i].offset] = cur[i];
+        if(cur[i] != nodes[i].offset){
+            ++rep.moved;
+            rep.bytes += nodes[i].size;
+        }
+    }
+    std::vector<std::pair<zu64, ParcelDedup::Key>> hashes;
+    for(const auto &node : _dedup->nodes){
+        auto it = moved.find(node.first);
+        if(node.second.hashed && it != moved.end())
+            hashes.push_back({ it->second, node.second.key });
+    }
+    RETERR(_dedupLoad());
+    for(const auto &h : hashes)
+        _dedup->hash(h.first, h.second);
+    _dedup->filled = (hashes.size() == _dedup->nodes.size());
+
+    rep.newsize = _fileSize();
+    if(report)
+        *report = rep;
+    return OK;
+}
+
+ZParcel::parcelerror ZParcel::pack(ZPath path){
+    ParcelLock::Shared guard(_lock);
+    CHECK_COMMON(__FUNCTION__);
+    if(_batch || _build)
+        throw ZException("pack: batch open");
+
+    // Live objects in UUID order
+    std::vector<ParcelBuild::Entry> entries;
+    RETERR(_walkEntries([&entries](const zbyte *entry){
+        ParcelBuild::Entry ent;
+        memcpy(ent.raw, entry, ParcelPage::LEAF_SIZE);
+        entries.push_back(ent);
+    }));
+
+    // Data nodes in file order, each given its place in the packed file
+    struct Payload {
+        zu64 offset;
+        zu64 size;
+        zu64 entry;
+    };
+    std::vector<Payload> payloads;
+    for(zu64 i = 0; i < entries.size(); ++i){
+        ObjectInfo info;
+        _pageEntryInfo(entries[i].raw, &info);
+        if(info.type >= BLOBOBJ && !info.inlined)
+            payloads.push_back({ info.data.offset, info.data.size, i });
+    }
+    std::sort(payloads.begin(), payloads.end(), [](const Payload &a, const Payload &b){
+        return a.offset < b.offset;
+    });
+    zu64 pos = ParcelHeader::NODE_SIZE;
+    zu64 end = 0;
+    for(zu64 i = 0; i < payloads.size(); ++i){
+        const Payload &pl = payloads[i];
+        if(pl.size > _header->tailptr || pl.offset > _header->tailptr - pl.size)
+            return ERR_TRUNC;
+        // Shared data nodes are copied once
+        const bool shared = (i && pl.offset == payloads[i - 1].offset && pl.size == payloads[i - 1].size);
+        if(!shared){
+            if(pl.offset < end)
+                return ERR_TREE;
+            end = pl.offset + pl.size;
+            pos += pl.size;
+        }
+        ZBinary::encbeu64(entries[pl.entry].raw + ZUID_SIZE + 2 + 8, pos - pl.size);
+    }
+
+    // Table after the data, aligned so the top levels share cache lines
+    const zu64 head = (pos + ZPARCEL_PACK_ALIGN - 1) / ZPARCEL_PACK_ALIGN * ZPARCEL_PACK_ALIGN;
+    const zu64 count = entries.size();
+    ZBinary table;
+    table.resize(count * ParcelPage::LEAF_SIZE);
+    zu64 next = 0;
+    for(zu64 k = eytzFirst(count); k; k = eytzNext(k, count))
+        memcpy(table.raw() + (k - 1) * ParcelPage::LEAF_SIZE, entries[next++].raw, ParcelPage::LEAF_SIZE);
+
+    ParcelHeader hdr(this, 0);
+    hdr.version = VERSION3;
+    hdr.flags = _header->flags & (OPT_COMPRESS | OPT_CRC32C | OPT_DATA_CRC | OPT_DEDUP);
+    hdr.treehead = head;
+    hdr.freehead = ZU64_MAX;
+    hdr.freetail = ZU64_MAX;
+    hdr.tailptr = head + ZPARCEL_PACK_ALIGN + table.size();
+    hdr.root = _header->root;
+
+    PackRecord rec;
+    rec.magic = ZPARCEL_PACK_MAGIC;
+    rec.count = count;
+    rec.tablecrc = _checksum(table.raw(), table.size());
+    rec.crc = _nodeChecksum(hdr.flags, (const zbyte *)&rec, sizeof(rec), offsetof(PackRecord, crc));
+
+#if ZPARCEL_POSIX
+    // The copy must not replace the parcel it is read from
+    const int src = (_fd >= 0 ? _fd : _mapfd);
+    struct stat st;
+    struct stat sst;
+    if(src >= 0 && ::stat(path.str().cc(), &st) == 0 && ::fstat(src, &sst) == 0 &&
+            st.st_dev == sst.st_dev && st.st_ino == sst.st_ino)
+        return ERR_OPEN;
+
+    // Written once, front to back, to a temporary file that replaces the path once synced
+    const ZString tmp = path.str() + ZPARCEL_TMP_SUFFIX;
+    int fd = ::open(tmp.cc(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0)
+        return ERR_OPEN;
+    auto put = [fd](const zbyte *buff, zu64 size){
+        return (writeFd(fd, buff, size) ? OK : ERR_WRITE);
+    };
+    auto write = [&]() -> parcelerror {
+        zbyte hbuff[ParcelHeader::NODE_SIZE];
+        hdr.encode(hbuff);
+        RETERR(put(hbuff, ParcelHeader::NODE_SIZE));
+
+        ZBinary buff;
+        for(zu64 i = 0; i < payloads.size(); ++i){
+            const Payload &pl = payloads[i];
+            if(i && pl.offset == payloads[i - 1].offset && pl.size == payloads[i - 1].size)
+                continue;
+            buff.resize(MIN(pl.size, (zu64)ZPARCEL_COPY_CHUNK));
+            for(zu64 done = 0; done < pl.size; ){
+                const zu64 n = MIN(pl.size - done, buff.size());
+                RETERR(_readAt(pl.offset + done, buff.raw(), n));
+                RETERR(put(buff.raw(), n));
+                done += n;
+            }
+        }
+
+        zbyte pad[ZPARCEL_PACK_ALIGN] = { 0 };
+        RETERR(put(pad, head - pos));
+        memcpy(pad, &rec, sizeof(rec));
+        RETERR(put(pad, ZPARCEL_PACK_ALIGN));
+        RETERR(put(table.raw(), table.size()));
+        return OK;
+    };
+
+    parcelerror err = write();
+    if(err == OK && !syncFd(fd))
+        err = ERR_WRITE;
+    if(::close(fd) != 0 && err == OK)
+        err = ERR_WRITE;
+    if(err == OK && ::rename(tmp.cc(), path.str().cc()) != 0)
+        err = ERR_WRITE;
+    if(err != OK){
+        ::unlink(tmp.cc());
+        return err;
+    }
+    if(!syncDir(path.str()))
+        return ERR_WRITE;
+    return OK;
+#else
+    return ERR_OPEN;
+#endif
+}
+
+//! Nodes on the longest path of a binary tree of \a nodes, as balanced as possible.
+static zu64 balancedHeight(zu64 nodes){
+    zu64 height = 0;
+    for(; nodes; nodes >>= 1)
+        ++height;
+    return height;
+}
+
+ZParcel::parcelerror ZParcel::shape(ShapeReport *report){
+    ParcelLock::Shared guard(_lock);
+    CHECK_COMMON(__FUNCTION__);
+
+    memset(report, 0, sizeof(ShapeReport));
+    report->balance = 1;
+    zu64 sumdepth = 0;
+    zu64 balanced = 0;
+
+    if(_header->version == VERSION3){
+        // Searches of the table go one level down the implicit tree per step
+        report->objects = _pack->count;
+        for(zu64 level = 1, first = 1; first <= _pack->count; ++level, first <<= 1)
+            sumdepth += level * (MIN(_pack->count, 2 * first - 1) - first + 1);
+        report->height = balancedHeight(_pack->count);
+        balanced = report->height;
+
+    } else if(_header->version == VERSION2){
+        zu64 used = 0;
+        zu64 capacity = 0;
+        std::vector<std::pair<zu64, zu64>> stack;
+        if(_header->treehead != ZU64_MAX)
+            stack.push_back({ _header->treehead, 1 });
+        while(!stack.empty()){
+            const auto top = stack.back();
+            stack.pop_back();
+            if(top.second > ZPARCEL_MAX_DEPTH)
+                return ERR_MAX_DEPTH;
+            ParcelPage page(this, top.first);
+            RETERR(page.read(top.second <= _pool->levels));
+            ++report->nodes;
+            report->height = MAX(report->height, top.second);
+            used += page.count;
+            if(page.level == 0){
+                capacity += ParcelPage::LEAF_MAX;
+                report->objects += page.count;
+                sumdepth += page.count * top.second;
+            } else {
+                capacity += ParcelPage::INNER_MAX;
+                for(zu16 i = 0; i <= page.count; ++i)
+                    stack.push_back({ page.child(i), top.second + 1 });
+            }
+        }
+        report->fill = (capacity ? (double)used / capacity : 0);
+
+        // Fewest levels that can hold the objects
+        if(report->objects){
+            balanced = 1;
+            for(zu64 n = (report->objects + ParcelPage::LEAF_MAX - 1) / ParcelPage::LEAF_MAX; n > 1; ++balanced)
+                n = (n + ParcelPage::INNER_MAX) / (ParcelPage::INNER_MAX + 1);
+        }
+
+    } else {
+        std::vector<std::pair<zu64, zu64>> stack;
+        if(_header->treehead != ZU64_MAX)
+            stack.push_back({ _header->treehead, 1 });
+        while(!stack.empty()){
+            const auto top = stack.back();
+            stack.pop_back();
+            if(top.second > ZPARCEL_MAX_DEPTH)
+                return ERR_MAX_DEPTH;
+            ParcelTreeNode node(this, top.first);
+            RETERR(node.read(top.second <= _pool->levels));
+            ++report->nodes;
+            report->height = MAX(report->height, top.second);
+            if(node.type != NULLOBJ){
+                ++report->objects;
+                sumdepth += top.second;
+            }
+            if(node.lnode != ZU64_MAX)
+                stack.push_back({ node.lnode, top.second + 1 });
+            if(node.rnode != ZU64_MAX)
+                stack.push_back({ node.rnode, top.second + 1 });
+        }
+        balanced = balancedHeight(report->nodes);
+    }
+
+    report->depth = (report->objects ? (double)sumdepth / report->objects : 0);
+    if(report->height)
+        report->balance = (double)balanced / report->height;
+
+    report->size = _header->tailptr;
+    if(_free){
+        for(auto it = _free->spans.begin(); it != _free->spans.end(); ++it){
+            ++report->freenodes;
+            report->freebytes += it->second.size;
+            report->freemax = MAX(report->freemax, it->second.size);
+        }
+    }
+    report->fragmentation = (report->freebytes ? 1 - (double)report->freemax / report->freebytes : 0);
+    return OK;
+}
+
+// /////////////////////////////////////////////////////////////////////////////
+
+ZParcel::parcelerror ZParcel::beginBatch(){
+    ParcelLock::Exclusive guard(_lock);
+    CHECK_COMMON(__FUNCTION__);
+    CHECK_WRITE;
+    if(!_batch)
+        _batch = new ParcelBatch;
+    _batch->depth++;
+    return OK;
+}
+
+ZParcel::parcelerror ZParcel::commitBatch(){
+    ParcelWrite guard(this);
+    CHECK_COMMON(__FUNCTION__);
+    if(!_batch)
+        throw ZException("commitBatch: no batch open");
+    return guard.done(_commitBatch());
+}
+
+ZParcel::parcelerror ZParcel::_commitBatch(){
+    if(--_batch->depth > 0)
+        return OK;
+
+    if(_wal->on){
+        // Left open as the transaction of the write operation, with the header in it
+        if(_batch->header){
+            _batch->header = false;
+            RETERR(_header->write());
+        }
+        return OK;
+    }
+
+    parcelerror err = _flushBatch();
+    bool header = _batch->header;
+    delete _batch;
+    _batch = nullptr;
+    RETERR(err);
+
+    if(header)
+        RETERR(_header->write());
+    return OK;
+}
+
+void ZParcel::abortBatch(){
+    ParcelLock::Exclusive guard(_lock);
+    if(!_batch)
+        return;
+    delete _batch;
+    _batch = nullptr;
+    _reloadState();
+}
+
+void ZParcel::_reloadState(){
+    // Cached info, the header and the bins may refer to discarded writes
+    _cache->clear();
+    _pool->clear();
+    if(_header && _header->read() != OK)
+        ELOG("ZParcel: header reload after abort failed");
+    if(_bins && _bins->read() != OK)
+        ELOG("ZParcel: bin table reload after abort failed");
+    if(_free && _freeLoad() != OK)
+        ELOG("ZParcel: free map reload after abort failed");
+    if(_header && _indexLoad() != OK)
+        ELOG("ZParcel: index reload after abort failed");
+    if(_header && _dedupLoad() != OK)
+        ELOG("ZParcel: shared data reload after abort failed");
+}
+
+void ZParcel::setCacheLimit(zu64 entries, zu64 bytes){
+    _cache->limit(entries, bytes);
+}
+
+void ZParcel::setNodeCacheLevels(zu16 levels){
+    ParcelLock::Exclusive guard(_lock);
+    _pool->levels = levels;
+    _pool->clear();
+}
+
+void ZParcel::setCompression(zu8 percent, zu64 minsize){
+    ParcelLock::Exclusive guard(_lock);
+    _compresspct = percent;
+    _compressmin = minsize;
+}
+
+void ZParcel::setVerify(verifymode mode){
+    ParcelLock::Exclusive guard(_lock);
+    _verify = mode;
+    _pool->clear();
+}
+
+ZParcel::parcelerror ZParcel::setIndexes(int indexes){
+    ParcelLock::Exclusive guard(_lock);
+    _indexes = indexes;
+    if(_state != OPEN)
+        return OK;
+    return _indexLoad();
+}
+
+ZParcel::parcelerror ZParcel::listByType(objtype type, ZArray<ZUID> &ids){
+    ParcelLock::Shared guard(_lock);
+    CHECK_COMMON(__FUNCTION__);
+    if(!(_indexes & INDEX_TYPE))
+        throw ZException("listByType: type index not enabled");
+    ids.clear();
+    auto it = _index->types.find(type);
+    if(it != _index->types.end()){
+        for(const ZUID &id : it->second)
+            ids.push(id);
+    }
+    return OK;
+}
+
+ZParcel::parcelerror ZParcel::findByName(ZString name, ZArray<ZUID> &ids){
+    ParcelLock::Shared guard(_lock);
+    CHECK_COMMON(__FUNCTION__);
+    if(!(_indexes & INDEX_NAME))
+        throw ZException("findByName: name index not enabled");
+    ids.clear();
+    auto it = _index->names.find(std::string(name.cc(), name.size()));
+    if(it == _index->names.end())
+        return ERR_NOEXIST;
+    for(const ZUID &id : it->second)
+        ids.push(id);
+    return OK;
+}
+
+ZParcel::CacheStats ZParcel::cacheStats() const {
+    CacheStats stats;
+    _cache->stats(&stats);
+    stats.nodes = _pool->size();
+    return stats;
+}
+
+ZParcel::Stats ZParcel::stats() const {
+    Stats st;
+    _stats->sum(&st);
+    CacheStats cache;
+    _cache->stats(&cache);
+    st.cachehits = cache.hits;
+    st.cachemisses = cache.misses;
+    return st;
+}
+
+void ZParcel::resetStats(){
+    _stats->reset();
+    _cache->resetStats();
+}
+
+// /////////////////////////////////////////////////////////////////////////////
+
+void ZParcel::listObjects(){
+    if(_state != OPEN)
+        return;
+    Scan sc = scan();
+    ScanEntry entry;
+    while(sc.next(entry))
+        LOG(entry.id.str() << " " << typeName(entry.type));
+    if(sc.error() != OK)
+        ELOG("ZParcel: list failed: " << errorStr(sc.error()));
+}
+
+ZParcel::Scan ZParcel::scan(){
+    ParcelLock::Shared guard(_lock);
+    CHECK_COMMON(__FUNCTION__);
+    return Scan(this);
+}
+
+ZParcel::Scan ZParcel::scan(ZUID from, ZUID to){
+    ParcelLock::Shared guard(_lock);
+    CHECK_COMMON(__FUNCTION__);
+    Scan sc(this);
+    sc._key = from;
+    sc._haskey = true;
+    sc._to = to;
+    sc._hasto = true;
+    return sc;
+}
+
+bool ZParcel::Scan::next(ScanEntry &entry){
+    while(_pos >= _batch.size()){
+        if(_done)
+            return false;
+        _err = _parcel->_scanFill(this);
+        if(_err != OK){
+            _done = true;
+            return false;
+        }
+    }
+    entry = _batch[_pos++];
+    return true;
+}
+
+ZParcel::parcelerror ZParcel::_walkEntries(const std::function<void(const zbyte *)> &fn, zu64 *removed){
+    if(removed)
+        *removed = 0;
+
+    if(_header->version == VERSION3){
+        for(zu64 k = eytzFirst(_pack->count); k; k = eytzNext(k, _pack->count))
+            fn(_packEntry(k));
+        return OK;
+    }
+
+    if(_header->version == VERSION2){
+        // Leftmost leaf, then along the leaf links
+        zu64 next = _header->treehead;
+        for(zu64 d = 0; next != ZU64_MAX; ++d){
+            if(d >= ZPARCEL_MAX_DEPTH)
+                return ERR_MAX_DEPTH;
+            ParcelPage page(this, next);
+            RETERR(page.read(d < _pool->levels));
+            if(page.level == 0)
+                break;
+            next = page.child(0);
+        }
+        while(next != ZU64_MAX){
+            ParcelPage leaf(this, next);
+            RETERR(leaf.read());
+            if(leaf.level != 0)
+                return ERR_TREE;
+            for(zu16 i = 0; i < leaf.count; ++i)
+                fn(leaf.entry(i));
+            next = leaf.next;
+        }
+        return OK;
+    }
+
+    // In order, with an explicit stack like _scanFill()
+    std::vector<ParcelTreeNode> stack;
+    auto descend = [&](zu64 next){
+        while(next != ZU64_MAX){
+            if(stack.size() >= ZPARCEL_MAX_DEPTH)
+                return ERR_MAX_DEPTH;
+            ParcelTreeNode node(this, next);
+            RETERR(node.read());
+            next = node.lnode;
+            stack.push_back(node);
+        }
+        return OK;
+    };
+    RETERR(descend(_header->treehead));
+    while(!stack.empty()){
+        ParcelTreeNode node = stack.back();
+        stack.pop_back();
+        if(node.type == NULLOBJ){
+            if(removed)
+                ++*removed;
+        } else {
+            zbyte entry[ParcelPage::LEAF_SIZE];
+            memset(entry, 0, ParcelPage::LEAF_SIZE);
+            memcpy(entry, node.uid.raw(), ZUID_SIZE);
+            entry[ZUID_SIZE] = node.type;
+            memcpy(entry + ZUID_SIZE + 2, node.payload, 16);
+            fn(entry);
+        }
+        RETERR(descend(node.rnode));
+    }
+    return OK;
+}
+
+ZParcel::parcelerror ZParcel::_indexLoad(){
+    _index->clear();
+    if(_indexes == INDEX_NONE)
+        return OK;
+
+    std::vector<std::pair<ZUID, zu64>> files;
+    RETERR(_walkEntries([this, &files](const zbyte *entry){
+        ZUID id;
+        id.fromRaw(entry);
+        const objtype type = entry[ZUID_SIZE];
+        if(_indexes & INDEX_TYPE){
+            ParcelIndex::IdSet &set = _index->types[type];
+            set.insert(set.end(), id);
+        }
+        if((_indexes & INDEX_NAME) && type == FILEOBJ){
+            ObjectInfo info;
+            _pageEntryInfo(entry, &info);
+            files.push_back({ id, info.data.offset });
+        }
+    }));
+
+    // File data starts with the id of the name string
+    for(const auto &file : files){
+        zbyte raw[ZUID_SIZE];
+        RETERR(_readAt(file.second, raw, ZUID_SIZE));
+        ZUID nameid;
+        nameid.fromRaw(raw);
+        ZString name;
+        parcelerror err = _fileName(nameid, &name);
+        // Files whose name object is gone are left out
+        if(err == ERR_NOEXIST || err == ERR_TYPE)
+            continue;
+        RETERR(err);
+        _index->addName(file.first, name);
+    }
+    return OK;
+}
+
+ZParcel::parcelerror ZParcel::_indexAdd(const ZUID &id, objtype type, const ZBinary &data){
+    if(_indexes & INDEX_TYPE)
+        _index->types[type].insert(id);
+    if((_indexes & INDEX_NAME) && type == FILEOBJ && data.size() >= 2 * ZUID_SIZE){
+        ZUID nameid;
+        nameid.fromRaw(data.raw());
+        ZString name;
+        parcelerror err = _fileName(nameid, &name);
+        if(err == ERR_NOEXIST || err == ERR_TYPE)
+            return OK;
+        RETERR(err);
+        _index->addName(id, name);
+    }
+    return OK;
+}
+
+ZParcel::parcelerror ZParcel::_fileName(const ZUID &nameid, ZString *name){
+    ObjectInfo info;
+    RETERR(_getObjectInfo(nameid, &info));
+    if(info.type != STRINGOBJ)
+        return ERR_TYPE;
+    ZBinary bin;
+    RETERR(_readPayload(info, &bin));
+    *name = ZString(bin.raw(), bin.size());
+    return OK;
+}
+
+ZParcel::parcelerror ZParcel::_dedupLoad(){
+    _dedup->clear();
+    if(_readonly || !(_header->flags & OPT_DEDUP))
+        return OK;
+
+    RETERR(_walkEntries([this](const zbyte *entry){
+        if(entry[ZUID_SIZE] != BLOBOBJ)
+            return;
+        ObjectInfo info;
+        _pageEntryInfo(entry, &info);
+        if(!info.inlined)
+            _dedup->add(info);
+    }));
+    // Contents are hashed by the first store that looks for a match
+    _dedup->filled = _dedup->nodes.empty();
+    return OK;
+}
+
+ZParcel::parcelerror ZParcel::_dedupFill(){
+    if(_dedup->filled)
+        return OK;
+
+    std::vector<ObjectInfo> todo;
+    for(const auto &node : _dedup->nodes){
+        if(!node.second.hashed)
+            todo.push_back(_dedup->info(node.first, node.second));
+    }
+    std::sort(todo.begin(), todo.end(), [](const ObjectInfo &a, const ObjectInfo &b){
+        return a.data.offset < b.data.offset;
+    });
+    if(_build)
+        RETERR(_buildFlush());
+
+    // Read in file order on the I/O threads, like verify()
+    std::vector<ParcelDedup::Key> keys(todo.size());
+    std::vector<parcelerror> errs(todo.size(), OK);
+    std::atomic<zu64> next(0);
+    _io->parallel((_batch ? 1 : MIN(todo.size(), (zu64)ZPARCEL_IO_THREADS)), [&](zu64){
+        for(zu64 i; (i = next++) < todo.size(); ){
+            zu64 len = 0;
+            zu32 crc = 0;
+            errs[i] = _readContent(todo[i], [this, &len, &crc](const zbyte *data, zu64 size){
+                len += size;
+                crc = _checksum(data, size, crc);
+                return true;
+            });
+            keys[i] = ParcelDedup::Key(len, crc);
+        }
+    });
+
+    // Data nodes that cannot be read are not shared
+    for(zu64 i = 0; i < todo.size(); ++i){
+        if(errs[i] == OK)
+            _dedup->hash(todo[i].data.offset, keys[i]);
+    }
+    _dedup->filled = true;
+    return OK;
+}
+
+ZParcel::parcelerror ZParcel::_dedupFind(zu64 len, zu32 hash, const std::function<bool(const ObjectInfo &)> &same, ObjectInfo *info){
+    RETERR(_dedupFill());
+    auto range = _dedup->byhash.equal_range(ParcelDedup::Key(len, hash));
+    if(range.first == range.second)
+        return ERR_NOEXIST;
+
+    // Staged build data must be in the file to be compared
+    if(_build)
+        RETERR(_buildFlush());
+    for(auto it = range.first; it != range.second; ++it){
+        const ObjectInfo cand = _dedup->info(it->second, _dedup->nodes[it->second]);
+        if(same(cand)){
+            *info = cand;
+            return OK;
+        }
+    }
+    return ERR_NOEXIST;
+}
+
+bool ZParcel::_dedupSame(const ObjectInfo &info, ZReader &file, zu64 size){
+    ZBinary buff;
+    zu64 pos = 0;
+    bool same = true;
+    parcelerror err = _readContent(info, [&](const zbyte *data, zu64 n){
+        buff.resize(n);
+        same = (n <= size - pos && file.read(buff.raw(), n) == n && memcmp(buff.raw(), data, n) == 0);
+        pos += n;
+        return same;
+    });
+    return (err == OK && same && pos == size);
+}
+
+ZParcel::parcelerror ZParcel::_storeShared(ZUID id, const ObjectInfo &info){
+    RETERR(_storeObject(id, BLOBOBJ, ZBinary(), 0, nullptr, (info.compressed ? ParcelPage::ENTRY_COMPRESSED : 0),
+                        nullptr, &info));
+    _dedup->add(info);
+    return OK;
+}
+
+ZParcel::parcelerror ZParcel::_updateShared(ZUID id, const ObjectInfo &info){
+    // Counted first, so an object that already refers to the node does not free it
+    _dedup->add(info);
+    return _updateObject(id, BLOBOBJ, ZBinary(), 0, nullptr, (info.compressed ? ParcelPage::ENTRY_COMPRESSED : 0),
+                         nullptr, &info);
+}
+
+ZParcel::parcelerror ZParcel::_scanFill(Scan *sc){
+    ParcelLock::Shared guard(_lock);
+    CHECK_COMMON("Scan::next");
+
+    sc->_batch.clear();
+    sc->_pos = 0;
+
+    // Add entry to the batch, or end the scan past the upper bound
+    auto emit = [sc](const ZUID &id, objtype type, const ObjectInfo &info){
+        if(sc->_hasto && id.compare(sc->_to) > 0){
+            sc->_done = true;
+            return false;
+        }
+        ScanEntry entry;
+        entry.id = id;
+        entry.type = type;
+        entry.offset = ZU64_MAX;
+        entry.size = 0;
+        entry.compressed = info.compressed;
+        if(info.inlined){
+            entry.size = info.inlen;
+        } else if(type >= BLOBOBJ){
+            entry.offset = info.data.offset;
+            entry.size = info.data.size;
+        }
+        sc->_batch.push(entry);
+        return true;
+    };
+    // Check if id is at or past the key the batch starts at
+    auto started = [sc](const ZUID &id){
+        if(!sc->_haskey)
+            return true;
+        const int cmp = id.compare(sc->_key);
+        return (sc->_inclusive ? cmp >= 0 : cmp > 0);
+    };
+
+    if(_header->version == VERSION3){
+        // In order through the table, from the first object not before the key
+        zu64 k = (sc->_haskey ? _packSearch(sc->_key) : eytzFirst(_pack->count));
+        for(; k && sc->_batch.size() < ZPARCEL_SCAN_BATCH; k = eytzNext(k, _pack->count)){
+            ZUID id;
+            id.fromRaw(_packEntry(k));
+            if(!started(id))
+                continue;
+            ObjectInfo info;
+            _pageEntryInfo(_packEntry(k), &info);
+            if(!emit(id, info.type, info))
+                break;
+        }
+        if(k == 0)
+            sc->_done = true;
+
+    } else if(_header->version == VERSION2){
+        // Find the leaf to start at
+        ParcelPage page(this, _header->treehead);
+        zu64 parent = ZU64_MAX;
+        zu64 pdepth = 0;
+        zu16 index = 0;
+        for(zu64 d = 0; ; ++d){
+            if(page.offset == ZU64_MAX){
+                sc->_done = true;
+                return OK;
+            }
+            if(d >= ZPARCEL_MAX_DEPTH)
+                return ERR_MAX_DEPTH;
+            RETERR(page.read(d < _pool->levels));
+            if(page.level == 0)
+                break;
+            bool found;
+            parent = page.offset;
+            pdepth = d;
+            index = (sc->_haskey ? page.search(sc->_key, &found) : 0);
+            page.offset = page.child(index);
+        }
+
+        // Read ahead the following leaves under the same parent
+        std::vector<std::unique_ptr<ParcelPage>> leaves;
+        if(parent != ZU64_MAX){
+            ParcelPage ppage(this, parent);
+            RETERR(ppage.read(pdepth < _pool->levels));
+            const zu16 end = MIN((zu16)(index + ZPARCEL_SCAN_PAGES), (zu16)(ppage.count + 1));
+            for(zu16 i = index + 1; i < end; ++i)
+                leaves.emplace_back(new ParcelPage(this, ppage.child(i)));
+        }
+        std::vector<parcelerror> errs(leaves.size(), OK);
+        _io->parallel(leaves.size(), [&leaves, &errs](zu64 i){
+            errs[i] = leaves[i]->read();
+        });
+
+        bool more = true;
+        auto walk = [&](ParcelPage &leaf){
+            if(leaf.level != 0)
+                return ERR_TREE;
+            for(zu16 i = 0; i < leaf.count && more; ++i){
+                ZUID id;
+                id.fromRaw(leaf.entry(i));
+                if(!started(id))
+                    continue;
+                ObjectInfo info;
+                _pageEntryInfo(leaf.entry(i), &info);
+                more = emit(id, info.type, info);
+            }
+            return OK;
+        };
+        RETERR(walk(page));
+        zu64 next = page.next;
+        for(zu64 i = 0; i < leaves.size() && more; ++i){
+            RETERR(errs[i]);
+            RETERR(walk(*leaves[i]));
+            next = leaves[i]->next;
+        }
+
+        // Skip empty leaves until something is found
+        while(more && sc->_batch.size() == 0){
+            if(next == ZU64_MAX){
+                sc->_done = true;
+                return OK;
+            }
+            ParcelPage leaf(this, next);
+            RETERR(leaf.read());
+            RETERR(walk(leaf));
+            next = leaf.next;
+        }
+        if(more && next == ZU64_MAX)
+            sc->_done = true;
+
+    } else {
+        // Tree nodes still to visit in order, found like a successor search
+        std::vector<ParcelTreeNode> stack;
+        auto descend = [&](zu64 next, bool keyed){
+            for(zu64 d = 0; next != ZU64_MAX; ++d){
+                if(d >= ZPARCEL_MAX_DEPTH || stack.size() >= ZPARCEL_MAX_DEPTH)
+                    return ERR_MAX_DEPTH;
+                // Only the path from the root is at a known depth
+                ParcelTreeNode node(this, next);
+                RETERR(node.read(keyed && d < _pool->levels));
+                if(keyed && !started(node.uid)){
+                    next = node.rnode;
+                    continue;
+                }
+                next = node.lnode;
+                stack.push_back(node);
+            }
+            return OK;
+        };
+        RETERR(descend(_header->treehead, true));
+
+        while(!stack.empty() && sc->_batch.size() < ZPARCEL_SCAN_BATCH){
+            ParcelTreeNode node = stack.back();
+            stack.pop_back();
+            if(node.type != NULLOBJ){
+                ObjectInfo info;
+                info.inlined = false;
+                info.inlen = 0;
+                info.compressed = false;
+                info.data.offset = node.data.offset;
+                info.data.size = node.data.size;
+                if(!emit(node.uid, node.type, info))
+                    break;
+            }
+            RETERR(descend(node.rnode, false));
+        }
+        if(stack.empty())
+            sc->_done = true;
+    }
+
+    // The next batch starts after the last object found
+    if(sc->_batch.size()){
+        sc->_key = sc->_batch[sc->_batch.size() - 1].id;
+        sc->_haskey = true;
+        sc->_inclusive = false;
+    }
+    return OK;
+}
+
+// /////////////////////////////////////////////////////////////////////////////
+
+ZString ZParcel::typeName(objtype type){
+    if(typetoname.contains(type))
+        return typetoname[type];
+    else
+        return "Unknown Type";
+}
+
+ZString ZParcel::errorStr(parcelerror err){
+    if(errtostr.contains(err))
+        return errtostr[err];
+    else
+        return "Unknown Error";
+}
+
+// /////////////////////////////////////////////////////////////////////////////
+
+zu64 ZParcel::_objectSize(objtype type, zu64 size){
+    // Data nodes end with their checksum
+    const zu64 trail = ((_header->flags & OPT_DATA_CRC) ? 4 : 0);
+    switch(type){
+        case NULLOBJ:
+            return 0;
+        case BOOLOBJ:
+            return 1;
+        case UINTOBJ:
+        case SINTOBJ:
+            return 4;
+        case FLOATOBJ:
+            return 10;
+        case ZUIDOBJ:
+            return 16;
+
+        case BLOBOBJ:
+        case STRINGOBJ:
+            return size + trail;
+
+        case FILEOBJ:
+            return 32 + trail;
+
+        default:
+            return size + trail;
+    }
+}
+
+ZParcel::parcelerror ZParcel::_sealPayload(zu64 offset, zu64 size, zu64 used, zu32 crc){
+    if(!(_header->flags & OPT_DATA_CRC))
+        return OK;
+    if(used + 4 > size)
+        return ERR_TRUNC;
+
+    // Clear the rest of the node, so the whole node is checked
+    const zu64 end = size - 4;
+    if(used < end){
+        ZBinary zero;
+        zero.fill(0, MIN(end - used, (zu64)ZPARCEL_COPY_CHUNK));
+        for(zu64 pos = used; pos < end; ){
+            const zu64 n = MIN(end - pos, zero.size());
+            RETERR(_writeAt(offset + pos, zero.raw(), n));
+            crc = _checksum(zero.raw(), n, crc);
+            pos += n;
+        }
+    }
+
+    zbyte trail[4];
+    ZBinary::encbeu32(trail, crc);
+    return _writeAt(offset + end, trail, 4);
+}
+
+zu32 ZParcel::_checksum(const zbyte *data, zu64 size, zu32 crc) const {
+    const auto start = std::chrono::steady_clock::now();
+    crc = ZParcelChecksum::crc32c(data, size, crc);
+    _stats->crc(size, start);
+    return crc;
+}
+
+zu32 ZParcel::_nodeChecksum(zu32 flags, const zbyte *data, zu64 size, zu64 field) const {
+    const auto start = std::chrono::steady_clock::now();
+    const zu32 crc = nodeChecksum(flags, data, size, field);
+    _stats->crc(size, start);
+    return crc;
+}
+
+bool ZParcel::_compressWanted(zu64 size) const {
+    return (_header->version == VERSION2 && _compresspct && size >= _compressmin);
+}
+
+zu8 ZParcel::_compressData(ZBinary &data){
+    const zu64 len = data.size() - 8;
+    if(!_compressWanted(len))
+        return 0;
+
+    ZBinary out(8);
+    ZBinary::encbeu64(out.raw(), len);
+    for(zu64 pos = 0; pos < len; pos += ZPARCEL_COMPRESS_CHUNK)
+        encodeChunk(data.raw() + 8 + pos, MIN(len - pos, (zu64)ZPARCEL_COMPRESS_CHUNK), out);
+    if(out.size() * 100 > data.size() * _compresspct)
+        return 0;
+
+    data = out;
+    return ParcelPage::ENTRY_COMPRESSED;
+}
+
+ZParcel::parcelerror ZParcel::_readContent(const ObjectInfo &info, const std::function<bool(const zbyte *, zu64)> &fn){
+    if(info.inlined){
+        fn(info.payload, info.inlen);
+        return OK;
+    }
+
+    ZBinary buff;
+    if(info.compressed){
+        try {
+            ParcelCompressedAccessor reader(this, info.data.offset, info.data.size);
+            buff.resize(ZPARCEL_COMPRESS_CHUNK);
+            while(!reader.atEnd()){
+                const zu64 n = reader.read(buff.raw(), buff.size());
+                if(!fn(buff.raw(), n))
+                    break;
+            }
+        } catch(ZException &){
+            return ERR_DECODE;
+        }
+        return OK;
+    }
+
+    if(info.data.size < 8)
+        return ERR_TRUNC;
+    zbyte head[8];
+    RETERR(_readAt(info.data.offset, head, 8));
+    const zu64 len = ZBinary::decbeu64(head);
+    if(len > info.data.size - 8)
+        return ERR_TRUNC;
+    buff.resize(MIN(len, (zu64)ZPARCEL_COPY_CHUNK));
+    for(zu64 pos = 0; pos < len; ){
+        const zu64 n = MIN(len - pos, buff.size());
+        RETERR(_readAt(info.data.offset + 8 + pos, buff.raw(), n));
+        if(!fn(buff.raw(), n))
+            break;
+        pos += n;
+    }
+    return OK;
+}
+
+ZParcel::parcelerror ZParcel::_readPayload(const ObjectInfo &info, ZBinary *out){
+    if(info.inlined){
+        *out = ZBinary(info.payload, info.inlen);
+        return OK;
+    }
+
+    if(_map){
+        // Decode from mapping
+        const zbyte *ptr = _mapView(info.data.offset, info.data.size);
+        if(ptr == nullptr)
+            return ERR_TRUNC;
+        return decodePayload(ptr, info.data.size, info.compressed, out);
+    }
+
+    if(info.compressed){
+        ZBinary buff(info.data.size);
+        RETERR(_readAt(info.data.offset, buff.raw(), buff.size()));
+        return decodePayload(buff.raw(), buff.size(), true, out);
+    }
+
+    // Only read up to the length, the node may be larger
+    ParcelObjectAccessor accessor(this, info.data.offset, info.data.size);
+    zu64 len = accessor.readbeu64();
+    if(len > info.data.size - 8)
+        return ERR_TRUNC;
+    out->resize(len);
+    if(accessor.read(out->raw(), len) != len)
+        return ERR_READ;
+    return OK;
+}
+
+ZParcel::parcelerror ZParcel::_listFill(ListReader *rd){
+    ParcelLock::Shared guard(_lock);
+    CHECK_COMMON("ListReader::next");
+
+    rd->_batch.clear();
+    rd->_pos = 0;
+    ObjectInfo info;
+    RETERR(_getObjectInfo(rd->_id, &info));
+    if(info.type != LISTOBJ)
+        throw ZException("ListReader::next called for wrong Object type");
+    RETERR(_listRead(info, rd->_next, ZPARCEL_LIST_CHUNK, rd->_batch));
+    rd->_next += rd->_batch.size();
+    if(rd->_batch.size() < ZPARCEL_LIST_CHUNK)
+        rd->_done = true;
+    return OK;
+}
+
+ZParcel::parcelerror ZParcel::_listSize(const ObjectInfo &info, zu64 *len){
+    if(info.inlined){
+        *len = info.inlen / ZUID_SIZE;
+        return OK;
+    }
+    if(info.data.size < 8)
+        return ERR_TRUNC;
+    zbyte head[8];
+    RETERR(_readAt(info.data.offset, head, 8));
+    *len = ZBinary::decbeu64(head);
+    if(*len > (info.data.size - 8) / ZUID_SIZE)
+        return ERR_TRUNC;
+    return OK;
+}
+
+ZParcel::parcelerror ZParcel::_listRead(const ObjectInfo &info, zu64 start, zu64 count, ZArray<ZUID> &out){
+    out.clear();
+    zu64 len;
+    RETERR(_listSize(info, &len));
+    if(start >= len)
+        return OK;
+    const zu64 n = MIN(count, len - start);
+    out.reserve(n);
+
+    const zbyte *src;
+    ZBinary buff;
+    if(info.inlined){
+        src = info.payload + start * ZUID_SIZE;
+    } else {
+        buff.resize(n * ZUID_SIZE);
+        ParcelObjectAccessor accessor(this, info.data.offset, info.data.size);
+        accessor.seek(8 + start * ZUID_SIZE);
+        if(accessor.read(buff.raw(), buff.size()) != buff.size())
+            return ERR_READ;
+        src = buff.raw();
+    }
+    for(zu64 i = 0; i < n; ++i){
+        ZUID uid;
+        uid.fromRaw(src + i * ZUID_SIZE);
+        out.push(uid);
+    }
+    return OK;
+}
+
+ZParcel::parcelerror ZParcel::_listAppend(ZUID id, const ObjectInfo &info, const zbyte *children, zu64 size){
+    if(size == 0)
+        return OK;
+    zu64 len;
+    RETERR(_listSize(info, &len));
+    const zu64 used = 8 + len * ZUID_SIZE;
+    const zu64 total = len + size / ZUID_SIZE;
+    const zu64 trail = ((_header->flags & OPT_DATA_CRC) ? 4 : 0);
+    zbyte head[8];
+    ZBinary::encbeu64(head, total);
+
+    if(!info.inlined && info.data.size >= used + trail && total <= (info.data.size - 8 - trail) / ZUID_SIZE){
+        // Room after the last child
+        const zu64 offset = info.data.offset;
+        zbyte tcrc[4];
+        if(trail){
+            // Checksums are linear, and only the count and the cleared bytes after the last child change,
+            // so the old checksum is updated without reading the node
+            RETERR(_readAt(offset + info.data.size - 4, tcrc, 4));
+            const zu64 body = info.data.size - 4;
+            zbyte delta[8];
+            ZBinary::encbeu64(delta, len ^ total);
+            zu32 crc = _checksum(delta, 8);
+            crc = ZParcelChecksum::zeros(crc, used - 8);
+            crc = _checksum(children, size, crc);
+            crc = ZParcelChecksum::zeros(crc, body - used - size);
+            ZBinary::encbeu32(tcrc, ZBinary::decbeu32(tcrc) ^ crc ^ ZParcelChecksum::zeros(0, body));
+        }
+        RETERR(_writeAt(offset + used, children, size));
+        RETERR(_writeAt(offset, head, 8));
+        if(trail)
+            RETERR(_writeAt(offset + info.data.size - 4, tcrc, 4));
+        return OK;
+    }
+
+    // Move to a node with room for twice the children
+    const zu64 cap = MAX(total, 2 * len);
+    zu64 noffset;
+    zu64 nsize;
+    RETERR(_nodeAlloc(_objectSize(LISTOBJ, 8 + cap * ZUID_SIZE), &noffset, &nsize));
+    RETERR(_writeAt(noffset, head, 8));
+    zu32 crc = (trail ? _checksum(head, 8) : 0);
+    if(info.inlined){
+        RETERR(_writeAt(noffset + 8, info.payload, used - 8));
+        if(trail)
+            crc = _checksum(info.payload, used - 8, crc);
+    } else {
+        ZBinary buff;
+        buff.resize(MIN(used - 8, (zu64)ZPARCEL_COPY_CHUNK));
+        for(zu64 pos = 8; pos < used; ){
+            const zu64 n = MIN(used - pos, buff.size());
+            RETERR(_readAt(info.data.offset + pos, buff.raw(), n));
+            RETERR(_writeAt(noffset + pos, buff.raw(), n));
+            if(trail)
+                crc = _checksum(buff.raw(), n, crc);
+            pos += n;
+        }
+    }
+    RETERR(_writeAt(noffset + used, children, size));
+    if(trail)
+        crc = _checksum(children, size, crc);
+    RETERR(_sealPayload(noffset, nsize, used + size, crc));
+
+    RETERR(_relinkData(id, info, noffset, nsize, 0));
+    if(!info.inlined && !_dedup->release(info.data.offset))
+        RETERR(_nodeFree(info.data.offset, info.data.size));
+    return OK;
+}
+
+ZParcel::parcelerror ZParcel::_relinkData(ZUID id, const ObjectInfo &info, zu64 offset, zu64 size, zu8 flags){
+    _cache->erase(id);
+    if(_header->version == VERSION2){
+        PagePath path;
+        ParcelPage leaf(this, ZU64_MAX);
+        RETERR(_pageFind(_header->treehead, id, &path, &leaf));
+        zbyte *entry = leaf.entry(path.index[path.depth - 1]);
+        entry[ZUID_SIZE + 1] = flags;
+        ZBinary::encbeu64(entry + ZUID_SIZE + 2, size);
+        ZBinary::encbeu64(entry + ZUID_SIZE + 2 + 8, offset);
+        return leaf.write();
+    }
+
+    ParcelTreeNode node(this, info.tree);
+    RETERR(node.read());
+    node.data.offset = offset;
+    node.data.size = size;
+    return node.write();
+}
+
+ZParcel::parcelerror ZParcel::_storeObject(ZUID id, objtype type, const ZBinary &data, zu64 reserve, zu64 *poffset,
+                                          zu8 flags, zu64 *psize, const ObjectInfo *shared){
+    CHECK_WRITE;
+
+    if(_header->version == VERSION2){
+        // Find leaf to insert into. Builds check for duplicates when finished.
+        PagePath path;
+        ParcelPage leaf(this, ZU64_MAX);
+        if(!_build){
+            parcelerror err = _pageFind(_header->treehead, id, &path, &leaf);
+            if(err == OK)
+                return ERR_EXISTS;
+            if(err != ERR_NOEXIST)
+                return err;
+        }
+
+        zbyte entry[ParcelPage::LEAF_SIZE];
+        memset(entry, 0, ParcelPage::LEAF_SIZE);
+        memcpy(entry, id.raw(), ZUID_SIZE);
+        entry[ZUID_SIZE] = type;
+        zbyte *payload = entry + ZUID_SIZE + 2;
+
+        entry[ZUID_SIZE + 1] = flags;
+        if(shared){
+            // Refer to the existing data node
+            ZBinary::encbeu64(payload, shared->data.size);
+            ZBinary::encbeu64(payload + 8, shared->data.offset);
+        } else if((type == BLOBOBJ || type == STRINGOBJ || type == LISTOBJ) && reserve == 0 && flags == 0 && !poffset &&
+                data.size() >= 8 && data.size() - 8 <= ParcelPage::INLINE_MAX){
+            // Keep short data in the entry, without the length
+            entry[ZUID_SIZE + 1] = ParcelPage::ENTRY_INLINE | (zu8)(data.size() - 8);
+            memcpy(payload, data.raw() + 8, data.size() - 8);
+        } else if(type >= BLOBOBJ){
+            // Allocate and write data node before linking it into the tree
+            zu64 doffset;
+            zu64 dsize;
+            if(_build){
+                // Payloads are appended in the order they are stored
+                dsize = _objectSize(type, data.size() + reserve);
+                doffset = _header->tailptr;
+                _header->tailptr += dsize;
+            } else {
+                RETERR(_nodeAlloc(_objectSize(type, data.size() + reserve), &doffset, &dsize));
+            }
+            ParcelObjectAccessor accessor(this, doffset, dsize);
+            if(accessor.write(data.raw(), data.size()) != data.size())
+                return ERR_WRITE;
+            if(reserve == 0 && (_header->flags & OPT_DATA_CRC))
+                RETERR(_sealPayload(doffset, dsize, data.size(), _checksum(data.raw(), data.size())));
+            ZBinary::encbeu64(payload, dsize);
+            ZBinary::encbeu64(payload + 8, doffset);
+            if(poffset){
+                *poffset = doffset;
+                *psize = dsize;
+            }
+        } else {
+            // Copy data into payload
+            memcpy(payload, data.raw(), MIN(data.size(), 16));
+        }
+
+        if(_build){
+            ParcelBuild::Entry ent;
+            memcpy(ent.raw, entry, ParcelPage::LEAF_SIZE);
+            _build->entries.push_back(ent);
+            return OK;
+        }
+
+        zu64 root = _header->treehead;
+        RETERR(_pageInsert(&root, &path, &leaf, entry));
+        if(root != _header->treehead){
+            _header->treehead = root;
+            RETERR(_header->write());
+        }
+        return _indexAdd(id, type, data);
+    }
+
+    // Tree node size
+    zu64 tsize = ParcelTreeNode::NODE_SIZE;
+
+    // Allocate tree node
+    zu64 offset;
+    zu64 nsize;
+    RETERR(_nodeAlloc(tsize, &offset, &nsize, true));
+
+//    DLOG("New node " << HEX(offset) << " " << nsize);
+
+    ParcelTreeNode newnode(this, offset);
+    newnode.uid = id;
+    newnode.lnode = ZU64_MAX;
+    newnode.rnode = ZU64_MAX;
+    newnode.type = type;
+    newnode.extra = nsize - tsize;
+
+    // Write data
+    if(shared){
+        newnode.data.offset = shared->data.offset;
+        newnode.data.size = shared->data.size;
+    } else if(newnode.type >= BLOBOBJ){
+        // Data node size
+        zu64 dsize = _objectSize(type, data.size() + reserve);
+        RETERR(_nodeAlloc(dsize, &newnode.data.offset, &newnode.data.size));
+        if(poffset){
+            *poffset = newnode.data.offset;
+            *psize = newnode.data.size;
+        }
+
+//        DLOG("ObjNode " << HEX(newnode.data.offset) << " " << newnode.data.size << " " << HEX(newnode.data.offset + newnode.data.size));
+
+    } else {
+        // Copy data into payload
+        memcpy(newnode.payload, data.raw(), MIN(data.size(), 16));
+    }
+
+    // Write the node
+    RETERR(newnode.write());
+
+    // Find where to insert into tree
+    zu64 next = _header->treehead;
+    if(next == ZU64_MAX){
+        // Tree head is uninitialzied
+        _header->treehead = offset;
+        RETERR(_header->write());
+
+    } else {
+
+        // Search tree
+        bool found = false;
+        for(zu64 d = 0; d < ZPARCEL_MAX_DEPTH; ++d){
+            // Read the node
+            ParcelTreeNode node(this, next);
+            RETERR(node.read(d < _pool->levels));
+
+            // Compare
+            int cmp = node.uid.compare(id);
+            if(cmp < 0){
+                if(node.rnode == ZU64_MAX){
+                    // Rewrite leaf
+                    node.rnode = offset;
+                    RETERR(node.write());
+
+                    found = true;
+                    break;
+                }
+                next = node.rnode;
+            } else if(cmp > 0){
+                if(node.lnode == ZU64_MAX){
+                    // Rewrite leaf
+                    node.lnode = offset;
+                    RETERR(node.write());
+
+                    found = true;
+                    break;
+                }
+                next = node.lnode;
+            } else {
+                // Object already exists
+                if(node.type == NULLOBJ && !_build){
+                    // Reuse the node of the removed object, and give back the new ones
+                    RETERR(_nodeFree(offset, nsize));
+                    if(newnode.type >= BLOBOBJ && !shared)
+                        RETERR(_nodeFree(newnode.data.offset, newnode.data.size));
+                    return _updateObject(id, type, data, reserve, poffset, flags, psize, shared);
+                }
+                return ERR_EXISTS;
+            }
+        }
+        // Loop ended without finding tree leaf
+        if(!found)
+            return ERR_MAX_DEPTH;
+    }
+
+    if(newnode.type >= BLOBOBJ && !shared){
+        ObjectInfo info;
+        RETERR(_getObjectInfo(id, &info));
+        if(info.type != type)
+            return ERR_TREE;
+
+        ParcelObjectAccessor accessor(this, info.data.offset, info.data.size);
+        zu64 wsize = accessor.write(data.raw(), data.size());
+//        DLOG("Object data write " << data.size() << " " << wsize);
+        if(reserve == 0 && (_header->flags & OPT_DATA_CRC))
+            RETERR(_sealPayload(info.data.offset, info.data.size, data.size(), _checksum(data.raw(), data.size())));
+    }
+
+    return _indexAdd(id, type, data);
+}
+
+ZParcel::parcelerror ZParcel::_updateObject(ZUID id, objtype type, const ZBinary &data, zu64 reserve, zu64 *poffset,
+                                           zu8 flags, zu64 *psize, const ObjectInfo *shared){
+    CHECK_WRITE;
+    if(_build)
+        return _storeObject(id, type, data, reserve, poffset, flags, psize, shared);
+
+    // Find the old object
+    ObjectInfo old;
+    PagePath path;
+    ParcelPage leaf(this, ZU64_MAX);
+    zu64 tree = ZU64_MAX;
+    if(_header->version == VERSION2){
+        parcelerror err = _pageFind(_header->treehead, id, &path, &leaf);
+        if(err == ERR_NOEXIST)
+            return _storeObject(id, type, data, reserve, poffset, flags, psize, shared);
+        RETERR(err);
+        _pageEntryInfo(leaf.entry(path.index[path.depth - 1]), &old);
+    } else {
+        parcelerror err = _treeFind(id, &tree);
+        if(err == ERR_NOEXIST)
+            return _storeObject(id, type, data, reserve, poffset, flags, psize, shared);
+        RETERR(err);
+    }
+    ParcelTreeNode node(this, tree);
+    if(tree != ZU64_MAX){
+        RETERR(node.read());
+        old.type = node.type;
+        old.inlined = false;
+        old.compressed = false;
+        old.data.offset = node.data.offset;
+        old.data.size = node.data.size;
+    }
+    // Removed objects have no data node
+    const bool hasnode = (old.type >= BLOBOBJ && !old.inlined);
+
+    // New entry payload
+    zbyte payload[16];
+    memset(payload, 0, 16);
+    zu8 eflags = flags;
+    bool reuse = false;
+    zu64 doffset = ZU64_MAX;
+    zu64 dsize = 0;
+    if(shared){
+        doffset = shared->data.offset;
+        dsize = shared->data.size;
+    } else if((type == BLOBOBJ || type == STRINGOBJ || type == LISTOBJ) && _header->version == VERSION2 &&
+              reserve == 0 && flags == 0 && !poffset && data.size() >= 8 && data.size() - 8 <= ParcelPage::INLINE_MAX){
+        // Short data in the entry, like _storeObject()
+        eflags = ParcelPage::ENTRY_INLINE | (zu8)(data.size() - 8);
+        memcpy(payload, data.raw() + 8, data.size() - 8);
+    } else if(type >= BLOBOBJ){
+        const zu64 need = _objectSize(type, data.size() + reserve);
+        if(hasnode && old.data.size >= need && old.data.size / 2 <= need && !_dedup->shared(old.data.offset)){
+            // Write over the old data
+            doffset = old.data.offset;
+            dsize = old.data.size;
+            reuse = true;
+        } else {
+            RETERR(_nodeAlloc(need, &doffset, &dsize));
+        }
+        RETERR(_writeAt(doffset, data.raw(), data.size()));
+        if(reserve == 0 && (_header->flags & OPT_DATA_CRC))
+            RETERR(_sealPayload(doffset, dsize, data.size(), _checksum(data.raw(), data.size())));
+        if(poffset){
+            *poffset = doffset;
+            *psize = dsize;
+        }
+    } else {
+        memcpy(payload, data.raw(), MIN(data.size(), 16));
+    }
+    if(doffset != ZU64_MAX){
+        ZBinary::encbeu64(payload, dsize);
+        ZBinary::encbeu64(payload + 8, doffset);
+    }
+
+    // Rewrite the index entry
+    if(_header->version == VERSION2){
+        zbyte *entry = leaf.entry(path.index[path.depth - 1]);
+        entry[ZUID_SIZE] = type;
+        entry[ZUID_SIZE + 1] = eflags;
+        memcpy(entry + ZUID_SIZE + 2, payload, 16);
+        RETERR(leaf.write());
+    } else {
+        node.type = type;
+        memcpy(node.payload, payload, 16);
+        if(type >= BLOBOBJ){
+            node.data.offset = doffset;
+            node.data.size = dsize;
+        }
+        RETERR(node.write());
+    }
+    _cache->erase(id);
+
+    // Old data node, unless it was written over or is still used
+    if(hasnode){
+        const bool used = _dedup->release(old.data.offset);
+        if(!reuse && !used)
+            RETERR(_nodeFree(old.data.offset, old.data.size));
+    }
+
+    _index->erase(id, old.type);
+    return _indexAdd(id, type, data);
+}
+
+ZParcel::parcelerror ZParcel::_treeFind(const ZUID &id, zu64 *offset){
+    zu64 next = _header->treehead;
+    for(zu64 d = 0; d < ZPARCEL_MAX_DEPTH; ++d){
+        if(next == ZU64_MAX)
+            return ERR_NOEXIST;
+        ParcelTreeNode node(this, next);
+        RETERR(node.read(d < _pool->levels));
+        const int cmp = node.uid.compare(id);
+        if(cmp == 0){
+            *offset = next;
+            return OK;
+        }
+        next = (cmp < 0 ? node.rnode : node.lnode);
+    }
+    return ERR_MAX_DEPTH;
+}
+
+ZParcel::parcelerror ZParcel::_storeFileName(ZUID id, ZPath path){
+    ZString name = ZPath(path).relativeTo(ZPath::pwd()).str();  // Get relative path
+    ZBinary nbin;
+    nbin.writebeu64(name.size());
+    nbin.write(name);
+    return _storeObject(id, STRINGOBJ, nbin);
+}
+
+ZParcel::parcelerror ZParcel::_storeFileData(ZUID id, zu64 filesize, zu64 dsize, zu8 flags, zu64 *poff, zu64 *psize){
+    ZBinary fbin;
+    fbin.writebeu64(filesize);
+    return _storeObject(id, BLOBOBJ, fbin, dsize, poff, flags, psize);
+}
+
+ZParcel::parcelerror ZParcel::_storeFileObject(ZUID id, ZUID nameid, ZUID dataid){
+    ZBinary bin;
+    bin.write(nameid.bin());
+    bin.write(dataid.bin());
+    return _storeObject(id, FILEOBJ, bin);
+}
+
+void ZParcel::_fileSizing(ZFile &infile, zu64 filesize, zu8 *flags, zu64 *dsize, zu32 *hash) const {
+    *flags = 0;
+    *dsize = filesize;
+    const bool compress = _compressWanted(filesize);
+    if(!compress && !hash)
         return;
 
-    ParcelTreeNode node(this, next);
-    if(node.read() != OK){
-        // Cannot read node
-        return;
+    // Compress once to find the compressed size, since it is allocated up front
+    ZBinary buff;
+    ZBinary cbuff;
+    zu64 csize = 0;
+    zu32 crc = 0;
+    while(!infile.atEnd()){
+        buff.clear();
+        if(infile.read(buff, (compress ? ZPARCEL_COMPRESS_CHUNK : ZPARCEL_COPY_CHUNK)) == 0)
+            break;
+        if(hash)
+            crc = _checksum(buff.raw(), buff.size(), crc);
+        if(!compress)
+            continue;
+        cbuff.clear();
+        encodeChunk(buff.raw(), buff.size(), cbuff);
+        csize += cbuff.size();
+    }
+    if(hash)
+        *hash = crc;
+    if(compress && csize * 100 <= filesize * _compresspct){
+        *flags = ParcelPage::ENTRY_COMPRESSED;
+        *dsize = csize;
+    }
+    infile.seek(0);
+}
+
+ZParcel::parcelerror ZParcel::_fileData(ZFile &infile, ZPath path, zu64 filesize, zu8 flags, zu64 dsize, zu64 poff, zu64 psize){
+    ZBinary fbin;
+    fbin.writebeu64(filesize);
+    const bool sum = !!(_header->flags & OPT_DATA_CRC);
+    zu32 crc = (sum ? _checksum(fbin.raw(), fbin.size()) : 0);
+    const zu64 start = poff;
+    const zu64 end = poff + 8 + dsize;
+    poff += 8;
+    bool copied = false;
+#if ZPARCEL_POSIX
+    if(!flags){
+        // Uncompressed data is copied straight from a descriptor
+        int infd = ::open(path.str().cc(), O_RDONLY);
+        if(infd >= 0){
+            parcelerror err = _copyFromFd(infd, poff, filesize, (sum ? &crc : nullptr));
+            ::close(infd);
+            RETERR(err);
+            poff += filesize;
+            copied = true;
+        }
+    }
+#endif
+    ZBinary buff;
+    ZBinary cbuff;
+    while(!copied && !infile.atEnd()){
+        buff.clear();
+        if(infile.read(buff, (flags ? ZPARCEL_COMPRESS_CHUNK : ZPARCEL_COPY_CHUNK)) == 0)
+            break;
+        const ZBinary *out = &buff;
+        if(flags){
+            cbuff.clear();
+            encodeChunk(buff.raw(), buff.size(), cbuff);
+            out = &cbuff;
+        }
+        // The file changed since its size was taken
+        if(out->size() > end - poff)
+            return ERR_TRUNC;
+        RETERR(_writeAt(poff, out->raw(), out->size()));
+        if(sum)
+            crc = _checksum(out->raw(), out->size(), crc);
+        poff += out->size();
+    }
+    return _sealPayload(start, psize, poff - start, crc);
+}
+
+ZParcel::parcelerror ZParcel::_getObjectInfo(ZUID id, ObjectInfo *info){
+    if(_header->version == VERSION3){
+        // One search of the table in memory, cheaper than the cache
+        const zu64 k = _packSearch(id);
+        if(k == 0 || pageKeyCompare(_packEntry(k), id) != 0)
+            return ERR_NOEXIST;
+        _pageEntryInfo(_packEntry(k), info);
+        info->tree = _pack->offset + (k - 1) * ParcelPage::LEAF_SIZE;
+        info->parent = 0;
+        return OK;
+    }
+
+    // Check cache
+    if(_cache->get(id, info))
+        return OK;
+
+    if(_header->version == VERSION2){
+        PagePath path;
+        ParcelPage leaf(this, ZU64_MAX);
+        const parcelerror err = _pageFind(_header->treehead, id, &path, &leaf);
+        _stats->lookup(path.depth);
+        if(err != OK)
+            return err;
+        _pageEntryInfo(leaf.entry(path.index[path.depth - 1]), info);
+        info->tree = leaf.offset;
+        info->parent = (path.depth > 1 ? path.page[path.depth - 2] : 0);
+
+        // Add to cache
+        _cache->put(id, *info);
+        return OK;
+    }
+
+    // Search the tree
+    zu64 next = _header->treehead;
+    zu64 prev = 0;
+
+    for(zu64 d = 0; d < ZPARCEL_MAX_DEPTH; ++d){
+        if(next == ZU64_MAX){
+            // Hit bottom of tree
+            _stats->lookup(d);
+            return ERR_NOEXIST;
+        }
+
+        ParcelTreeNode node(this, next);
+        RETERR(node.read(d < _pool->levels));
+
+        int cmp = node.uid.compare(id);
+        if(cmp < 0){
+            prev = next;
+            next = node.rnode;
+        } else if(cmp > 0){
+            prev = next;
+            next = node.lnode;
+        } else {
+            _stats->lookup(d + 1);
+            // Removed objects leave a null node in the tree
+            if(node.type == NULLOBJ)
+                return ERR_NOEXIST;
+
+            // Get the object info
+            // Payload checksums are checked by verify(), not on lookup
+
+            info->tree = next;
+            info->parent = prev;
+            info->lnode = node.lnode;
+            info->rnode = node.rnode;
+
+            info->type = node.type;
+            info->inlined = false;
+            info->inlen = 0;
+            info->compressed = false;
+            if(node.type >= BLOBOBJ){
+                info->data.offset = node.data.offset;
+                info->data.size = node.data.size;
+            } else {
+                memcpy(info->payload, node.payload, 16);
+            }
+
+            // Add to cache
+            _cache->put(id, *info);
+            return OK;
+        }
+    }
+    return ERR_MAX_DEPTH;
+}
+
+void ZParcel::_infoMany(const ZArray<ZUID> &ids, ZArray<ObjectInfo> &infos, ZArray<parcelerror> &errs){
+    infos.clear();
+    errs.clear();
+    std::vector<zu64> order(ids.size());
+    for(zu64 i = 0; i < ids.size(); ++i){
+        infos.push(ObjectInfo());
+        errs.push(ERR_NOEXIST);
+        order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), [&ids](zu64 a, zu64 b){
+        return (ids[a].compare(ids[b]) < 0);
+    });
+
+    // Keep the last leaf page, neighboring ids are often in it
+    ParcelPage leaf(this, ZU64_MAX);
+    zu64 parent = 0;
+    for(zu64 n = 0; n < order.size(); ++n){
+        const zu64 i = order[n];
+        const ZUID &id = ids[i];
+        ObjectInfo *info = &infos[i];
+
+        if(_header->version != VERSION2 || _cache->get(id, info)){
+            errs[i] = (_header->version != VERSION2 ? _getObjectInfo(id, info) : OK);
+            continue;
+        }
+
+        zu16 idx;
+        bool found = false;
+        if(leaf.offset != ZU64_MAX && leaf.count &&
+                pageKeyCompare(leaf.entry(0), id) <= 0 &&
+                pageKeyCompare(leaf.entry(leaf.count - 1), id) >= 0){
+            idx = leaf.search(id, &found);
+            _stats->lookup(1);
+        } else {
+            PagePath path;
+            leaf.offset = ZU64_MAX;
+            parcelerror err = _pageFind(_header->treehead, id, &path, &leaf);
+            _stats->lookup(path.depth);
+            if(err != OK){
+                leaf.offset = ZU64_MAX;
+                errs[i] = err;
+                continue;
+            }
+            idx = path.index[path.depth - 1];
+            parent = (path.depth > 1 ? path.page[path.depth - 2] : 0);
+            found = true;
+        }
+        if(!found)
+            continue;
+
+        _pageEntryInfo(leaf.entry(idx), info);
+        info->tree = leaf.offset;
+        info->parent = parent;
+        _cache->put(id, *info);
+        errs[i] = OK;
+    }
+}
+
+void ZParcel::_payloadMany(const ZArray<ObjectInfo> &infos, ZArray<parcelerror> &errs, ZArray<ZBinary> &out){
+    struct Read {
+        zu64 offset;
+        zu64 size;
+        zu64 index;
+        bool compressed;
+    };
+    std::vector<Read> reads;
+    out.clear();
+    for(zu64 i = 0; i < infos.size(); ++i){
+        if(errs[i] == OK && infos[i].inlined){
+            out.push(ZBinary(infos[i].payload, infos[i].inlen));
+            continue;
+        }
+        out.push(ZBinary());
+        if(errs[i] == OK)
+            reads.push_back({ infos[i].data.offset, infos[i].data.size, i, infos[i].compressed });
+    }
+    std::sort(reads.begin(), reads.end(), [](const Read &a, const Read &b){
+        return (a.offset < b.offset);
+    });
+
+    // Merge following reads that are close enough
+    struct Group {
+        zu64 start;
+        zu64 end;
+        zu64 first;
+        zu64 last;
+    };
+    std::vector<Group> groups;
+    for(zu64 r = 0; r < reads.size(); ){
+        Group grp = { reads[r].offset, reads[r].offset + reads[r].size, r, r + 1 };
+        while(grp.last < reads.size() && reads[grp.last].offset <= grp.end + ZPARCEL_MERGE_GAP &&
+              reads[grp.last].offset + reads[grp.last].size - grp.start <= ZPARCEL_COPY_CHUNK){
+            grp.end = MAX(grp.end, reads[grp.last].offset + reads[grp.last].size);
+            ++grp.last;
+        }
+        groups.push_back(grp);
+        r = grp.last;
+    }
+
+    // Each group fills its own entries, so groups are read in parallel
+    auto readGroup = [this, &reads, &groups, &errs, &out](zu64 g){
+        const Group &grp = groups[g];
+        const zu64 start = grp.start;
+        ZBinary buff;
+        const zbyte *base;
+        if(_map){
+            base = _mapView(start, grp.end - start);
+        } else {
+            buff.resize(grp.end - start);
+            base = (_readAt(start, buff.raw(), grp.end - start) == OK ? buff.raw() : nullptr);
+        }
+
+        for(zu64 r = grp.first; r < grp.last; ++r){
+            const Read &rd = reads[r];
+            if(base == nullptr){
+                errs[rd.index] = ERR_READ;
+                continue;
+            }
+            errs[rd.index] = decodePayload(base + (rd.offset - start), rd.size, rd.compressed, &out[rd.index]);
+        }
+    };
+
+    if(_map){
+        for(zu64 g = 0; g < groups.size(); ++g)
+            readGroup(g);
+    } else {
+        _io->parallel(groups.size(), readGroup);
+    }
+}
+
+ZParcel::parcelerror ZParcel::_fetchMany(const ZArray<ZUID> &ids, objtype type, ZArray<ObjectInfo> &infos,
+                                         ZArray<parcelerror> &errs, ZArray<ZBinary> *out){
+    _infoMany(ids, infos, errs);
+    for(zu64 i = 0; i < infos.size(); ++i){
+        if(errs[i] == OK && infos[i].type != type)
+            errs[i] = ERR_TYPE;
+    }
+    if(out)
+        _payloadMany(infos, errs, *out);
+
+    for(zu64 i = 0; i < errs.size(); ++i){
+        if(errs[i] != OK)
+            return errs[i];
+    }
+    return OK;
+}
+
+ZParcel::parcelerror ZParcel::_pageFind(zu64 root, const ZUID &id, PagePath *path, ParcelPage *leaf){
+    path->depth = 0;
+    zu64 next = root;
+    zu8 level = 0;
+
+    for(zu64 d = 0; d < ZPARCEL_MAX_DEPTH; ++d){
+        if(next == ZU64_MAX){
+            // Empty tree
+            return ERR_NOEXIST;
+        }
+
+        leaf->offset = next;
+        RETERR(leaf->read(d < _pool->levels));
+        // Each step must go down one level
+        if(d && leaf->level != level - 1)
+            return ERR_TREE;
+        level = leaf->level;
+
+        bool found;
+        zu16 i = leaf->search(id, &found);
+        path->page[d] = next;
+        path->index[d] = i;
+        path->depth = d + 1;
+
+        if(level == 0)
+            return (found ? OK : ERR_NOEXIST);
+        next = leaf->child(i);
+    }
+    return ERR_MAX_DEPTH;
+}
+
+ZParcel::parcelerror ZParcel::_pageInsert(zu64 *root, const PagePath *path, ParcelPage *leaf, const zbyte *entry){
+    if(path->depth == 0){
+        // New root leaf
+        zu64 offset;
+        zu64 nsize;
+        RETERR(_nodeAlloc(ParcelPage::PAGE_SIZE, &offset, &nsize));
+        ParcelPage page(this, offset);
+        page.init(0);
+        page.insertEntry(0, entry);
+        RETERR(page.write());
+        *root = offset;
+        return OK;
+    }
+
+    zu16 idx = path->index[path->depth - 1];
+    if(!leaf->full()){
+        leaf->insertEntry(idx, entry);
+        return leaf->write();
+    }
+
+    // Split leaf. Appending at the end of a page starts a new page, so ordered inserts fill pages.
+    zu64 offset;
+    zu64 nsize;
+    RETERR(_nodeAlloc(ParcelPage::PAGE_SIZE, &offset, &nsize));
+    ParcelPage right(this, offset);
+    right.init(0);
+    zu16 at = (idx == leaf->count ? idx : leaf->count / 2);
+    leaf->split(&right, at, nullptr);
+    if(idx < at){
+        leaf->insertEntry(idx, entry);
+    } else {
+        right.insertEntry(idx - at, entry);
+    }
+    RETERR(right.write());
+    RETERR(leaf->write());
+
+    // Separator key and new child to insert into parent
+    zbyte sep[ZUID_SIZE];
+    memcpy(sep, right.entry(0), ZUID_SIZE);
+    zu64 child = right.offset;
+    zu8 level = 0;
+
+    for(zu16 d = path->depth - 1; d > 0; --d){
+        ParcelPage page(this, path->page[d - 1]);
+        RETERR(page.read(d - 1 < _pool->levels));
+        zu16 i = path->index[d - 1] + 1;
+        level = page.level;
+
+        if(!page.full()){
+            page.insertChild(i, sep, child);
+            return page.write();
+        }
+
+        // Split inner page, promote middle key
+        RETERR(_nodeAlloc(ParcelPage::PAGE_SIZE, &offset, &nsize));
+        ParcelPage iright(this, offset);
+        iright.init(page.level);
+        zu16 m = (i == page.count + 1 ? page.count : page.count / 2 + 1);
+        zbyte promote[ZUID_SIZE];
+        page.split(&iright, m, promote);
+        if(i <= m){
+            page.insertChild(i, sep, child);
+        } else {
+            iright.insertChild(i - m, sep, child);
+        }
+        RETERR(iright.write());
+        RETERR(page.write());
+
+        memcpy(sep, promote, ZUID_SIZE);
+        child = iright.offset;
     }
 
-    _listStep(node.lnode, depth + 1);
-
-    LOG(ZString(' ', depth) << node.uid.str() << " " << typeName(node.type));
+    // Split root, grow tree
+    RETERR(_nodeAlloc(ParcelPage::PAGE_SIZE, &offset, &nsize));
+    ParcelPage nroot(this, offset);
+    nroot.init(level + 1);
+    nroot.setChild(0, *root);
+    nroot.insertChild(1, sep, child);
+    RETERR(nroot.write());
+    *root = offset;
+    return OK;
+}
 
-    _listStep(node.rnode, depth + 1);
+void ZParcel::_pageEntryInfo(const zbyte *entry, ObjectInfo *info){
+    const zbyte *payload = entry + ZUID_SIZE + 2;
+    info->tree = 0;
+    info->parent = 0;
+    info->lnode = ZU64_MAX;
+    info->rnode = ZU64_MAX;
+    info->type = entry[ZUID_SIZE];
+    info->inlined = !!(entry[ZUID_SIZE + 1] & ParcelPage::ENTRY_INLINE);
+    info->inlen = (info->inlined ? entry[ZUID_SIZE + 1] & ParcelPage::ENTRY_LENGTH : 0);
+    info->compressed = !!(entry[ZUID_SIZE + 1] & ParcelPage::ENTRY_COMPRESSED);
+    if(info->type >= BLOBOBJ && !info->inlined){
+        info->data.size = ZBinary::decbeu64(payload);
+        info->data.offset = ZBinary::decbeu64(payload + 8);
+    } else {
+        memcpy(info->payload, payload, 16);
+    }
 }
 
-// /////////////////////////////////////////////////////////////////////////////
+ZParcel::parcelerror ZParcel::_packLoad(){
+    PackRecord rec;
+    RETERR(_readAt(_header->treehead, (zbyte *)&rec, sizeof(rec)));
+    if(rec.magic != ZPARCEL_PACK_MAGIC)
+        return ERR_MAGIC;
+    if(_nodeChecksum(_header->flags, (const zbyte *)&rec, sizeof(rec), offsetof(PackRecord, crc)) != rec.crc)
+        return ERR_CRC;
 
-ZString ZParcel::typeName(objtype type){
-    if(typetoname.contains(type))
-        return typetoname[type];
-    else
-        return "Unknown Type";
+    // Table must fit before the tail
+    const zu64 count = rec.count;
+    const zu64 offset = _header->treehead + ZPARCEL_PACK_ALIGN;
+    if(offset > _header->tailptr || count > (_header->tailptr - offset) / ParcelPage::LEAF_SIZE)
+        return ERR_TRUNC;
+    const zu64 size = count * ParcelPage::LEAF_SIZE;
+
+    // Searched in place when mapped
+    const zbyte *table = (_map ? _mapView(offset, size) : nullptr);
+    if(!table){
+        _pack->buff.resize(size);
+        RETERR(_readAt(offset, _pack->buff.raw(), size));
+        table = _pack->buff.raw();
+    }
+    if(_checksum(table, size) != rec.tablecrc)
+        return ERR_CRC;
+
+    _pack->table = table;
+    _pack->count = count;
+    _pack->offset = offset;
+    return OK;
 }
 
-ZString ZParcel::errorStr(parcelerror err){
-    if(errtostr.contains(err))
-        return errtostr[err];
-    else
-        return "Unknown Error";
+zu64 ZParcel::_packSearch(const ZUID &id) const {
+    const zu64 hi = ZBinary::decbeu64(id.raw());
+    const zu64 lo = ZBinary::decbeu64(id.raw() + 8);
+    const zbyte *table = _pack->table;
+    const zu64 n = _pack->count;
+
+    // Right when the entry is less, the same number of steps for every id
+    zu64 k = 1;
+    while(k <= n){
+#if defined(__GNUC__)
+        // Four levels down is one cache line of candidates
+        if(16 * k <= n)
+            __builtin_prefetch(table + (16 * k - 1) * ParcelPage::LEAF_SIZE);
+#endif
+        const zbyte *entry = table + (k - 1) * ParcelPage::LEAF_SIZE;
+        const zu64 ehi = ZBinary::decbeu64(entry);
+        const zu64 elo = ZBinary::decbeu64(entry + 8);
+        k = 2 * k + (ehi < hi || (ehi == hi && elo < lo));
+    }
+
+    // Undo the right turns after the last left turn
+    while(k & 1)
+        k >>= 1;
+    return k >> 1;
 }
 
-// /////////////////////////////////////////////////////////////////////////////
+const zbyte *ZParcel::_packEntry(zu64 k) const {
+    return _pack->table + (k - 1) * ParcelPage::LEAF_SIZE;
+}
 
-zu64 ZParcel::_objectSize(objtype type, zu64 size){
-    switch(type){
-        case NULLOBJ:
-            return 0;
-        case BOOLOBJ:
-            return 1;
-        case UINTOBJ:
-        case SINTOBJ:
-            return 4;
-        case FLOATOBJ:
-            return 10;
-        case ZUIDOBJ:
-            return 16;
+ZParcel::parcelerror ZParcel::_nodeAlloc(zu64 size, zu64 *offset, zu64 *nsize, bool bound){
+    // Node must be able to hold a free node when it is freed
+    const zu64 minsize = (_bins ? ParcelBinNode::MIN_SIZE : ParcelFreeNode::NODE_SIZE);
+    if(size < minsize)
+        size = minsize;
+    _stats->add(ParcelStats::ALLOCS);
+
+    // Best fit from the free map
+    const zu64 next = _free->fit(size);
+    if(next != ZU64_MAX){
+        const zu64 fsize = _free->spans[next].size;
+        RETERR(_freeUnlink(next));
+        _stats->add(ParcelStats::FREEALLOCS);
+
+        if(fsize - size >= minsize){
+            // Split node, return the rest
+            RETERR(_freeLink(next + size, fsize - size));
+            *nsize = size;
+            _stats->add(ParcelStats::SPLITS);
+        } else {
+            // Whole node
+            *nsize = fsize;
+            _stats->add(ParcelStats::SLACK, fsize - size);
+        }
 
-        case BLOBOBJ:
-        case STRINGOBJ:
-            return size;
+//        DLOG("Alloc free node " << HEX(next) << " " << *nsize);
 
-        case FILEOBJ:
-            return 32;
+        *offset = next;
+        return OK;
+    }
 
-        default:
-            return size;
+    // No free nodes found
+    if(!(_header->flags & OPT_TAIL_EXTEND))
+        return ERR_NOFREE;
+
+    // Reserve new space, or pad it if the file cannot be extended without writing
+    if(!_fileReserve(_header->tailptr, size)){
+        ZBinary pad;
+        pad.fill(0, MIN(size, (zu64)ZPARCEL_COPY_CHUNK));
+        for(zu64 sz = 0; sz < size; ){
+            zu64 s = MIN(size - sz, pad.size());
+            RETERR(_writeAt(_header->tailptr + sz, pad.raw(), s));
+            sz += s;
+        }
     }
+
+    *offset = _header->tailptr;
+    *nsize = size;
+
+//    DLOG("Tail extend " << HEX(*offset) << " " << *nsize);
+
+    // Move tail
+    _header->tailptr += size;
+    RETERR(_header->write());
+
+    return OK;
 }
 
-ZParcel::parcelerror ZParcel::_storeObject(ZUID id, objtype type, const ZBinary &data, zu64 reserve){
-    // Tree node size
-    zu64 tsize = ParcelTreeNode::NODE_SIZE;
+ZParcel::parcelerror ZParcel::_nodeFree(zu64 offset, zu64 size){
+    // Nodes too small to hold a free node can only come from old parcels, leave them
+    if(size < (_bins ? ParcelBinNode::MIN_SIZE : ParcelFreeNode::NODE_SIZE))
+        return OK;
 
-    // Allocate tree node
-    zu64 offset;
-    zu64 nsize;
-    RETERR(_nodeAlloc(tsize, &offset, &nsize, true));
+    zu64 noffset = offset;
+    zu64 nsize = size;
+
+    auto right = _free->spans.lower_bound(offset);
+    if(right != _free->spans.end() && right->first < offset + size)
+        return ERR_FREELIST;
+
+    // Coalesce with left neighbor
+    if(right != _free->spans.begin()){
+        auto left = std::prev(right);
+        const zu64 lend = left->first + left->second.size;
+        if(lend > offset)
+            return ERR_FREELIST;
+        if(lend == offset){
+            noffset = left->first;
+            nsize += left->second.size;
+            RETERR(_freeUnlink(noffset));
+        }
+    }
 
-//    DLOG("New node " << HEX(offset) << " " << nsize);
+    // Coalesce with right neighbor
+    right = _free->spans.find(offset + size);
+    if(right != _free->spans.end()){
+        nsize += right->second.size;
+        RETERR(_freeUnlink(offset + size));
+    }
 
-    ParcelTreeNode newnode(this, offset);
-    newnode.uid = id;
-    newnode.lnode = ZU64_MAX;
-    newnode.rnode = ZU64_MAX;
-    newnode.type = type;
-    newnode.extra = nsize - tsize;
+    return _freeLink(noffset, nsize);
+}
 
-    // Write data
-    if(newnode.type >= BLOBOBJ){
-        // Data node size
-        zu64 dsize = _objectSize(type, data.size() + reserve);
-        RETERR(_nodeAlloc(dsize, &newnode.data.offset, &newnode.data.size));
+ZParcel::parcelerror ZParcel::_freeLoad(){
+    if(!_free)
+        _free = new ParcelFreeMap;
+    _free->clear();
+
+    if(_bins){
+        for(zu8 b = 0; b < ParcelBinTable::BINS; ++b){
+            zu64 prev = ZU64_MAX;
+            for(zu64 next = _bins->head[b]; next != ZU64_MAX; ){
+                if(_free->spans.count(next))
+                    return ERR_FREELIST;
+                ParcelBinNode node(this, next);
+                RETERR(node.read());
+                if(node.prev != prev || ParcelBinTable::bin(node.size) != b)
+                    return ERR_FREELIST;
+                _free->add(next, node.size, node.next, prev);
+                prev = next;
+                next = node.next;
+            }
+        }
+        return OK;
+    }
 
-//        DLOG("ObjNode " << HEX(newnode.data.offset) << " " << newnode.data.size << " " << HEX(newnode.data.offset + newnode.data.size));
+    zu64 prev = ZU64_MAX;
+    for(zu64 next = _header->freehead; next != ZU64_MAX; ){
+        if(_free->spans.count(next))
+            return ERR_FREELIST;
+        ParcelFreeNode node(this, next);
+        RETERR(node.read());
+        _free->add(next, node.size, node.next, prev);
+        prev = next;
+        next = node.next;
+    }
+    // Appends go after the real end of the list
+    _header->freetail = prev;
+    return OK;
+}
 
-    } else {
-        // Copy data into payload
-        memcpy(newnode.payload, data.raw(), MIN(data.size(), 16));
+ZParcel::parcelerror ZParcel::_freeWrite(zu64 offset){
+    const ParcelFreeMap::Span &span = _free->spans[offset];
+    if(_bins){
+        ParcelBinNode node(this, offset);
+        node.next = span.next;
+        node.prev = span.prev;
+        node.size = span.size;
+        return node.write();
     }
+    ParcelFreeNode node(this, offset);
+    node.next = span.next;
+    node.size = span.size;
+    return node.write();
+}
 
-    // Write the node
-    RETERR(newnode.write());
+ZParcel::parcelerror ZParcel::_freeLink(zu64 offset, zu64 size){
+    if(_bins){
+        // Push onto the head of its bin
+        const zu8 b = ParcelBinTable::bin(size);
+        const zu64 next = _bins->head[b];
+        _free->add(offset, size, next, ZU64_MAX);
+        if(next != ZU64_MAX){
+            _free->spans[next].prev = offset;
+            RETERR(_freeWrite(next));
+        }
+        RETERR(_freeWrite(offset));
+        _bins->head[b] = offset;
+        return _bins->write();
+    }
 
-    // Find where to insert into tree
-    zu64 next = _header->treehead;
-    if(next == ZU64_MAX){
-        // Tree head is uninitialzied
-        _header->treehead = offset;
-        RETERR(_header->write());
+    // Append to the list
+    const zu64 prev = (_header->freehead == ZU64_MAX ? ZU64_MAX : _header->freetail);
+    _free->add(offset, size, ZU64_MAX, prev);
+    RETERR(_freeWrite(offset));
+    if(prev == ZU64_MAX){
+        _header->freehead = offset;
+    } else {
+        _free->spans[prev].next = offset;
+        RETERR(_freeWrite(prev));
+    }
+    _header->freetail = offset;
+    return _header->write();
+}
 
+ZParcel::parcelerror ZParcel::_freeUnlink(zu64 offset){
+    const ParcelFreeMap::Span span = _free->spans[offset];
+    _free->erase(offset);
+    bool header = false;
+
+    if(span.prev != ZU64_MAX){
+        _free->spans[span.prev].next = span.next;
+        RETERR(_freeWrite(span.prev));
+    } else if(_bins){
+        _bins->head[ParcelBinTable::bin(span.size)] = span.next;
+        RETERR(_bins->write());
     } else {
+        _header->freehead = span.next;
+        header = true;
+    }
 
-        // Search tree
-        bool found = false;
-        for(zu64 d = 0; d < ZPARCEL_MAX_DEPTH; ++d){
-            // Read the node
-            ParcelTreeNode node(this, next);
-            RETERR(node.read());
+    if(span.next != ZU64_MAX){
+        _free->spans[span.next].prev = span.prev;
+        // List nodes only store next
+        if(_bins)
+            RETERR(_freeWrite(span.next));
+    } else if(!_bins){
+        _header->freetail = span.prev;
+        header = true;
+    }
 
-            // Compare
-            int cmp = node.uid.compare(id);
-            if(cmp < 0){
-                if(node.rnode == ZU64_MAX){
-                    // Rewrite leaf
-                    node.rnode = offset;
-                    RETERR(node.write());
+    if(header)
+        RETERR(_header->write());
+    return OK;
+}
 
-                    found = true;
-                    break;
-                }
-                next = node.rnode;
-            } else if(cmp > 0){
-                if(node.lnode == ZU64_MAX){
-                    // Rewrite leaf
-                    node.lnode = offset;
-                    RETERR(node.write());
+ZParcel::parcelerror ZParcel::_readAt(zu64 offset, zbyte *dest, zu64 size){
+    if(_map){
+        const zbyte *ptr = _mapView(offset, size);
+        if(ptr == nullptr)
+            return ERR_READ;
+        memcpy(dest, ptr, size);
+        _stats->add(ParcelStats::READS);
+        _stats->add(ParcelStats::READBYTES, size);
+        return OK;
+    }
 
-                    found = true;
-                    break;
-                }
-                next = node.lnode;
-            } else {
-                // Object already exists
-                if(node.type == NULLOBJ){
-                    // TODO: Fill in new node
-                    return ERR_EXISTS;
-                } else {
-                    return ERR_EXISTS;
+    if(_batch || !_wal->overlay.empty()){
+        if(_batch){
+            auto it = _batch->extents.upper_bound(offset);
+            if(it != _batch->extents.begin()){
+                auto prev = std::prev(it);
+                if(prev->first + prev->second.size() >= offset + size){
+                    // Entirely buffered
+                    memcpy(dest, prev->second.raw() + (offset - prev->first), size);
+                    return OK;
                 }
             }
         }
-        // Loop ended without finding tree leaf
-        if(!found)
-            return ERR_MAX_DEPTH;
+
+        // Space past the end of the file can only be read where this batch or the journal wrote it
+        const zu64 len = _fileRead(offset, dest, size);
+        for(zu64 pos = offset + len; pos < offset + size; ){
+            zu64 next = coveredExtents(_wal->overlay, pos);
+            if(_batch)
+                next = MAX(next, coveredExtents(_batch->extents, pos));
+            if(next == pos)
+                return ERR_READ;
+            pos = next;
+        }
+
+        // Overlay logged writes, then buffered writes
+        overlayExtents(_wal->overlay, offset, dest, size);
+        if(_batch)
+            overlayExtents(_batch->extents, offset, dest, size);
+        return OK;
     }
 
-    if(newnode.type >= BLOBOBJ){
-        ObjectInfo info;
-        RETERR(_getObjectInfo(id, &info));
-        if(info.type != type)
-            return ERR_TREE;
+    if(_fileRead(offset, dest, size) != size)
+        return ERR_READ;
+    return OK;
+}
 
-        zu64 wsize = info.accessor->write(data.raw(), data.size());
-//        DLOG("Object data write " << data.size() << " " << wsize);
+ZParcel::parcelerror ZParcel::_writeAt(zu64 offset, const zbyte *src, zu64 size){
+    if(size == 0)
+        return OK;
+    const zu64 end = offset + size;
+
+    // Pooled nodes always match the file
+    _pool->mirror(offset, src, size);
+
+    if(_build){
+        // Stage sequential writes
+        if(_build->stage.size() == 0)
+            _build->offset = offset;
+        if(offset == _build->offset + _build->stage.size()){
+            const zu64 pos = _build->stage.size();
+            _build->stage.resize(pos + size);
+            memcpy(_build->stage.raw() + pos, src, size);
+            if(_build->stage.size() >= ZPARCEL_COPY_CHUNK)
+                RETERR(_buildFlush());
+            return OK;
+        }
+        RETERR(_buildFlush());
+    }
+
+    // Each write operation on a journaled parcel is one transaction, logged whole
+    if(!_batch && _wal->on)
+        _batch = new ParcelBatch;
+
+    // Large writes skip the batch, and the journal too in new space
+    if(!_batch || (size >= ZPARCEL_BATCH_DIRECT && (!_wal->on || offset >= _wal->tail))){
+        if(!_fileWrite(offset, src, size))
+            return ERR_WRITE;
+
+        if(_batch){
+            _batch->direct = _wal->on;
+            // Keep overlapping buffered extents consistent with the direct write
+            auto it = _batch->extents.upper_bound(offset);
+            if(it != _batch->extents.begin())
+                --it;
+            for(; it != _batch->extents.end() && it->first < end; ++it){
+                const zu64 start = MAX(it->first, offset);
+                const zu64 stop = MIN(it->first + it->second.size(), end);
+                if(stop > start)
+                    memcpy(it->second.raw() + (start - it->first), src + (start - offset), stop - start);
+            }
+        }
+        return OK;
     }
 
+    mergeExtent(_batch->extents, offset, src, size);
     return OK;
 }
 
-ZParcel::parcelerror ZParcel::_getObjectInfo(ZUID id, ObjectInfo *info){
-    // Check cache
-    if(_cache.contains(id)){
-        *info = _cache[id];
+ZParcel::parcelerror ZParcel::_buildBegin(){
+    if(_header->version != VERSION2 || _header->treehead != ZU64_MAX || _batch)
+        return ERR_TREE;
+    // Builds write the file directly, and it is synced when the journal is closed
+    _wal->on = false;
+    _build = new ParcelBuild;
+    return OK;
+}
+
+ZParcel::parcelerror ZParcel::_buildFinish(){
+    zu64 head;
+    RETERR(_buildIndex(&head));
+    delete _build;
+    _build = nullptr;
+
+    _header->treehead = head;
+    RETERR(_header->write());
+    return OK;
+}
+
+ZParcel::parcelerror ZParcel::_buildIndex(zu64 *head){
+    std::vector<ParcelBuild::Entry> &entries = _build->entries;
+
+    // Sort by UUID
+    std::sort(entries.begin(), entries.end(), [](const ParcelBuild::Entry &a, const ParcelBuild::Entry &b){
+        ZUID aid;
+        aid.fromRaw(a.raw);
+        return (pageKeyCompare(b.raw, aid) > 0);
+    });
+    for(zu64 i = 1; i < entries.size(); ++i){
+        ZUID id;
+        id.fromRaw(entries[i].raw);
+        if(pageKeyCompare(entries[i - 1].raw, id) == 0)
+            return ERR_EXISTS;
+    }
+
+    // First key and offset of each page on the level being built
+    std::vector<std::pair<const zbyte *, zu64>> level;
+
+    // Leaf pages, filled evenly and linked in order
+    const zu64 nleaf = (entries.size() + ParcelPage::LEAF_MAX - 1) / ParcelPage::LEAF_MAX;
+    zu64 e = 0;
+    for(zu64 i = 0; i < nleaf; ++i){
+        ParcelPage page(this, _header->tailptr);
+        _header->tailptr += ParcelPage::PAGE_SIZE;
+        page.init(0);
+        const zu64 n = entries.size() / nleaf + (i < entries.size() % nleaf ? 1 : 0);
+        level.push_back({ entries[e].raw, page.offset });
+        for(zu16 j = 0; j < n; ++j, ++e)
+            page.insertEntry(j, entries[e].raw);
+        if(i + 1 < nleaf)
+            page.next = _header->tailptr;
+        RETERR(page.write());
+    }
+
+    // Inner pages, one level at a time
+    for(zu8 lvl = 1; level.size() > 1; ++lvl){
+        const zu64 fan = ParcelPage::INNER_MAX + 1;
+        const zu64 npage = (level.size() + fan - 1) / fan;
+        std::vector<std::pair<const zbyte *, zu64>> upper;
+        zu64 c = 0;
+        for(zu64 i = 0; i < npage; ++i){
+            ParcelPage page(this, _header->tailptr);
+            _header->tailptr += ParcelPage::PAGE_SIZE;
+            page.init(lvl);
+            const zu64 n = level.size() / npage + (i < level.size() % npage ? 1 : 0);
+            upper.push_back({ level[c].first, page.offset });
+            page.setChild(0, level[c++].second);
+            for(zu16 j = 1; j < n; ++j, ++c)
+                page.insertChild(j, level[c].first, level[c].second);
+            RETERR(page.write());
+        }
+        level.swap(upper);
+    }
+
+    RETERR(_buildFlush());
+    *head = (level.size() ? level[0].second : ZU64_MAX);
+    return OK;
+}
+
+zu64 ZParcel::_buildCount() const {
+    return _build->entries.size();
+}
+
+ZParcel::parcelerror ZParcel::_buildFlush(){
+    if(_build->stage.size() == 0)
+        return OK;
+    if(!_fileWrite(_build->offset, _build->stage.raw(), _build->stage.size()))
+        return ERR_WRITE;
+    _build->stage.clear();
+    return OK;
+}
+
+ZParcel::parcelerror ZParcel::_flushBatch(){
+    // Write runs of adjacent extents with as few writes as possible
+    ZBinary stage;
+    zu64 soff = 0;
+    zu64 slen = 0;
+    for(auto it = _batch->extents.begin(); it != _batch->extents.end(); ++it){
+        const zu64 size = it->second.size();
+        if(slen && (soff + slen != it->first || slen + size > ZPARCEL_COPY_CHUNK)){
+            if(!_fileWrite(soff, stage.raw(), slen))
+                return ERR_WRITE;
+            slen = 0;
+        }
+        if(size >= ZPARCEL_COPY_CHUNK){
+            if(!_fileWrite(it->first, it->second.raw(), size))
+                return ERR_WRITE;
+            continue;
+        }
+        if(slen == 0){
+            soff = it->first;
+            if(stage.size() < ZPARCEL_COPY_CHUNK)
+                stage.resize(ZPARCEL_COPY_CHUNK);
+        }
+        memcpy(stage.raw() + slen, it->second.raw(), size);
+        slen += size;
+    }
+    if(slen && !_fileWrite(soff, stage.raw(), slen))
+        return ERR_WRITE;
+    return OK;
+}
+
+ZParcel::parcelerror ZParcel::_walRecover(const ZString &path){
+#if ZPARCEL_POSIX
+    int fd = ::open(path.cc(), O_RDWR);
+    if(fd < 0)
+        return (errno == ENOENT ? OK : ERR_OPEN);
+    struct stat st;
+    if(::fstat(fd, &st) != 0){
+        ::close(fd);
+        return ERR_OPEN;
+    }
+    const zu64 fsize = st.st_size;
+
+    // Replay whole records in order, up to the first torn or corrupt one
+    parcelerror err = OK;
+    zu64 pos = 0;
+    zu64 replayed = 0;
+    ZBinary rec;
+    while(err == OK && fsize - pos >= sizeof(JournalRecord)){
+        JournalRecord head;
+        if(!readFd(fd, (zbyte *)&head, sizeof(head), pos) || head.magic != ZPARCEL_WAL_MAGIC ||
+                head.size > fsize - pos - sizeof(head))
+            break;
+        rec.resize(sizeof(head) + head.size);
+        if(!readFd(fd, rec.raw(), rec.size(), pos) ||
+                ZParcelChecksum::node(rec.raw(), rec.size(), offsetof(JournalRecord, crc)) != head.crc)
+            break;
+
+        const zbyte *ptr = rec.raw() + sizeof(head);
+        zu64 rem = head.size;
+        for(zu32 i = 0; err == OK && i < head.count; ++i){
+            JournalExtent ext;
+            if(rem < sizeof(ext)){
+                err = ERR_TRUNC;
+                break;
+            }
+            memcpy(&ext, ptr, sizeof(ext));
+            ptr += sizeof(ext);
+            rem -= sizeof(ext);
+            if(ext.size > rem){
+                err = ERR_TRUNC;
+                break;
+            }
+            if(!_fileWrite(ext.offset, ptr, ext.size))
+                err = ERR_WRITE;
+            ptr += ext.size;
+            rem -= ext.size;
+        }
+        pos += rec.size();
+        ++replayed;
+    }
+
+    // Records are dropped once their writes are synced. A journal that could not be replayed is kept.
+    if(err == OK && replayed && !_fileSync())
+        err = ERR_WRITE;
+    if(err == OK && (::ftruncate(fd, 0) != 0 || !syncFd(fd)))
+        err = ERR_WRITE;
+    ::close(fd);
+    return err;
+#else
+    return OK;
+#endif
+}
+
+ZParcel::parcelerror ZParcel::_walStart(const ZString &path, bool create){
+#if ZPARCEL_POSIX
+    // The new parcel must be in the file before any record is replayed onto it
+    if(create && !_fileSync())
+        return ERR_WRITE;
+    int fd = ::open(path.cc(), O_RDWR | O_CREAT | O_APPEND | (create ? O_TRUNC : 0), 0644);
+    if(fd < 0)
+        return ERR_OPEN;
+    struct stat st;
+    if(::fstat(fd, &st) != 0 || !syncFd(fd) || !syncDir(path)){
+        ::close(fd);
+        return ERR_OPEN;
+    }
+    {
+        std::lock_guard<std::mutex> lk(_wal->mutex);
+        _wal->fd = fd;
+    }
+    _wal->size = st.st_size;
+    _wal->tail = _header->tailptr;
+    _wal->on = true;
+    return OK;
+#else
+    return ERR_OPEN;
+#endif
+}
+
+void ZParcel::_walClose(){
+#if ZPARCEL_POSIX
+    zu64 lsn;
+    if(_txnLog(&lsn) != OK)
+        ELOG("ZParcel: journal write on close failed");
+    // Records left in the file after a failed checkpoint are replayed on open
+    if(_walCheckpoint() != OK)
+        ELOG("ZParcel: journal checkpoint on close failed");
+
+    std::unique_lock<std::mutex> lk(_wal->mutex);
+    _wal->cond.wait(lk, [this]{ return !_wal->syncing; });
+    ::close(_wal->fd);
+    _wal->fd = -1;
+    _wal->synced = _wal->written;
+    _wal->failed = false;
+    _wal->records.clear();
+    _wal->cond.notify_all();
+#endif
+    _wal->on = false;
+    _wal->size = 0;
+    _wal->overlay.clear();
+}
+
+ZParcel::parcelerror ZParcel::_txnLog(zu64 *lsn){
+    *lsn = 0;
+    if(!_wal->on || !_batch || _batch->depth)
         return OK;
+    // Read-only after a failed sync
+    if(_readonly){
+        _txnAbort();
+        return ERR_READONLY;
     }
 
-    // Search the tree
-    zu64 next = _header->treehead;
-    zu64 prev = 0;
+    parcelerror err = OK;
+    if(_batch->header){
+        _batch->header = false;
+        err = _header->write();
+    }
+    std::unique_ptr<ParcelBatch> batch(_batch);
+    _batch = nullptr;
+    if(err != OK || batch->extents.empty()){
+        if(err != OK)
+            _reloadState();
+        return err;
+    }
+
+    // Data written past the journal must be in the file before any record refers to it
+    if(batch->direct && !_fileSync()){
+        _reloadState();
+        return ERR_WRITE;
+    }
+
+#if ZPARCEL_POSIX
+    // One record of every extent the operation wrote
+    zu64 total = sizeof(JournalRecord);
+    for(const auto &ext : batch->extents)
+        total += sizeof(JournalExtent) + ext.second.size();
+    ZBinary rec(total);
+    JournalRecord head;
+    head.magic = ZPARCEL_WAL_MAGIC;
+    head.count = (zu32)batch->extents.size();
+    head.size = total - sizeof(head);
+    head.crc = 0;
+    zbyte *ptr = rec.raw() + sizeof(head);
+    for(const auto &ext : batch->extents){
+        JournalExtent jext;
+        jext.offset = ext.first;
+        jext.size = ext.second.size();
+        memcpy(ptr, &jext, sizeof(jext));
+        memcpy(ptr + sizeof(jext), ext.second.raw(), ext.second.size());
+        ptr += sizeof(jext) + ext.second.size();
+    }
+    memcpy(rec.raw(), &head, sizeof(head));
+    head.crc = ZParcelChecksum::node(rec.raw(), total, offsetof(JournalRecord, crc));
+    memcpy(rec.raw(), &head, sizeof(head));
+
+    if(!writeFd(_wal->fd, rec.raw(), total)){
+        // A torn record would hide the records appended after it
+        if(::ftruncate(_wal->fd, _wal->size) != 0)
+            ELOG("ZParcel: journal truncate failed");
+        _reloadState();
+        return ERR_WRITE;
+    }
+    _wal->size += total;
+    _wal->tail = MAX(_wal->tail, _header->tailptr);
+
+    // Reads see the writes until they are applied
+    for(const auto &ext : batch->extents)
+        mergeExtent(_wal->overlay, ext.first, ext.second.raw(), ext.second.size());
+    std::lock_guard<std::mutex> lk(_wal->mutex);
+    *lsn = ++_wal->written;
+    _wal->records.push_back({ *lsn, std::move(batch->extents) });
+    return OK;
+#else
+    return ERR_WRITE;
+#endif
+}
+
+void ZParcel::_txnAbort(){
+    if(!_wal->on || !_batch || _batch->depth)
+        return;
+    delete _batch;
+    _batch = nullptr;
+    _reloadState();
+}
+
+ZParcel::parcelerror ZParcel::_walSync(zu64 lsn){
+#if ZPARCEL_POSIX
+    ParcelJournal *wal = _wal;
+    std::unique_lock<std::mutex> lk(wal->mutex);
+    while(wal->synced < lsn){
+        if(wal->failed)
+            return ERR_WRITE;
+        if(wal->syncing){
+            wal->cond.wait(lk);
+            continue;
+        }
+        // Lead one sync for every record appended so far
+        wal->syncing = true;
+        const zu64 target = wal->written;
+        const int fd = wal->fd;
+        lk.unlock();
+        const bool ok = syncFd(fd);
+        lk.lock();
+        wal->syncing = false;
+        if(ok)
+            wal->synced = MAX(wal->synced, target);
+        else
+            wal->failed = true;
+        wal->cond.notify_all();
+        if(!ok)
+            return ERR_WRITE;
+    }
+    return OK;
+#else
+    return ERR_WRITE;
+#endif
+}
+
+bool ZParcel::_walDue(){
+    std::lock_guard<std::mutex> lk(_wal->mutex);
+    return (!_wal->records.empty() && _wal->records.front().lsn <= _wal->synced);
+}
 
-    for(zu64 d = 0; d < ZPARCEL_MAX_DEPTH; ++d){
-        if(next == ZU64_MAX){
-            // Hit bottom of tree
-            return ERR_NOEXIST;
+ZParcel::parcelerror ZParcel::_walApply(){
+    std::unique_lock<std::mutex> lk(_wal->mutex);
+    const zu64 synced = _wal->synced;
+    lk.unlock();
+
+    // Records are only added under the parcel lock, so the front stays put while it is written
+    parcelerror err = OK;
+    bool applied = false;
+    while(!_wal->records.empty() && _wal->records.front().lsn <= synced){
+        for(const auto &ext : _wal->records.front().extents){
+            if(!_fileWrite(ext.first, ext.second.raw(), ext.second.size()))
+                err = ERR_WRITE;
         }
+        if(err != OK)
+            break;
+        lk.lock();
+        _wal->records.pop_front();
+        lk.unlock();
+        applied = true;
+    }
 
-        ParcelTreeNode node(this, next);
-        RETERR(node.read());
-
-        int cmp = node.uid.compare(id);
-        if(cmp < 0){
-            prev = next;
-            next = node.rnode;
-        } else if(cmp > 0){
-            prev = next;
-            next = node.lnode;
-        } else {
-            // Get the object info
-            // TODO: Check object CRC
+    if(applied){
+        _wal->overlay.clear();
+        for(const auto &rec : _wal->records){
+            for(const auto &ext : rec.extents)
+                mergeExtent(_wal->overlay, ext.first, ext.second.raw(), ext.second.size());
+        }
+    }
+    return err;
+}
 
-            info->tree = next;
-            info->parent = prev;
-            info->lnode = node.lnode;
-            info->rnode = node.rnode;
+ZParcel::parcelerror ZParcel::_walCheckpoint(){
+#if ZPARCEL_POSIX
+    {
+        std::unique_lock<std::mutex> lk(_wal->mutex);
+        _wal->cond.wait(lk, [this]{ return !_wal->syncing; });
+        // A later sync may succeed without the failed writes
+        if(_wal->failed)
+            return ERR_WRITE;
+        if(_wal->synced < _wal->written){
+            if(!syncFd(_wal->fd))
+                return ERR_WRITE;
+            _wal->synced = _wal->written;
+            _wal->cond.notify_all();
+        }
+    }
+    RETERR(_walApply());
 
-            info->type = node.type;
-            if(node.type >= BLOBOBJ){
-                info->data.offset = node.data.offset;
-                info->data.size = node.data.size;
-                info->accessor = new ParcelObjectAccessor(_file, info->data.offset, info->data.size);
-            } else {
-                memcpy(info->payload, node.payload, 16);
-                info->accessor = nullptr;
-            }
+    // Applied writes are durable in the parcel file before the records are dropped
+    if(!_fileSync())
+        return ERR_WRITE;
+    if(::ftruncate(_wal->fd, 0) != 0 || !syncFd(_wal->fd))
+        return ERR_WRITE;
+    _wal->size = 0;
+#endif
+    return OK;
+}
 
-            // Add to cache
-            _cache.add(id, *info);
-            return OK;
+zu64 ZParcel::_fileRead(zu64 offset, zbyte *dest, zu64 size){
+    _stats->add(ParcelStats::READS);
+    _stats->add(ParcelStats::READBYTES, size);
+#if ZPARCEL_POSIX
+    if(_fd >= 0){
+        zu64 done = 0;
+        while(done < size){
+            ssize_t r = ::pread(_fd, dest + done, size - done, offset + done);
+            if(r < 0 && errno == EINTR)
+                continue;
+            if(r <= 0)
+                break;
+            done += r;
         }
+        return done;
     }
-    return ERR_MAX_DEPTH;
+#endif
+    std::lock_guard<std::mutex> io(_lock->io);
+    if(_file->seek(offset) != offset)
+        return 0;
+    return _file->read(dest, size);
 }
 
-ZParcel::parcelerror ZParcel::_nodeAlloc(zu64 size, zu64 *offset, zu64 *nsize, bool bound){
-    zu64 next = _header->freehead;
-    zu64 fsize;
-    zu64 fnext;
-    zu64 prev = 0;
+bool ZParcel::_fileWrite(zu64 offset, const zbyte *src, zu64 size){
+    _stats->add(ParcelStats::WRITES);
+    _stats->add(ParcelStats::WRITEBYTES, size);
+#if ZPARCEL_POSIX
+    if(_fd >= 0){
+        zu64 done = 0;
+        while(done < size){
+            ssize_t r = ::pwrite(_fd, src + done, size - done, offset + done);
+            if(r < 0 && errno == EINTR)
+                continue;
+            if(r <= 0)
+                return false;
+            done += r;
+        }
+        return true;
+    }
+#endif
+    std::lock_guard<std::mutex> io(_lock->io);
+    if(_file->seek(offset) != offset)
+        return false;
+    return (_file->write(src, size) == size);
+}
 
-    // Search the free list
-    while(true){
-        if(next == ZU64_MAX){
-            // No free nodes found
-            if(_header->flags & OPT_TAIL_EXTEND){
-                if(_file->seek(_header->tailptr) != _header->tailptr)
-                    return ERR_SEEK;
-
-                // Pad new space
-                ZBinary pad;
-                pad.fill(0, 4096);
-                for(zu64 sz = size; sz > 0; ){
-                    zu32 s = MIN(sz, 4096);
-                    if(_file->write(pad.raw(), s) != s)
-                        return ERR_WRITE;
-                    sz -= s;
-                }
+zu64 ZParcel::_fileSize(){
+#if ZPARCEL_POSIX
+    if(_fd >= 0){
+        struct stat st;
+        return (::fstat(_fd, &st) == 0 ? (zu64)st.st_size : 0);
+    }
+#endif
+    std::lock_guard<std::mutex> io(_lock->io);
+    _file->seek(0);
+    zu64 size = _file->available();
+    _file->seek(0);
+    return size;
+}
 
-                *offset = _header->tailptr;
-                *nsize = size;
+bool ZParcel::_fileTruncate(zu64 size){
+#if ZPARCEL_POSIX
+    if(_fd >= 0)
+        return (::ftruncate(_fd, size) == 0);
+#endif
+    return true;
+}
 
-//                DLOG("Tail extend " << HEX(offset) << " " << nsize);
+bool ZParcel::_fileSync(){
+#if ZPARCEL_POSIX
+    if(_fd >= 0)
+        return syncFd(_fd);
+#endif
+    return true;
+}
 
-                // Move tail
-                _header->tailptr += size;
-                RETERR(_header->write());
+bool ZParcel::_fileReserve(zu64 offset, zu64 size){
+#if ZPARCEL_POSIX
+    // Space already in the file may hold old data, so it is padded
+    if(_fd < 0 || _fileSize() > offset)
+        return false;
+#if defined(__linux__)
+    if(::fallocate(_fd, 0, offset, size) == 0)
+        return true;
+#endif
+    return (::ftruncate(_fd, offset + size) == 0);
+#else
+    return false;
+#endif
+}
 
-                return OK;
-            } else {
-                return ERR_NOFREE;
-            }
-        }
+const zbyte *ZParcel::_mapView(zu64 offset, zu64 size) const {
+    if(offset > _mapsize || size > _mapsize - offset)
+        return nullptr;
+    return _map + offset;
+}
 
-        // Read free list node
-        ParcelFreeNode fnode(this, next);
-        RETERR(fnode.read());
+ZParcel::parcelerror ZParcel::_blobRange(ZUID id, const char *fn, ObjectInfo *info, zu64 *offset, zu64 *size){
+    auto err = _getObjectInfo(id, info);
+    if(err != OK)
+        throw ZException(ZString(fn) + " failed object info " + errorStr(err));
+    if(info->type != BLOBOBJ)
+        throw ZException(ZString(fn) + " called for wrong Object type");
+    if(info->inlined || info->compressed)
+        return OK;
 
-//        DLOG("Search free node " << HEX(next) << " " << fnode.size);
+    ParcelObjectAccessor accessor(this, info->data.offset, info->data.size);
+    zu64 len = accessor.readbeu64();
+    if(len > info->data.size - 8)
+        return ERR_TRUNC;
 
-        // check node
-        if(fnode.size >= size){
-            // Got first free entry large enough
-//            DLOG("Free node " << HEX(next) << " " << fnode.size);
+    *offset = info->data.offset + 8;
+    *size = len;
+    return OK;
+}
 
-//            if(bound){
-//                // Check that beginning and end of node are in the same 4 KiB-aligned block
-//                zu64 moff = next >> 12;
-//                zu64 mend = (next + size - 1) >> 12;
-//                if(moff == mend){
-//                    fsize = fnode.size;
-//                    fnext = fnode.next;
-//                    break;
-//                } else if(fnode.size - (((moff + 1) << 12) - next) > size){
+const zbyte *ZParcel::_mapInline(const ZUID &id, zu64 page) const {
+    // Packed objects know their own entry
+    if(_header->version == VERSION3)
+        return _mapView(page + ZUID_SIZE + 2, ParcelPage::INLINE_MAX);
+    const zbyte *pg = _mapView(page, ParcelPage::PAGE_SIZE);
+    if(pg == nullptr)
+        return nullptr;
+    zu16 lo = 0;
+    zu16 hi = MIN(ZBinary::decbeu16(pg + 6), ParcelPage::LEAF_MAX);
+    while(lo < hi){
+        const zu16 mid = lo + (hi - lo) / 2;
+        const zbyte *entry = pg + ParcelPage::HEAD_SIZE + (zu64)mid * ParcelPage::LEAF_SIZE;
+        const int cmp = pageKeyCompare(entry, id);
+        if(cmp == 0)
+            return entry + ZUID_SIZE + 2;
+        if(cmp < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return nullptr;
+}
 
-//                }
+ZParcel::parcelerror ZParcel::_copyToFd(int fd, zu64 offset, zu64 size){
+#if ZPARCEL_POSIX
+    const int infd = (_mapfd >= 0 ? _mapfd : _fd);
+    zu64 done = 0;
+#if defined(__linux__)
+    // Copy in kernel, may fail for some file system combinations
+    loff_t inoff = offset;
+    while(done < size){
+        ssize_t r = ::copy_file_range(infd, &inoff, fd, nullptr, size - done, 0);
+        if(r <= 0)
+            break;
+        done += r;
+    }
+    while(done < size){
+        off_t soff = offset + done;
+        ssize_t r = ::sendfile(fd, infd, &soff, MIN(size - done, (zu64)1 << 30));
+        if(r <= 0)
+            break;
+        done += r;
+    }
+#endif
+    // Write from mapping, or read into a buffer
+    ZBinary buff;
+    while(done < size){
+        const zu64 n = MIN(size - done, (zu64)ZPARCEL_COPY_CHUNK);
+        const zbyte *ptr;
+        if(_map){
+            ptr = _mapView(offset + done, n);
+        } else {
+            buff.resize(n);
+            ptr = (_fileRead(offset + done, buff.raw(), n) == n ? buff.raw() : nullptr);
+        }
+        if(ptr == nullptr)
+            return ERR_TRUNC;
+        ssize_t r = ::write(fd, ptr, n);
+        if(r <= 0)
+            return ERR_WRITE;
+        done += r;
+    }
+    return OK;
+#else
+    return ERR_WRITE;
+#endif
+}
 
-//            } else {
-                fsize = fnode.size;
-                fnext = fnode.next;
+ZParcel::parcelerror ZParcel::_copyFromFd(int fd, zu64 offset, zu64 size, zu32 *crc){
+#if ZPARCEL_POSIX
+    zu64 done = 0;
+#if defined(__linux__)
+    ::posix_fadvise(fd, 0, size, POSIX_FADV_SEQUENTIAL);
+    // Copy in kernel when the data is not checksummed. Batches buffer writes, so they cannot,
+    // except journaled write operations into new space they have not written yet.
+    const bool direct = (_wal->on ? offset >= _wal->tail && !(_batch && overlapsExtents(_batch->extents, offset, size)) : !_batch);
+    if(!crc && _fd >= 0 && direct){
+        if(_wal->on){
+            if(!_batch)
+                _batch = new ParcelBatch;
+            _batch->direct = true;
+        }
+        loff_t outoff = offset;
+        while(done < size){
+            ssize_t r = ::copy_file_range(fd, nullptr, _fd, &outoff, size - done, 0);
+            if(r <= 0)
                 break;
-//            }
+            done += r;
         }
-
-        // next node
-        prev = next;
-        next = fnode.next;
     }
+#endif
+    // Read the rest in large chunks
+    ZBinary buff(MIN(size - done, (zu64)ZPARCEL_COPY_CHUNK));
+    while(done < size){
+        ssize_t r = ::read(fd, buff.raw(), MIN(size - done, buff.size()));
+        if(r < 0 && errno == EINTR)
+            continue;
+        if(r < 0)
+            return ERR_READ;
+        // The file got shorter since its size was taken
+        if(r == 0)
+            return ERR_TRUNC;
+        RETERR(_writeAt(offset + done, buff.raw(), r));
+        if(crc)
+            *crc = _checksum(buff.raw(), r, *crc);
+        done += r;
+    }
+    return OK;
+#else
+    return ERR_READ;
+#endif
+}
 
-    zu64 nextoff;
-
-//    DLOG("Alloc free node " << *size << " " << HEX(fnode->offset) << " " << fnode->size);
+bool ZParcel::_mustVerify(zu64 offset) const {
+    return (_verify != VERIFY_ONCE || !_pool->checked(offset));
+}
 
-    if((fsize - size) >= ParcelFreeNode::NODE_SIZE){
-        *nsize = size;
-        nextoff = next + size;
+void ZParcel::_verified(zu64 offset){
+    if(_verify == VERIFY_ONCE)
+        _pool->check(offset);
+}
 
-        // Split node
-        ParcelFreeNode fnode(this, nextoff);
-        fnode.next = fnext;
-        fnode.size = fsize - size;
-        RETERR(fnode.write());
+ZParcel::parcelerror ZParcel::_verifyPayload(zu64 offset, zu64 size, objtype type, bool compressed, ZBinary &buff){
+    if(_header->flags & OPT_DATA_CRC){
+        if(size < 4)
+            return ERR_TRUNC;
+        // The checksum covers the whole node before it
+        buff.resize(MIN(size, (zu64)ZPARCEL_COPY_CHUNK));
+        zu32 crc = 0;
+        for(zu64 pos = 0; pos < size - 4; ){
+            const zu64 n = MIN(size - 4 - pos, buff.size());
+            RETERR(_readAt(offset + pos, buff.raw(), n));
+            crc = _checksum(buff.raw(), n, crc);
+            pos += n;
+        }
+        zbyte trail[4];
+        RETERR(_readAt(offset + size - 4, trail, 4));
+        return (ZBinary::decbeu32(trail) == crc ? OK : ERR_CRC);
+    }
 
-        // If moving the tail, update head
-        if(fnode.next == ZU64_MAX){
-            _header->freetail = next;
-            RETERR(_header->write());
+    if(size < 8)
+        return ERR_TRUNC;
+    zbyte head[8];
+    RETERR(_readAt(offset, head, 8));
+    const zu64 len = ZBinary::decbeu64(head);
+
+    if(compressed){
+        // Decode every chunk
+        ZBinary chunk;
+        zu64 pos = 8;
+        for(zu64 done = 0; done < len; ){
+            zbyte hdr[4];
+            if(size - pos < 4)
+                return ERR_DECODE;
+            RETERR(_readAt(offset + pos, hdr, 4));
+            const zu64 clen = (ZBinary::decbeu32(hdr) & ~ZPARCEL_CHUNK_RAW);
+            if(clen > size - pos - 4)
+                return ERR_DECODE;
+            buff.resize(4 + clen);
+            RETERR(_readAt(offset + pos, buff.raw(), buff.size()));
+            chunk.resize(MIN(len - done, (zu64)ZPARCEL_COMPRESS_CHUNK));
+            if(decodeChunk(buff.raw(), buff.size(), chunk.raw(), chunk.size()) == 0)
+                return ERR_DECODE;
+            pos += buff.size();
+            done += chunk.size();
         }
+        return OK;
+    }
 
-//        DLOG("Split free node " << HEX(fnode->offset) << " " << fnode->size);
+    // Without checksums, check that the length fits and the node can be read
+    if((type == BLOBOBJ || type == STRINGOBJ) && len > size - 8)
+        return ERR_TRUNC;
+    if(type == LISTOBJ && len > (size - 8) / ZUID_SIZE)
+        return ERR_TRUNC;
+    buff.resize(MIN(size, (zu64)ZPARCEL_COPY_CHUNK));
+    for(zu64 pos = 8; pos < size; ){
+        const zu64 n = MIN(size - pos, buff.size());
+        RETERR(_readAt(offset + pos, buff.raw(), n));
+        pos += n;
+    }
+    return OK;
+}
 
-    } else {
-        // Whole node
-        *nsize = fsize;
-        nextoff = fnext;
+// /////////////////////////////////////////////////////////////////////////////
+// ParcelCompressedAccessor
+// /////////////////////////////////////////////////////////////////////////////
 
-//        DLOG("Whole free node " << " " << size);
-    }
+ZParcel::ParcelCompressedAccessor::ParcelCompressedAccessor(ZParcel *parcel, zu64 offset, zu64 size) :
+    _parcel(parcel), _base(offset + 8), _end(offset + size), _size(0), _pos(0), _coff(offset + 8), _cstart(0){
 
-    *offset = next;
+    zbyte len[8];
+    if(size < 8 || _parcel->_readAt(offset, len, 8) != OK)
+        throw ZException("ParcelCompressedAccessor bad read");
+    _size = ZBinary::decbeu64(len);
+}
 
-    // Update parent freelist
-    if(prev == 0){
-        // Rewrite superblock
-        _header->freehead = nextoff;
-        RETERR(_header->write());
+zu64 ZParcel::ParcelCompressedAccessor::read(zbyte *dest, zu64 size){
+    zu64 done = 0;
+    while(done < size && _pos < _size){
+        if(_pos < _cstart){
+            // Seeked back, decode from the start
+            _coff = _base;
+            _cstart = 0;
+            _chunk.clear();
+        }
+        while(_pos >= _cstart + _chunk.size()){
+            _cstart += _chunk.size();
+            if(!_next())
+                throw ZException("ParcelCompressedAccessor bad chunk");
+        }
 
-    } else {
-        // Rewrite parent
-        ParcelFreeNode pnode(this, prev);
-        RETERR(pnode.read());
-        pnode.next = nextoff;
-        RETERR(pnode.write());
+        const zu64 n = MIN(size - done, _cstart + _chunk.size() - _pos);
+        memcpy(dest + done, _chunk.raw() + (_pos - _cstart), n);
+        done += n;
+        _pos += n;
     }
-
-    return OK;
+    return done;
 }
 
-ZParcel::parcelerror ZParcel::_nodeFree(zu64 offset, zu64 size){
-    ParcelFreeNode fnode(this, offset);
-    fnode.size = size;
-    fnode.next = ZU64_MAX;
+bool ZParcel::ParcelCompressedAccessor::_next(){
+    zbyte hdr[4];
+    if(_cstart >= _size || _end - _coff < 4 || _parcel->_readAt(_coff, hdr, 4) != OK)
+        return false;
+    const zu64 len = (ZBinary::decbeu32(hdr) & ~ZPARCEL_CHUNK_RAW);
+    if(len > _end - _coff - 4)
+        return false;
 
-    RETERR(fnode.write());
+    ZBinary raw(4 + len);
+    memcpy(raw.raw(), hdr, 4);
+    if(_parcel->_readAt(_coff + 4, raw.raw() + 4, len) != OK)
+        return false;
+    _chunk.resize(MIN(_size - _cstart, (zu64)ZPARCEL_COMPRESS_CHUNK));
+    if(decodeChunk(raw.raw(), raw.size(), _chunk.raw(), _chunk.size()) == 0)
+        return false;
+    _coff += raw.size();
+    return true;
+}
 
-    ParcelFreeNode pnode(this, _header->freetail);
-    RETERR(pnode.read());
-    pnode.next = offset;
-    RETERR(pnode.write());
+// /////////////////////////////////////////////////////////////////////////////
+// ParcelMapAccessor
+// /////////////////////////////////////////////////////////////////////////////
 
-    return OK;
+zu64 ZParcel::ParcelMapAccessor::read(zbyte *dest, zu64 size){
+    zu64 sz = MIN(size, available());
+    memcpy(dest, _parcel->_map + _pos, sz);
+    _pos += sz;
+    return sz;
 }
 
 // /////////////////////////////////////////////////////////////////////////////
@@ -836,22 +6082,16 @@ ZParcel::parcelerror ZParcel::_nodeFree(zu64 offset, zu64 size){
 zu64 ZParcel::ParcelObjectAccessor::read(zbyte *dest, zu64 size){
 //    DLOG("Obj read " << HEX(_base + _pos) << " " << size);
 
-    if(_file->seek(_base + _pos) != _base + _pos)
-        throw ZException("ParcelObjectAccessor bad seek");
-
     zu64 sz = MIN(size, available());
-    if(_file->read(dest, sz) != sz)
+    if(_parcel->_readAt(_base + _pos, dest, sz) != OK)
         throw ZException("ParcelObjectAccessor bad read");
     _pos += sz;
     return sz;
 }
 
 zu64 ZParcel::ParcelObjectAccessor::write(const zbyte *src, zu64 size){
-    if(_file->seek(_base + _pos) != _base + _pos)
-        throw ZException("ParcelObjectAccessor bad seek");
-
     zu64 sz = MIN(size, available());
-    if(_file->write(src, sz) != sz)
+    if(_parcel->_writeAt(_base + _pos, src, sz) != OK)
         throw ZException("ParcelObjectAccessor bad write");
 
 //    DLOG("Obj write OK " << HEX(_base + _pos) << " " << size << " " << sz);
@@ -866,113 +6106,105 @@ zu64 ZParcel::ParcelObjectAccessor::write(const zbyte *src, zu64 size){
 
 ZParcel::parcelerror ZParcel::ParcelHeader::read(){
 //    DLOG("Header read " << HEX(0));
-
-    ZBinary buff(NODE_SIZE);
+    static_assert(sizeof(HeaderRecord) == NODE_SIZE, "header record size");
 
     // I/O
-    if(file->seek(offset) != offset)
-        return ERR_SEEK;
-    if(file->read(buff.raw(), buff.size()) != buff.size())
-        return ERR_READ;
+    HeaderRecord rec;
+    zbyte *buff = (zbyte *)&rec;
+    RETERR(parcel->_readAt(offset, buff, NODE_SIZE));
 
     // Magic
-    zbyte sig[ZPARCEL_SIG_LEN];
-    buff.read(sig, ZPARCEL_SIG_LEN);
-    if(::memcmp(sig, ZPARCEL_SIG, ZPARCEL_SIG_LEN) != 0)
+    if(::memcmp(rec.sig, ZPARCEL_SIG, ZPARCEL_SIG_LEN) != 0)
         return ERR_SIG;
 
     // Fields
-    version = buff.readu8();
-    flags = buff.readbeu32();
-    treehead = buff.readbeu64();
-    freehead = buff.readbeu64();
-    freetail = buff.readbeu64();
-    tailptr = buff.readbeu64();
-    zbyte rootid[16];
-    buff.read(rootid, 16);
+    version = rec.version;
+    flags = rec.flags;
+    treehead = rec.treehead;
+    freehead = rec.freehead;
+    freetail = rec.freetail;
+    tailptr = rec.tailptr;
 
     // CRC
-    zu32 crc1 = buff.readbeu32();
-    buff.seek(buff.tell() - 4);
-    buff.writebeu32(0);
-    zu32 crc2 = ZHash<ZBinary, ZHashBase::CRC32>(buff).hash();
-    if(crc2 != crc1)
+    if(parcel->_nodeChecksum(flags, buff, NODE_SIZE, offsetof(HeaderRecord, crc)) != rec.crc)
         return ERR_CRC;
 
-    root.fromRaw(rootid);
+    root.fromRaw(rec.root);
     return OK;
 }
 
 ZParcel::parcelerror ZParcel::ParcelHeader::write(){
-    ZBinary buff(NODE_SIZE);
-
-    // Fields
-    buff.write((const zbyte *)ZPARCEL_SIG, ZPARCEL_SIG_LEN);
-    buff.writeu8(version);
-    buff.writebeu32(flags);
-    buff.writebeu64(treehead);
-    buff.writebeu64(freehead);
-    buff.writebeu64(freetail);
-    buff.writebeu64(tailptr);
-    buff.write(root.raw(), 16);
-    buff.writebeu32(0);
-
-    // CRC
-    zu32 crc = ZHash<ZBinary, ZHashBase::CRC32>(buff).hash();
-    buff.seek(buff.tell() - 4);
-    buff.writebeu32(crc);
+    // Header is written once when the batch is committed
+    if(parcel->_batch && parcel->_batch->depth){
+        parcel->_batch->header = true;
+        return OK;
+    }
 
-    // I/O
-    if(file->seek(offset) != offset)
-        return ERR_SEEK;
-    if(file->write(buff.raw(), buff.size()) != buff.size())
-        return ERR_WRITE;
+    zbyte buff[NODE_SIZE];
+    encode(buff);
+    RETERR(parcel->_writeAt(offset, buff, NODE_SIZE));
 
 //    DLOG("Header write OK " << HEX(offset) << " " << HEX(offset + NODE_SIZE));
 
     return OK;
 }
 
+void ZParcel::ParcelHeader::encode(zbyte *buff) const {
+    // Fields
+    HeaderRecord rec;
+    memcpy(rec.sig, ZPARCEL_SIG, ZPARCEL_SIG_LEN);
+    rec.version = version;
+    rec.flags = flags;
+    rec.treehead = treehead;
+    rec.freehead = freehead;
+    rec.freetail = freetail;
+    rec.tailptr = tailptr;
+    memcpy(rec.root, root.raw(), ZUID_SIZE);
+
+    // CRC
+    rec.crc = parcel->_nodeChecksum(flags, (const zbyte *)&rec, NODE_SIZE, offsetof(HeaderRecord, crc));
+    memcpy(buff, &rec, NODE_SIZE);
+}
+
 // /////////////////////////////////////////////////////////////////////////////
 // ParcelTreeNode
 // /////////////////////////////////////////////////////////////////////////////
 
-ZParcel::parcelerror ZParcel::ParcelTreeNode::read(){
+ZParcel::parcelerror ZParcel::ParcelTreeNode::read(bool pool){
 //    DLOG("TreeNode read " << HEX(offset));
+    static_assert(sizeof(TreeRecord) == NODE_SIZE, "tree node record size");
 
-    ZBinary buff(NODE_SIZE);
+    TreeRecord rec;
+    zbyte *buff = (zbyte *)&rec;
 
     // I/O
-    if(file->seek(offset) != offset)
-        return ERR_SEEK;
-    if(file->read(buff.raw(), buff.size()) != buff.size())
-        return ERR_READ;
+    const bool hit = (pool && parcel->_pool->get(offset, buff, NODE_SIZE));
+    parcel->_stats->add(hit ? ParcelStats::POOLHITS : ParcelStats::NODEREADS);
+    if(!hit)
+        RETERR(parcel->_readAt(offset, buff, NODE_SIZE));
 
     // Magic
-    zu32 magic = buff.readbeu32();
-    if(magic != ZPARCEL_TREE_MAGIC)
+    if(rec.magic != ZPARCEL_TREE_MAGIC)
         return ERR_MAGIC;
 
-    // Fields
-    zbyte id[16];
-    buff.read(id, 16);
-    lnode = buff.readbeu64();
-    rnode = buff.readbeu64();
-    type = buff.readu8();
-    extra = buff.readu8();
-
     // CRC
-    zu32 crc1 = buff.readbeu32();
-    buff.seek(buff.tell() - 4);
-    buff.writebeu32(0);
-    zu32 crc2 = ZHash<ZBinary, ZHashBase::CRC32>(buff).hash();
-    if(crc2 != crc1)
-        return ERR_CRC;
-
-    // Payload
-    buff.read(payload, 16);
+    if(!hit){
+        if(parcel->_mustVerify(offset)){
+            if(parcel->_nodeChecksum(parcel->_header->flags, buff, NODE_SIZE, offsetof(TreeRecord, crc)) != rec.crc)
+                return ERR_CRC;
+            parcel->_verified(offset);
+        }
+        if(pool)
+            parcel->_pool->put(offset, buff, NODE_SIZE);
+    }
 
-    uid.fromRaw(id);
+    // Fields
+    uid.fromRaw(rec.uid);
+    lnode = rec.lnode;
+    rnode = rec.rnode;
+    type = rec.type;
+    extra = rec.extra;
+    memcpy(payload, rec.payload, 16);
     if(type >= ZParcel::BLOBOBJ){
         data.size = ZBinary::decbeu64(payload);
         data.offset= ZBinary::decbeu64(payload + 8);
@@ -981,32 +6213,26 @@ ZParcel::parcelerror ZParcel::ParcelTreeNode::read(){
 }
 
 ZParcel::parcelerror ZParcel::ParcelTreeNode::write(){
-    ZBinary buff(NODE_SIZE);
-
     // Fields
-    buff.writebeu32(ZPARCEL_TREE_MAGIC);
-    buff.write(uid.raw(), 16);
-    buff.writebeu64(lnode);
-    buff.writebeu64(rnode);
-    buff.writeu8(type);
-    buff.writeu8(extra);
-    buff.writebeu32(0);
+    TreeRecord rec;
+    zbyte *buff = (zbyte *)&rec;
+    rec.magic = ZPARCEL_TREE_MAGIC;
+    memcpy(rec.uid, uid.raw(), ZUID_SIZE);
+    rec.lnode = lnode;
+    rec.rnode = rnode;
+    rec.type = type;
+    rec.extra = extra;
     if(type >= ZParcel::BLOBOBJ){
         ZBinary::encbeu64(payload, data.size);
         ZBinary::encbeu64(payload + 8, data.offset);
     }
-    buff.write(payload, 16);
+    memcpy(rec.payload, payload, 16);
 
     // CRC
-    zu32 crc = ZHash<ZBinary, ZHashBase::CRC32>(buff).hash();
-    buff.seek(buff.tell() - 20);
-    buff.writebeu32(crc);
+    rec.crc = parcel->_nodeChecksum(parcel->_header->flags, buff, NODE_SIZE, offsetof(TreeRecord, crc));
 
     // I/O
-    if(file->seek(offset) != offset)
-        return ERR_SEEK;
-    if(file->write(buff.raw(), buff.size()) != buff.size())
-        return ERR_WRITE;
+    RETERR(parcel->_writeAt(offset, buff, NODE_SIZE));
 
 //    DLOG("TreeNode write OK " << HEX(offset) << " " << HEX(offset + NODE_SIZE));
 
@@ -1019,57 +6245,298 @@ ZParcel::parcelerror ZParcel::ParcelTreeNode::write(){
 
 ZParcel::parcelerror ZParcel::ParcelFreeNode::read(){
 //    DLOG("FreeNode read " << HEX(offset));
+    static_assert(sizeof(FreeRecord) == NODE_SIZE, "free node record size");
 
-    ZBinary buff(NODE_SIZE);
+    FreeRecord rec;
+    zbyte *buff = (zbyte *)&rec;
+    RETERR(parcel->_readAt(offset, buff, NODE_SIZE));
 
-    if(file->seek(offset) != offset)
-        return ERR_SEEK;
-    if(file->read(buff.raw(), buff.size()) != buff.size())
-        return ERR_READ;
+    // Magic
+    if(rec.magic != ZPARCEL_FREE_MAGIC)
+        return ERR_MAGIC;
+
+    // CRC
+    if(parcel->_mustVerify(offset)){
+        if(parcel->_nodeChecksum(parcel->_header->flags, buff, NODE_SIZE, offsetof(FreeRecord, crc)) != rec.crc)
+            return ERR_CRC;
+        parcel->_verified(offset);
+    }
+
+    // Fields
+    next = rec.next;
+    size = rec.size;
+    return OK;
+}
+
+ZParcel::parcelerror ZParcel::ParcelFreeNode::write(){
+    // Fields
+    FreeRecord rec;
+    zbyte *buff = (zbyte *)&rec;
+    rec.magic = ZPARCEL_FREE_MAGIC;
+    rec.next = next;
+    rec.size = size;
+
+    // CRC
+    rec.crc = parcel->_nodeChecksum(parcel->_header->flags, buff, NODE_SIZE, offsetof(FreeRecord, crc));
+
+    // I/O
+    RETERR(parcel->_writeAt(offset, buff, NODE_SIZE));
+
+//    DLOG("FreeNode write OK " << HEX(offset) << " " << HEX(offset + NODE_SIZE));
+
+    return OK;
+}
+
+// /////////////////////////////////////////////////////////////////////////////
+// ParcelBinTable
+// /////////////////////////////////////////////////////////////////////////////
+
+ZParcel::parcelerror ZParcel::ParcelBinTable::read(){
+    static_assert(sizeof(BinTableRecord) == NODE_SIZE, "bin table record size");
+
+    BinTableRecord rec;
+    zbyte *buff = (zbyte *)&rec;
+    RETERR(parcel->_readAt(offset, buff, NODE_SIZE));
 
     // Magic
-    zu32 magic = buff.readbeu32();
-    if(magic != ZPARCEL_FREE_MAGIC)
+    if(rec.magic != ZPARCEL_BINS_MAGIC)
         return ERR_MAGIC;
 
+    // CRC
+    if(parcel->_mustVerify(offset)){
+        if(parcel->_nodeChecksum(parcel->_header->flags, buff, NODE_SIZE, offsetof(BinTableRecord, crc)) != rec.crc)
+            return ERR_CRC;
+        parcel->_verified(offset);
+    }
+
+    // Fields
+    for(zu8 i = 0; i < BINS; ++i)
+        head[i] = rec.head[i];
+    return OK;
+}
+
+ZParcel::parcelerror ZParcel::ParcelBinTable::write(){
     // Fields
-    next = buff.readbeu64();
-    size = buff.readbeu64();
+    BinTableRecord rec;
+    zbyte *buff = (zbyte *)&rec;
+    rec.magic = ZPARCEL_BINS_MAGIC;
+    for(zu8 i = 0; i < BINS; ++i)
+        rec.head[i] = head[i];
 
     // CRC
-    zu32 crc1 = buff.readbeu32();
-    buff.seek(buff.tell() - 4);
-    buff.writebeu32(0);
-    zu32 crc2 = ZHash<ZBinary, ZHashBase::CRC32>(buff).hash();
-    if(crc2 != crc1)
-        return ERR_CRC;
+    rec.crc = parcel->_nodeChecksum(parcel->_header->flags, buff, NODE_SIZE, offsetof(BinTableRecord, crc));
 
+    // I/O
+    RETERR(parcel->_writeAt(offset, buff, NODE_SIZE));
     return OK;
 }
 
-ZParcel::parcelerror ZParcel::ParcelFreeNode::write(){
-    ZBinary buff(NODE_SIZE);
+zu8 ZParcel::ParcelBinTable::bin(zu64 size){
+    zu8 b = 0;
+    while(size >>= 1)
+        ++b;
+    return b;
+}
+
+// /////////////////////////////////////////////////////////////////////////////
+// ParcelBinNode
+// /////////////////////////////////////////////////////////////////////////////
+
+ZParcel::parcelerror ZParcel::ParcelBinNode::read(){
+    static_assert(sizeof(BinNodeRecord) == NODE_SIZE, "bin node record size");
+
+    BinNodeRecord rec;
+    zbyte *buff = (zbyte *)&rec;
+    RETERR(parcel->_readAt(offset, buff, NODE_SIZE));
+
+    // Magic
+    if(rec.magic != ZPARCEL_BNOD_MAGIC)
+        return ERR_MAGIC;
+
+    // CRC
+    if(parcel->_mustVerify(offset)){
+        if(parcel->_nodeChecksum(parcel->_header->flags, buff, NODE_SIZE, offsetof(BinNodeRecord, crc)) != rec.crc)
+            return ERR_CRC;
+        parcel->_verified(offset);
+    }
 
     // Fields
-    buff.writebeu32(ZPARCEL_FREE_MAGIC);
-    buff.writebeu64(next);
-    buff.writebeu64(size);
-    buff.writebeu32(0);
+    next = rec.next;
+    prev = rec.prev;
+    size = rec.size;
+    return OK;
+}
+
+ZParcel::parcelerror ZParcel::ParcelBinNode::write(){
+    // Fields
+    BinNodeRecord rec;
+    zbyte *buff = (zbyte *)&rec;
+    rec.magic = ZPARCEL_BNOD_MAGIC;
+    rec.next = next;
+    rec.prev = prev;
+    rec.size = size;
 
     // CRC
-    zu32 crc = ZHash<ZBinary, ZHashBase::CRC32>(buff).hash();
-    buff.seek(buff.tell() - 4);
-    buff.writebeu32(crc);
+    rec.crc = parcel->_nodeChecksum(parcel->_header->flags, buff, NODE_SIZE, offsetof(BinNodeRecord, crc));
 
     // I/O
-    if(file->seek(offset) != offset)
-        return ERR_SEEK;
-    if(file->write(buff.raw(), buff.size()) != buff.size())
-        return ERR_WRITE;
+    RETERR(parcel->_writeAt(offset, buff, NODE_SIZE));
 
-//    DLOG("FreeNode write OK " << HEX(offset) << " " << HEX(offset + NODE_SIZE));
+    // Size footer
+    zbyte foot[FOOT_SIZE];
+    ZBinary::encbeu64(foot, size);
+    RETERR(parcel->_writeAt(offset + size - FOOT_SIZE, foot, FOOT_SIZE));
+    return OK;
+}
+
+// /////////////////////////////////////////////////////////////////////////////
+// ParcelPage
+// /////////////////////////////////////////////////////////////////////////////
+
+ZParcel::parcelerror ZParcel::ParcelPage::read(bool pool){
+//    DLOG("Page read " << HEX(offset));
+    static_assert(sizeof(PageRecord) == HEAD_SIZE, "page record size");
+
+    // I/O
+    const bool hit = (pool && parcel->_pool->get(offset, buff, PAGE_SIZE));
+    parcel->_stats->add(hit ? ParcelStats::POOLHITS : ParcelStats::NODEREADS);
+    if(!hit)
+        RETERR(parcel->_readAt(offset, buff, PAGE_SIZE));
+
+    // Magic
+    PageRecord rec;
+    memcpy(&rec, buff, HEAD_SIZE);
+    if(rec.magic != ZPARCEL_PAGE_MAGIC)
+        return ERR_MAGIC;
+
+    // Fields
+    level = rec.level;
+    flags = rec.flags;
+    count = rec.count;
+    next = rec.next;
+
+    // CRC
+    if(!hit && parcel->_mustVerify(offset)){
+        if(parcel->_nodeChecksum(parcel->_header->flags, buff, PAGE_SIZE, offsetof(PageRecord, crc)) != rec.crc)
+            return ERR_CRC;
+        parcel->_verified(offset);
+    }
+
+    if(count > (level ? INNER_MAX : LEAF_MAX))
+        return ERR_TREE;
+
+    if(pool && !hit && level > 0)
+        parcel->_pool->put(offset, buff, PAGE_SIZE);
+    return OK;
+}
+
+ZParcel::parcelerror ZParcel::ParcelPage::write(){
+    // Fields
+    PageRecord rec;
+    rec.magic = ZPARCEL_PAGE_MAGIC;
+    rec.level = level;
+    rec.flags = flags;
+    rec.count = count;
+    rec.next = next;
+    rec.crc = 0;
+    memcpy(buff, &rec, HEAD_SIZE);
+
+    // CRC
+    rec.crc = parcel->_nodeChecksum(parcel->_header->flags, buff, PAGE_SIZE, offsetof(PageRecord, crc));
+    memcpy(buff + offsetof(PageRecord, crc), &rec.crc, 4);
+
+    // I/O
+    RETERR(parcel->_writeAt(offset, buff, PAGE_SIZE));
+
+//    DLOG("Page write OK " << HEX(offset) << " " << HEX(offset + PAGE_SIZE));
 
     return OK;
 }
 
+void ZParcel::ParcelPage::init(zu8 lvl){
+    memset(buff, 0, PAGE_SIZE);
+    level = lvl;
+    flags = 0;
+    count = 0;
+    next = ZU64_MAX;
+    if(level)
+        setChild(0, ZU64_MAX);
+}
+
+zu16 ZParcel::ParcelPage::search(const ZUID &id, bool *found){
+    *found = false;
+    if(level == 0){
+        // First entry not less than id
+        zu16 lo = 0;
+        zu16 hi = count;
+        while(lo < hi){
+            zu16 mid = lo + (hi - lo) / 2;
+            int cmp = pageKeyCompare(entry(mid), id);
+            if(cmp < 0){
+                lo = mid + 1;
+            } else {
+                if(cmp == 0)
+                    *found = true;
+                hi = mid;
+            }
+        }
+        return lo;
+    } else {
+        // Last key not greater than id
+        zu16 lo = 1;
+        zu16 hi = count + 1;
+        while(lo < hi){
+            zu16 mid = lo + (hi - lo) / 2;
+            if(pageKeyCompare(key(mid), id) <= 0){
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        return lo - 1;
+    }
+}
+
+void ZParcel::ParcelPage::insertEntry(zu16 i, const zbyte *ent){
+    zbyte *pos = entry(i);
+    memmove(pos + LEAF_SIZE, pos, (count - i) * LEAF_SIZE);
+    memcpy(pos, ent, LEAF_SIZE);
+    ++count;
+}
+
+void ZParcel::ParcelPage::removeEntry(zu16 i){
+    zbyte *pos = entry(i);
+    memmove(pos, pos + LEAF_SIZE, (count - i - 1) * LEAF_SIZE);
+    --count;
+    memset(entry(count), 0, LEAF_SIZE);
+}
+
+void ZParcel::ParcelPage::insertChild(zu16 i, const zbyte *k, zu64 addr){
+    zbyte *pos = key(i);
+    memmove(pos + INNER_SIZE, pos, (count + 1 - i) * INNER_SIZE);
+    memcpy(pos, k, ZUID_SIZE);
+    ZBinary::encbeu64(pos + ZUID_SIZE, addr);
+    ++count;
+}
+
+void ZParcel::ParcelPage::split(ParcelPage *right, zu16 at, zbyte *sep){
+    if(level == 0){
+        right->count = count - at;
+        memcpy(right->entry(0), entry(at), right->count * LEAF_SIZE);
+        memset(entry(at), 0, right->count * LEAF_SIZE);
+        count = at;
+        // Link leaves
+        right->next = next;
+        next = right->offset;
+    } else {
+        memcpy(sep, key(at), ZUID_SIZE);
+        right->setChild(0, child(at));
+        right->count = count - at;
+        if(right->count)
+            memcpy(right->key(1), key(at + 1), right->count * INNER_SIZE);
+        memset(key(at), 0, (count - at + 1) * INNER_SIZE);
+        count = at - 1;
+    }
+}
+
 } // namespace LibChaos
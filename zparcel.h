@@ -13,17 +13,27 @@
 #include "zfile.h"
 #include "zmap.h"
 
+#include <functional>
+#include <future>
+
 namespace LibChaos {
 
+class ZParcelBuilder;
+
 /*! Interface for storing and fetching objects from the LibChaos parcel file format.
  *  Each object is stored, fetched or updated through a unique UUID.
+ *  Lookups and fetches may be called from many threads at once. Stores, removes, batches
+ *  and open or close wait for running readers and block new ones until they are done.
  */
 class ZParcel {
+    friend class ZParcelBuilder;
 public:
     enum parceltype {
         UNKNOWN = 0,
         VERSION1,       //!< Type 1 parcel. No pages, payload in tree node.
-        MAX_PARCELTYPE = VERSION1,
+        VERSION2,       //!< Type 2 parcel. B+tree index in 4 KiB pages.
+        VERSION3,       //!< Type 3 parcel. Read-only, written by pack(). Data packed together, one table of ids.
+        MAX_PARCELTYPE = VERSION3,
     };
 
     enum parcelstate {
@@ -35,6 +45,23 @@ public:
     enum parcelopt {
         OPT_NONE        = 0,
         OPT_TAIL_EXTEND = 1,    //! Extend parcel file on tail when full.
+        OPT_SIZE_CLASSES = 2,   //! Keep free nodes in power-of-two size class bins, coalesced with free neighbors.
+        OPT_COMPRESS    = 4,    //! Compress blobs, strings and files by default when stored.
+        OPT_CRC32C      = 8,    //! Checksum nodes with CRC32C instead of CRC32.
+        OPT_DATA_CRC    = 16,   //! Data nodes end with a CRC32C of their contents.
+        OPT_DEDUP       = 32,   //! Blobs and files with the same contents share one data node.
+        OPT_JOURNAL     = 64,   //! Writes are logged to a journal file next to the parcel before they are made.
+    };
+
+    enum verifymode {
+        VERIFY_ALWAYS = 0,      //!< Check node checksums every time a node is read from the file.
+        VERIFY_ONCE,            //!< Check each node only the first time it is read after open.
+    };
+
+    enum indextype {
+        INDEX_NONE  = 0,
+        INDEX_TYPE  = 1,        //!< Object ids by type, for listByType().
+        INDEX_NAME  = 2,        //!< File object ids by stored file name, for findByName().
     };
 
     enum {
@@ -81,6 +108,158 @@ public:
         ERR_VERSION,    //!< Bad file header version.
         ERR_MAX_DEPTH,  //!< Exceeded maximum tree depth.
         ERR_MAGIC,      //!< Bad object magic number.
+        ERR_READONLY,   //!< Parcel is open read-only.
+        ERR_TYPE,       //!< Object has wrong type.
+        ERR_DECODE,     //!< Compressed payload is corrupt.
+    };
+
+    //! Object info cache counters.
+    struct CacheStats {
+        zu64 hits;      //!< Lookups answered from the cache.
+        zu64 misses;    //!< Lookups that searched the index.
+        zu64 evictions; //!< Objects evicted to stay within the limits.
+        zu64 entries;   //!< Objects currently cached.
+        zu64 bytes;     //!< Approximate memory used by cached objects.
+        zu64 nodes;     //!< Index nodes in the node pool.
+    };
+
+    //! Problem found by verify().
+    struct VerifyError {
+        ZUID id;            //!< Object the node belongs to, nil for index and free nodes.
+        zu64 offset;        //!< File offset of the node.
+        parcelerror err;
+    };
+
+    //! Result of verify().
+    struct VerifyReport {
+        zu64 objects;       //!< Objects in the index.
+        zu64 nodes;         //!< Index nodes read.
+        zu64 freenodes;     //!< Free nodes read.
+        zu64 payloads;      //!< Data nodes checked.
+        zu64 bytes;         //!< Data node bytes read.
+        ZArray<VerifyError> errors;
+    };
+
+    //! Result of compact().
+    struct CompactReport {
+        zu64 objects;       //!< Objects kept.
+        zu64 removed;       //!< Removed object nodes dropped from the index.
+        zu64 moved;         //!< Data nodes moved.
+        zu64 bytes;         //!< Data node bytes moved.
+        zu64 oldsize;       //!< File size before.
+        zu64 newsize;       //!< File size after.
+    };
+
+    //! Buckets of the lookup depth histogram in Stats.
+    static const zu64 STATS_DEPTHS = 32;
+
+    //! Hot path counters from stats(), summed over all threads.
+    struct Stats {
+        zu64 lookups;       //!< Lookups that searched the index after missing the cache.
+        zu64 depth;         //!< Index nodes visited by those lookups.
+        zu64 depths[STATS_DEPTHS];  //!< Lookups by index nodes visited, the last bucket counts deeper ones too.
+        zu64 nodereads;     //!< Index nodes read from the file.
+        zu64 poolhits;      //!< Index nodes read from the node pool.
+        zu64 cachehits;     //!< Lookups answered from the object info cache.
+        zu64 cachemisses;   //!< Lookups that missed the object info cache.
+        zu64 allocs;        //!< Node allocations.
+        zu64 freeallocs;    //!< Allocations from free space, the rest extend the file.
+        zu64 splits;        //!< Free nodes split by allocations.
+        zu64 slack;         //!< Bytes allocated past the requested sizes.
+        zu64 reads;         //!< File reads, or copies from the mapping.
+        zu64 readbytes;
+        zu64 writes;        //!< File writes.
+        zu64 writebytes;
+        zu64 crcs;          //!< Checksums computed.
+        zu64 crcbytes;
+        zu64 crcnsec;       //!< Nanoseconds spent computing checksums.
+    };
+
+    //! Result of shape().
+    struct ShapeReport {
+        zu64 objects;       //!< Objects in the index.
+        zu64 nodes;         //!< Index nodes, with the tree nodes of removed objects, or pages.
+        zu64 height;        //!< Index nodes on the longest path from the root.
+        double depth;       //!< Mean index nodes visited to find an object.
+        double balance;     //!< Height of a balanced index of the same nodes over \a height, 1 when balanced.
+        double fill;        //!< Mean fraction of page entries used, VERSION2 only.
+        zu64 size;          //!< Bytes used, up to the end of the last node.
+        zu64 freenodes;     //!< Free nodes, only known for parcels open for writing.
+        zu64 freebytes;     //!< Bytes in free nodes.
+        zu64 freemax;       //!< Largest free node.
+        double fragmentation;   //!< One minus \a freemax over \a freebytes, 0 without free space.
+    };
+
+    //! Object found by a scan.
+    struct ScanEntry {
+        ZUID id;
+        objtype type;
+        zu64 offset;        //!< Data node offset, or ZU64_MAX if the data is in the index.
+        zu64 size;          //!< Data node size, or the length of inline data.
+        bool compressed;    //!< Data node holds compressed chunks.
+    };
+
+    /*! Ordered scan over the objects in a parcel, from scan().
+     *  Entries are read in batches, and the parcel is only locked while a batch is read,
+     *  so the parcel may be changed during a scan. Objects stored or removed after the scan
+     *  started may or may not be seen.
+     */
+    class Scan {
+    public:
+        /*! Get the next object in UUID order.
+         *  \return False at the end of the scan, or on error.
+         *  \exception ZException Parcel not open.
+         */
+        bool next(ScanEntry &entry);
+        //! Get the error that ended the scan, or OK.
+        parcelerror error() const { return _err; }
+
+    private:
+        friend class ZParcel;
+        Scan(ZParcel *parcel) : _parcel(parcel), _haskey(false), _inclusive(true), _hasto(false),
+            _pos(0), _done(false), _err(OK){}
+
+        ZParcel *_parcel;
+        //! Next batch starts at, or after, this id.
+        ZUID _key;
+        bool _haskey;
+        bool _inclusive;
+        ZUID _to;
+        bool _hasto;
+        ZArray<ScanEntry> _batch;
+        zu64 _pos;
+        bool _done;
+        parcelerror _err;
+    };
+
+    /*! Reader over the children of a list object, from listReader().
+     *  Children are read in chunks, and the parcel is only locked while a chunk is read,
+     *  so the list may be appended to while it is read.
+     */
+    class ListReader {
+    public:
+        /*! Get the next child of the list.
+         *  \return False at the end of the list, or on error.
+         *  \exception ZException Parcel not open.
+         *  \exception ZException Object has wrong type.
+         */
+        bool next(ZUID &uid);
+        //! Get the error that ended the read, or OK.
+        parcelerror error() const { return _err; }
+
+    private:
+        friend class ZParcel;
+        ListReader(ZParcel *parcel, ZUID id, zu64 start) : _parcel(parcel), _id(id), _next(start),
+            _pos(0), _done(false), _err(OK){}
+
+        ZParcel *_parcel;
+        ZUID _id;
+        //! Index of the child the next chunk starts at.
+        zu64 _next;
+        ZArray<ZUID> _batch;
+        zu64 _pos;
+        bool _done;
+        parcelerror _err;
     };
 
 protected:
@@ -93,14 +272,41 @@ public:
 
     /*! Create new parcel file and open it.
      *  This will overwrite an existing file.
+     *  \a type selects the index format of the new parcel. VERSION3 parcels are only written by pack().
      *  \exception ZException Failed to create file.
      */
-    parcelerror create(ZBlockAccessor *file, parcelopt opt);
+    parcelerror create(ZBlockAccessor *file, parcelopt opt, parceltype type = VERSION2);
+    /*! Create new parcel file at \a path and open it with positional I/O, like open(ZPath).
+     *  This will overwrite an existing file, and remove its journal.
+     */
+    parcelerror create(ZPath path, parcelopt opt, parceltype type = VERSION2);
 
     /*! Open existing parcel.
      *  \exception ZException Failed to open file.
      */
     parcelerror open(ZBlockAccessor *file);
+    /*! Open existing parcel at \a path read-write.
+     *  The parcel owns the file descriptor and reads and writes it with pread() and pwrite(),
+     *  so concurrent readers never share a file position.
+     *
+     *  Records left in the journal <path>.wal by a crash are replayed into the file first.
+     *  In OPT_JOURNAL parcels, each write operation is then one transaction: its writes are buffered,
+     *  appended to the journal as one record, and written to the parcel once the journal is synced.
+     *  Large writes to new space past the tail, which no logged state refers to, go to the parcel
+     *  directly instead, and it is synced before the record is appended, so only their metadata is logged.
+     *  Concurrent operations share one sync, and an operation that fails is rolled back.
+     *  If a journal sync fails, the operations waiting for it fail, and the parcel is read-only until
+     *  reopened, when the records that made it into the journal are replayed.
+     *  Parcels opened on a ZBlockAccessor are not journaled.
+     */
+    parcelerror open(ZPath path);
+
+    /*! Open existing parcel at \a path read-only, through a shared memory mapping of the file.
+     *  Lookups and fetches are served from the mapping without system calls.
+     *  Objects stored in the file after it is mapped are not visible until it is reopened.
+     *  \return ERR_OPEN if the journal of the parcel holds records, which open(ZPath) replays.
+     */
+    parcelerror openMapped(ZPath path);
 
     //! Close file handles.
     void close();
@@ -135,6 +341,7 @@ public:
      */
     parcelerror storeZUID(ZUID id, ZUID uid);
     /*! Store blob in parcel.
+     *  In OPT_DEDUP parcels, a blob with the same contents as a stored blob or file refers to its data node.
      *  \exception ZException Parcel not open.
      */
     parcelerror storeBlob(ZUID id, ZBinary blob);
@@ -146,10 +353,62 @@ public:
      *  \exception ZException Parcel not open.
      */
     parcelerror storeList(ZUID id, ZList<ZUID> list);
+    /*! Append \a list to the children of an existing list object.
+     *  Children are written into free space at the end of the list's data node when it fits.
+     *  Otherwise the list is moved to a node with room for twice as many children,
+     *  so appending one child at a time costs amortized constant time.
+     *  \return ERR_NOEXIST if the list does not exist.
+     *  \exception ZException Parcel not open.
+     *  \exception ZException Object has wrong type.
+     */
+    parcelerror appendList(ZUID id, ZList<ZUID> list);
     /*! Store file reference in parcel.
+     *  In OPT_DEDUP parcels, the file is read once to find a stored blob or file with the same contents.
      *  \exception ZException Parcel not open.
      */
     parcelerror storeFile(ZUID id, ZPath path);
+    /*! Store many files, like storeFile() for each of \a paths with the id at the same index in \a ids.
+     *  Files are read, and compressed when the policy wants it, on the I/O threads. Space for every file is
+     *  allocated on the calling thread in one batch, the data is written on the I/O threads, and then the
+     *  files whose data was written are indexed in a second batch. Space for files that failed is given back,
+     *  so nothing is stored for them, and a crash before the index is written only leaks the space.
+     *  In an open batch, and in OPT_JOURNAL parcels where the whole call is one transaction, the data is
+     *  written on the calling thread.
+     *  If \a errors is not null, it gets one error for each file.
+     *  \return OK, or the first error for any file.
+     *  \exception ZException Parcel not open.
+     *  \exception ZException \a ids and \a paths differ in length.
+     */
+    parcelerror storeFiles(const ZArray<ZUID> &ids, const ZArray<ZPath> &paths, ZArray<parcelerror> *errors = nullptr);
+    /*! Store every regular file under \a dir with storeFiles(), each with a new random id.
+     *  Subdirectories are walked in name order, and links are not followed.
+     *  \a ids and \a paths get the id and path of each file found.
+     *  \exception ZException Parcel not open.
+     */
+    parcelerror storeDirectory(ZPath dir, ZArray<ZUID> &ids, ZArray<ZPath> &paths, ZArray<parcelerror> *errors = nullptr);
+
+    /*! Store bool in parcel, or replace the existing object with \a id, of any type.
+     *  Fixed-size values are written over the index entry. Variable-size data is written over the
+     *  object's data node when it fits and the node is not more than twice the size needed, and not
+     *  shared with other objects. Otherwise it gets a new data node and the old one is freed.
+     *  In VERSION1 parcels, the node left by a removed object is reused.
+     *  \exception ZException Parcel not open.
+     */
+    parcelerror updateBool(ZUID id, bool bl);
+    //! Store or replace uint, like updateBool().
+    parcelerror updateUint(ZUID id, zu64 num);
+    //! Store or replace sint, like updateBool().
+    parcelerror updateSint(ZUID id, zs64 num);
+    //! Store or replace float, like updateBool().
+    parcelerror updateFloat(ZUID id, double num);
+    //! Store or replace zuid, like updateBool().
+    parcelerror updateZUID(ZUID id, ZUID uid);
+    //! Store or replace blob, like updateBool(). Deduplicated like storeBlob().
+    parcelerror updateBlob(ZUID id, ZBinary blob);
+    //! Store or replace string, like updateBool().
+    parcelerror updateString(ZUID id, ZString str);
+    //! Store or replace list, like updateBool().
+    parcelerror updateList(ZUID id, ZList<ZUID> list);
 
     /*! Fetch bool from parcel.
      *  \exception ZException Parcel not open.
@@ -188,11 +447,36 @@ public:
      */
     ZBinary fetchBlob(ZUID id);
     /*! Fetch reader for blob from parcel.
+     *  The reader does not hold the parcel lock; the blob must not be removed, and the parcel must not
+     *  be compacted, while it is in use.
      *  \exception ZException Parcel not open.
      *  \exception ZException Object does not exist.
      *  \exception ZException Object has wrong type.
      */
     ZPointer<ZBlockAccessor> fetchBlobReader(ZUID id);
+    /*! Fetch blob from mapped parcel without copying.
+     *  The size of the blob is written at \a size.
+     *  \return Pointer to the blob in the mapping, valid until the parcel is closed.
+     *  \exception ZException Parcel not open or not mapped.
+     *  \exception ZException Object does not exist.
+     *  \exception ZException Object has wrong type.
+     *  \exception ZException Object is compressed.
+     */
+    const zbyte *fetchBlobView(ZUID id, zu64 *size);
+    /*! Stream blob from parcel to \a out, without loading the whole blob into memory.
+     *  Blobs longer than one copy chunk are read ahead on the I/O threads while the previous chunk is written.
+     *  \exception ZException Parcel not open.
+     *  \exception ZException Object does not exist.
+     *  \exception ZException Object has wrong type.
+     */
+    parcelerror fetchBlobTo(ZUID id, ZWriter &out);
+    /*! Stream blob from parcel into a new file at \a path.
+     *  When the parcel has a file descriptor, the data is copied in the kernel.
+     *  \exception ZException Parcel not open.
+     *  \exception ZException Object does not exist.
+     *  \exception ZException Object has wrong type.
+     */
+    parcelerror fetchBlobTo(ZUID id, ZPath path);
     /*! Fetch string from parcel.
      *  \exception ZException Parcel not open.
      *  \exception ZException Object does not exist.
@@ -205,6 +489,22 @@ public:
      *  \exception ZException Object has wrong type.
      */
     ZList<ZUID> fetchList(ZUID id);
+    /*! Get the number of children of a list.
+     *  \exception ZException Parcel not open.
+     *  \exception ZException Object does not exist.
+     *  \exception ZException Object has wrong type.
+     */
+    zu64 fetchListSize(ZUID id);
+    /*! Fetch up to \a count children of a list, starting at child \a start, into \a out.
+     *  Only the requested children are read. \a out is empty if \a start is past the end.
+     *  \exception ZException Parcel not open.
+     *  \exception ZException Object has wrong type.
+     */
+    parcelerror fetchListRange(ZUID id, zu64 start, zu64 count, ZArray<ZUID> &out);
+    /*! Read the children of a list from child \a start, in chunks.
+     *  \exception ZException Parcel not open.
+     */
+    ListReader listReader(ZUID id, zu64 start = 0);
     /*! Fetch file object from parcel.
      *  If \a offset is not null, the offset of the file payload is written at \a offset.
      *  If \a size is not null, the size of the file payload is written at \a size.
@@ -215,7 +515,33 @@ public:
      */
     parcelerror fetchFile(ZUID id, ZUID &nameid, ZUID &dataid);
 
+    /*! Fetch blobs for many objects at once.
+     *  Index lookups are made in UUID order, reusing the last leaf page, and payloads are read
+     *  in file order with nearby reads merged. \a out gets one blob for each id, empty on error.
+     *  If \a errors is not null, it gets one error for each id.
+     *  \return OK, or the first error for any id.
+     *  \exception ZException Parcel not open.
+     */
+    parcelerror fetchMany(const ZArray<ZUID> &ids, ZArray<ZBinary> &out, ZArray<parcelerror> *errors = nullptr);
+    /*! Fetch blob from parcel in the background, on the parcel's I/O threads.
+     *  Exceptions thrown by fetchBlob() are rethrown from the future's get().
+     */
+    std::future<ZBinary> fetchBlobAsync(ZUID id);
+    /*! Fetch blobs for many objects in the background, like fetchMany().
+     *  \a ids is copied. \a out and \a errors must stay valid until the future is ready.
+     */
+    std::future<parcelerror> fetchManyAsync(const ZArray<ZUID> &ids, ZArray<ZBinary> *out, ZArray<parcelerror> *errors = nullptr);
+    /*! Fetch strings for many objects at once, like fetchMany().
+     *  \exception ZException Parcel not open.
+     */
+    parcelerror fetchManyString(const ZArray<ZUID> &ids, ZArray<ZString> &out, ZArray<parcelerror> *errors = nullptr);
+    /*! Fetch unsigned ints for many objects at once, like fetchMany().
+     *  \exception ZException Parcel not open.
+     */
+    parcelerror fetchManyUint(const ZArray<ZUID> &ids, ZArray<zu64> &out, ZArray<parcelerror> *errors = nullptr);
+
     /*! Remove an object from the parcel.
+     *  In OPT_DEDUP parcels, a shared data node is only freed with the last object referring to it.
      *  \exception ZException Parcel not open.
       */
     parcelerror removeObject(ZUID id);
@@ -223,9 +549,123 @@ public:
     ZUID getRoot();
     parcelerror setRoot(ZUID id);
 
-    void listObjects();
+    /*! Check the whole parcel file.
+     *  Every index node and free node is read and its checksum checked, and no two nodes may overlap.
+     *  In OPT_DEDUP parcels, objects may share the same data node, which is checked once.
+     *  Data nodes are then read in file order on the I/O threads. In OPT_DATA_CRC parcels their
+     *  checksums are checked, otherwise compressed payloads are decoded and lengths are checked.
+     *  \a report gets counts and every problem found.
+     *  \return OK, or the first error found.
+     *  \exception ZException Parcel not open.
+     */
+    parcelerror verify(VerifyReport *report);
+
+    /*! Compact the parcel file in place.
+     *  Data nodes are moved down to the front of the file in file order, the index is rebuilt densely
+     *  after them without removed objects, and free space is dropped. Parcels with OPT_TAIL_EXTEND
+     *  are then truncated, others keep their size with the rest as one free node.
+     *  Nothing the header refers to is overwritten: the moved data and a new index are first copied
+     *  past the used space and the header switched to them, then copied down into the freed space and
+     *  the header switched again, syncing the file around each switch. If it fails or is interrupted,
+     *  the parcel is as of the last switch, and only free space is lost until the next compaction.
+     *  Parcels without OPT_TAIL_EXTEND need room at the tail for the copies, or get ERR_NOFREE.
+     *  The parcel is locked for the whole compaction. OPT_JOURNAL parcels are checkpointed first.
+     *  If \a report is not null, it gets counts and file sizes.
+     *  \exception ZException Parcel not open.
+     *  \exception ZException Batch open.
+     */
+    parcelerror compact(CompactReport *report = nullptr);
+
+    /*! Write a packed read-only copy of the parcel to \a path, as a VERSION3 parcel.
+     *  The data nodes of live objects are copied together in file order, shared nodes once, and followed
+     *  by one table of the objects in Eytzinger order, so a lookup is a single branch-free search with
+     *  no index nodes to read. There is no free space. Opening a packed parcel reads only the header
+     *  and the table, which openMapped() searches in place.
+     *  The copy is written to <path>.tmp, synced and renamed over \a path, so \a path never holds a partial copy.
+     *  \return ERR_OPEN if \a path is the parcel itself.
+     *  \exception ZException Parcel not open.
+     */
+    parcelerror pack(ZPath path);
+
+    /*! Walk the index to measure its height and balance, and sum up the free space.
+     *  \exception ZException Parcel not open.
+     */
+    parcelerror shape(ShapeReport *report);
+
+    /*! Begin a batch of writes.
+     *  Until the matching commitBatch(), node and payload writes are buffered in memory
+     *  and the header is written once, at commit. Batches may be nested.
+     *  \exception ZException Parcel not open.
+     */
+    parcelerror beginBatch();
+    /*! Commit the current batch.
+     *  The outermost commit flushes buffered writes in coalesced runs, then writes the header.
+     *  In journaled parcels, it logs the batch as one transaction instead.
+     *  \exception ZException Parcel not open.
+     */
+    parcelerror commitBatch();
+    /*! Discard all buffered writes of the current batch, including nested batches.
+     *  The header is reloaded from the file.
+     */
+    void abortBatch();
+
+    /*! Limit the object info cache to \a entries objects and \a bytes of memory.
+     *  A limit of zero is not enforced. The least recently used objects are evicted first.
+     */
+    void setCacheLimit(zu64 entries, zu64 bytes = 0);
+    //! Get object info cache counters.
+    CacheStats cacheStats() const;
+    /*! Get hot path counters since the parcel object was made or resetStats().
+     *  Each thread counts into its own shard, so the counters are always on and cheap to update.
+     */
+    Stats stats() const;
+    //! Zero the counters of stats() and cacheStats().
+    void resetStats();
+    /*! Keep index nodes in the top \a levels of the tree in memory, so lookups and inserts
+     *  only read the lower levels from the file. Pooled nodes are not re-verified.
+     *  For VERSION2 parcels only inner pages are kept. Zero disables the pool.
+     */
+    void setNodeCacheLevels(zu16 levels);
+    /*! Compress blobs, strings and files of at least \a minsize bytes when they are stored
+     *  in VERSION2 parcels. Data is kept compressed only if it shrinks to at most \a percent
+     *  of its size. A \a percent of zero disables compression.
+     *  The default on open is from OPT_COMPRESS.
+     */
+    void setCompression(zu8 percent, zu64 minsize = 256);
+    /*! Set when node checksums are checked. With VERIFY_ONCE, nodes that have been verified
+     *  are trusted on later traversals, which only helps if the file is not changed by others.
+     *  The default is VERIFY_ALWAYS.
+     */
+    void setVerify(verifymode mode);
+    /*! Keep the secondary indexes in \a indexes, a mask of indextype, in memory.
+     *  The indexes are built by reading every object when they are enabled and each time a parcel
+     *  is opened, and are kept up to date by stores and removes. Zero disables them.
+     *  \return OK, or an error reading the parcel to build the indexes.
+     */
+    parcelerror setIndexes(int indexes);
+    /*! Get the ids of all objects of \a type in UUID order, from the type index.
+     *  \exception ZException Parcel not open.
+     *  \exception ZException Type index not enabled.
+     */
+    parcelerror listByType(objtype type, ZArray<ZUID> &ids);
+    /*! Get the ids of file objects stored with file name \a name in UUID order, from the name index.
+     *  \return ERR_NOEXIST if there are none.
+     *  \exception ZException Parcel not open.
+     *  \exception ZException Name index not enabled.
+     */
+    parcelerror findByName(ZString name, ZArray<ZUID> &ids);
+
+    /*! Scan all objects in UUID order.
+     *  \exception ZException Parcel not open.
+     */
+    Scan scan();
+    /*! Scan objects with UUIDs from \a from to \a to, inclusive, in UUID order.
+     *  \exception ZException Parcel not open.
+     */
+    Scan scan(ZUID from, ZUID to);
 
-    void _listStep(zu64 next, zu16 depth);
+    //! Log every object in the parcel, in UUID order.
+    void listObjects();
 
     //! Get string name of object type.
     static ZString typeName(objtype type);
@@ -235,16 +675,231 @@ public:
 protected:
     //! Compute the size of an object node payload.
     zu64 _objectSize(objtype type, zu64 size);
+    /*! Finish data node at \a offset of \a size bytes, of which \a used bytes were written with checksum \a crc.
+     *  In OPT_DATA_CRC parcels, the rest is cleared and the node checksum is written at its end.
+     */
+    parcelerror _sealPayload(zu64 offset, zu64 size, zu64 used, zu32 crc);
+    //! CRC32C of \a size bytes at \a data continuing from \a crc, counted in the stats.
+    zu32 _checksum(const zbyte *data, zu64 size, zu32 crc = 0) const;
+    //! Checksum of a node with the 4 byte field at \a field counted as zero, by \a flags, counted in the stats.
+    zu32 _nodeChecksum(zu32 flags, const zbyte *data, zu64 size, zu64 field) const;
     /*! Store a new object with \a id and \a type.
      *  The contents of \a data are written into the payload of the new object.
+     *  In VERSION2 parcels, short blobs, strings and lists are stored inline in the leaf entry.
      *  If \a trailsize > 0, indicates the number of bytes that should be reserved in the payload,
      *  beyond the size of \a data.
+     *  If \a poffset is not null, the data is not inlined, and the offset of the payload is written at \a poffset,
+     *  and its size at \a psize.
+     *  With \a reserve, the caller writes the rest of the payload and seals it with _sealPayload().
+     *  In VERSION2 parcels, \a flags are set in the leaf entry.
+     *  If \a shared is not null, the object refers to its existing data node, and \a data is not written.
+     */
+    parcelerror _storeObject(ZUID id, objtype type, const ZBinary &data, zu64 reserve = 0, zu64 *poffset = nullptr,
+                             zu8 flags = 0, zu64 *psize = nullptr, const ObjectInfo *shared = nullptr);
+    //! Store the name string of a file object.
+    parcelerror _storeFileName(ZUID id, ZPath path);
+    /*! Store the data blob of a file object of \a filesize bytes, reserving \a dsize bytes for the data.
+     *  The offset and size of the data node are written at \a poff and \a psize.
+     */
+    parcelerror _storeFileData(ZUID id, zu64 filesize, zu64 dsize, zu8 flags, zu64 *poff, zu64 *psize);
+    //! Store a blob object referring to the shared data node of \a info.
+    parcelerror _storeShared(ZUID id, const ObjectInfo &info);
+    /*! Store object \a id like _storeObject(), or replace the existing object with \a id.
+     *  The data node of the old object is rewritten in place if it is not shared and fits,
+     *  and freed otherwise. Its deduplication reference is dropped, and the new data node is counted by the caller.
      */
-    parcelerror _storeObject(ZUID id, objtype type, const ZBinary &data, zu64 reserve = 0);
+    parcelerror _updateObject(ZUID id, objtype type, const ZBinary &data, zu64 reserve = 0, zu64 *poffset = nullptr,
+                              zu8 flags = 0, zu64 *psize = nullptr, const ObjectInfo *shared = nullptr);
+    //! Store or replace blob \a id, referring to the shared data node of \a info.
+    parcelerror _updateShared(ZUID id, const ObjectInfo &info);
+    //! Find the tree node of \a id in a VERSION1 parcel, including the null node of a removed object.
+    parcelerror _treeFind(const ZUID &id, zu64 *offset);
+    //! Store a file object referring to its name and data objects.
+    parcelerror _storeFileObject(ZUID id, ZUID nameid, ZUID dataid);
+    /*! Get the leaf entry \a flags and stored data size \a dsize for \a filesize bytes read from \a infile.
+     *  Compressible files are compressed once to find their size.
+     *  If \a hash is not null, the file is read to get the CRC32C of its contents there.
+     */
+    void _fileSizing(ZFile &infile, zu64 filesize, zu8 *flags, zu64 *dsize, zu32 *hash = nullptr) const;
+    //! Write the contents of \a infile at \a path into the data node from _storeFileData() and seal it.
+    parcelerror _fileData(ZFile &infile, ZPath path, zu64 filesize, zu8 flags, zu64 dsize, zu64 poff, zu64 psize);
+    //! Check if \a size bytes of data should be compressed when stored.
+    bool _compressWanted(zu64 size) const;
+    /*! Replace length-prefixed \a data with its compressed form if the policy keeps it.
+     *  \return Leaf entry flags for the data.
+     */
+    zu8 _compressData(ZBinary &data);
+    //! Read and decode the length-prefixed payload of \a info.
+    parcelerror _readPayload(const ObjectInfo &info, ZBinary *out);
     //! Get object info struct.
     parcelerror _getObjectInfo(ZUID id, ObjectInfo *info);
+    //! Get object info for each of \a ids, looked up in UUID order.
+    void _infoMany(const ZArray<ZUID> &ids, ZArray<ObjectInfo> &infos, ZArray<parcelerror> &errs);
+    /*! Call \a fn with each piece of the decoded contents of the data node of \a info, in order.
+     *  Stops early if \a fn returns false.
+     */
+    parcelerror _readContent(const ObjectInfo &info, const std::function<bool(const zbyte *, zu64)> &fn);
+    //! Read the length-prefixed payloads of objects without errors, in file order.
+    void _payloadMany(const ZArray<ObjectInfo> &infos, ZArray<parcelerror> &errs, ZArray<ZBinary> &out);
+    /*! Look up \a ids and check that they have \a type. If \a out is not null, read their payloads.
+     *  \return OK, or the first error in \a errs.
+     */
+    parcelerror _fetchMany(const ZArray<ZUID> &ids, objtype type, ZArray<ObjectInfo> &infos,
+                           ZArray<parcelerror> &errs, ZArray<ZBinary> *out);
+
+private:
+    //! Read header and finish opening parcel on \a file.
+    parcelerror _open(ZBlockAccessor *file);
+    //! Initialize new parcel on \a file, or on the descriptor if \a file is null.
+    parcelerror _create(ZBlockAccessor *file, parcelopt opt, parceltype type);
+    //! Read up to \a size bytes at \a offset straight from the file. Returns the number of bytes read.
+    zu64 _fileRead(zu64 offset, zbyte *dest, zu64 size);
+    //! Write \a size bytes at \a offset straight to the file.
+    bool _fileWrite(zu64 offset, const zbyte *src, zu64 size);
+    //! Get size of the file.
+    zu64 _fileSize();
+    //! Cut the file to \a size bytes. Files with no descriptor are left as they are.
+    bool _fileTruncate(zu64 size);
+    /*! Extend the file to hold \a size bytes at \a offset, the current end, without writing them.
+     *  \return False if the file has no descriptor or already extends past \a offset.
+     */
+    bool _fileReserve(zu64 offset, zu64 size);
+    //! Read \a size bytes at \a offset into \a dest, including writes buffered in a batch.
+    parcelerror _readAt(zu64 offset, zbyte *dest, zu64 size);
+    //! Write \a size bytes from \a src at \a offset, buffered if a batch is open.
+    parcelerror _writeAt(zu64 offset, const zbyte *src, zu64 size);
+    //! Write buffered batch extents to the file.
+    parcelerror _flushBatch();
+    //! Reload the header, free space and in-memory indexes after buffered writes were discarded.
+    void _reloadState();
+    //! Sync the parcel file. Files with no descriptor are not synced.
+    bool _fileSync();
+    //! Load the id table of a VERSION3 parcel.
+    parcelerror _packLoad();
+    //! Get the Eytzinger index of the first packed object not less than \a id, or zero if there is none.
+    zu64 _packSearch(const ZUID &id) const;
+    //! Get the entry at Eytzinger index \a k of the packed id table.
+    const zbyte *_packEntry(zu64 k) const;
+
+    //! Replay the records in journal file \a path into the parcel file, then empty it.
+    parcelerror _walRecover(const ZString &path);
+    //! Start journaling to \a path. If \a create, the journal is emptied and the parcel file synced.
+    parcelerror _walStart(const ZString &path, bool create);
+    //! Log the open transaction, checkpoint and close the journal.
+    void _walClose();
+    /*! Append the writes of the write operation to the journal.
+     *  \a lsn gets the sequence number of the record, or zero if nothing was logged.
+     */
+    parcelerror _txnLog(zu64 *lsn);
+    //! Discard the writes of the write operation.
+    void _txnAbort();
+    //! Wait until the journal is synced up to record \a lsn, leading a sync if none is running. Does not lock.
+    parcelerror _walSync(zu64 lsn);
+    //! Check if synced records are waiting to be applied. Does not lock.
+    bool _walDue();
+    //! Write synced records to the parcel file.
+    parcelerror _walApply();
+    //! Sync and apply every record, sync the parcel file and empty the journal.
+    parcelerror _walCheckpoint();
+
+    //! Start collecting stored objects for a bulk build of an empty VERSION2 parcel.
+    parcelerror _buildBegin();
+    //! Sort the collected objects and write the index bottom-up.
+    parcelerror _buildFinish();
+    //! Sort the collected objects and write their index pages from the tail pointer. \a head gets the root page.
+    parcelerror _buildIndex(zu64 *head);
+    //! Number of objects collected by the build.
+    zu64 _buildCount() const;
+    //! Write staged sequential payload data to the file.
+    parcelerror _buildFlush();
+    //! Get pointer to \a size bytes at \a offset in the mapping, or null if out of range.
+    const zbyte *_mapView(zu64 offset, zu64 size) const;
+    //! Close without locking.
+    void _close();
+    //! Commit batch without locking.
+    parcelerror _commitBatch();
+    //! Compact without locking.
+    parcelerror _compact(CompactReport *report);
+    //! Stream blob without locking.
+    parcelerror _fetchBlobTo(ZUID id, ZWriter &out);
+    /*! Call \a fn with the leaf entry of each object in UUID order, without locking.
+     *  VERSION1 tree nodes are passed in the same layout. If \a removed is not null,
+     *  it gets the number of removed object nodes passed over.
+     */
+    parcelerror _walkEntries(const std::function<void(const zbyte *)> &fn, zu64 *removed = nullptr);
+    //! Rebuild the enabled secondary indexes from the parcel.
+    parcelerror _indexLoad();
+    //! Add a stored object to the enabled secondary indexes. \a data is the object data as stored.
+    parcelerror _indexAdd(const ZUID &id, objtype type, const ZBinary &data);
+    //! Read the file name in the string object \a nameid of a file object.
+    parcelerror _fileName(const ZUID &nameid, ZString *name);
+    //! Count the objects referring to each blob data node of an OPT_DEDUP parcel.
+    parcelerror _dedupLoad();
+    //! Hash the contents of counted data nodes that have not been hashed yet.
+    parcelerror _dedupFill();
+    /*! Find a blob data node with \a len bytes of contents with CRC32C \a hash, for which \a same is true.
+     *  \return ERR_NOEXIST if there is none.
+     */
+    parcelerror _dedupFind(zu64 len, zu32 hash, const std::function<bool(const ObjectInfo &)> &same, ObjectInfo *info);
+    //! Check if the contents of the data node of \a info are the \a size bytes read from \a file.
+    bool _dedupSame(const ObjectInfo &info, ZReader &file, zu64 size);
+    //! Read the next batch of \a scan.
+    parcelerror _scanFill(Scan *scan);
+    //! Read the next chunk of \a reader.
+    parcelerror _listFill(ListReader *reader);
+    //! Get the number of children of list \a info.
+    parcelerror _listSize(const ObjectInfo &info, zu64 *len);
+    //! Read up to \a count children of list \a info from child \a start into \a out, in one read.
+    parcelerror _listRead(const ObjectInfo &info, zu64 start, zu64 count, ZArray<ZUID> &out);
+    //! Append the \a size bytes of children at \a children to list \a id with \a info.
+    parcelerror _listAppend(ZUID id, const ObjectInfo &info, const zbyte *children, zu64 size);
+    /*! Point object \a id with \a info at the data node at \a offset of \a size bytes, with entry \a flags.
+     *  The old data node is not freed.
+     */
+    parcelerror _relinkData(ZUID id, const ObjectInfo &info, zu64 offset, zu64 size, zu8 flags);
+    /*! Get offset and length of blob \a id's data. Throws for \a fn like the fetch functions.
+     *  If \a info is inlined, \a offset and \a size are not set.
+     */
+    parcelerror _blobRange(ZUID id, const char *fn, ObjectInfo *info, zu64 *offset, zu64 *size);
+    //! Get pointer to the inline data of \a id in leaf \a page in the mapping, or null.
+    const zbyte *_mapInline(const ZUID &id, zu64 page) const;
+    //! Copy \a size bytes at \a offset in the parcel file to file descriptor \a fd.
+    parcelerror _copyToFd(int fd, zu64 offset, zu64 size);
+    /*! Copy \a size bytes from file descriptor \a fd to \a offset in the parcel file.
+     *  If \a crc is not null, the CRC32C of the data is continued there, otherwise the copy may be made in the kernel.
+     */
+    parcelerror _copyFromFd(int fd, zu64 offset, zu64 size, zu32 *crc);
+    //! Check if the node at \a offset must be verified after it is read from the file.
+    bool _mustVerify(zu64 offset) const;
+    //! Record that the node at \a offset passed verification.
+    void _verified(zu64 offset);
+    //! Check data node at \a offset of \a size bytes for verify(), using \a buff for reads.
+    parcelerror _verifyPayload(zu64 offset, zu64 size, objtype type, bool compressed, ZBinary &buff);
 
 private:
+    struct PagePath;
+    struct ParcelInfoCache;
+    struct ParcelNodePool;
+    struct ParcelBatch;
+    struct ParcelFreeMap;
+    struct ParcelBuild;
+    struct ParcelLock;
+    struct ParcelIOPool;
+    struct ParcelIndex;
+    struct ParcelDedup;
+    struct ParcelJournal;
+    struct ParcelWrite;
+    struct ParcelPack;
+    struct ParcelStats;
+    class ParcelPage;
+
+    //! Search B+tree at \a root for \a id, recording the path taken and loading the leaf into \a leaf.
+    parcelerror _pageFind(zu64 root, const ZUID &id, PagePath *path, ParcelPage *leaf);
+    //! Insert leaf \a entry at the position found by _pageFind(), splitting pages as needed.
+    parcelerror _pageInsert(zu64 *root, const PagePath *path, ParcelPage *leaf, const zbyte *entry);
+    //! Decode a leaf page entry into \a info.
+    void _pageEntryInfo(const zbyte *entry, ObjectInfo *info);
+
     /*! Allocate node of at least \a size.
      *  Offset and actual size of the node are returned in \a offset and \a nsize.
      */
@@ -252,17 +907,26 @@ private:
     //! Add node at \a offset with \a size to the freelist.
     parcelerror _nodeFree(zu64 offset, zu64 size);
 
+    //! Build the free map from the free list or size class bins.
+    parcelerror _freeLoad();
+    //! Write the free node at \a offset from the free map.
+    parcelerror _freeWrite(zu64 offset);
+    //! Add a free node to the free map and the free list or its bin.
+    parcelerror _freeLink(zu64 offset, zu64 size);
+    //! Remove the free node at \a offset from the free map and the free list or its bin.
+    parcelerror _freeUnlink(zu64 offset);
+
 protected:
     class ParcelObjectAccessor : public ZBlockAccessor {
     public:
-        ParcelObjectAccessor(ZBlockAccessor *file, zu64 offset, zu64 size) :
-            _file(file), _base(offset), _pos(0), _size(size){
+        ParcelObjectAccessor(ZParcel *parcel, zu64 offset, zu64 size) :
+            _parcel(parcel), _base(offset), _pos(0), _size(size){
 
         }
 
         // ZReader interface
         zu64 available() const {
-            return (_base + _size) - _pos;
+            return _size - _pos;
         }
         zu64 read(zbyte *dest, zu64 size);
 
@@ -274,15 +938,15 @@ protected:
             return _pos;
         }
         zu64 seek(zu64 pos){
-            _pos = MIN(pos, _base + _size);
+            _pos = MIN(pos, _size);
             return _pos;
         }
         bool atEnd() const {
-            return (tell() == _base + _size);
+            return (_pos == _size);
         }
 
     private:
-        ZBlockAccessor *const _file;
+        ZParcel *const _parcel;
         const zu64 _base;
         zu64 _pos;
         const zu64 _size;
@@ -295,6 +959,9 @@ protected:
         zu64 rnode;     // Right child tree node offset
 
         objtype type;   // Payload type
+        bool inlined;   // Object data is in payload
+        zu8 inlen;      // Inline data length
+        bool compressed; // Data node holds compressed chunks
         union {
             zbyte payload[16];
             struct {
@@ -302,17 +969,17 @@ protected:
                 zu64 size;      // Payload size
             } data;
         };
-
-        ZPointer<ParcelObjectAccessor> accessor;
     };
 
 private:
     class ParcelHeader {
     public:
-        ParcelHeader(ZParcel *parcel, zu64 addr) : file(parcel->_file), offset(addr){}
+        ParcelHeader(ZParcel *parcel, zu64 addr) : parcel(parcel), offset(addr){}
 
         parcelerror read();
         parcelerror write();
+        //! Encode the header record into \a buff of NODE_SIZE bytes.
+        void encode(zbyte *buff) const;
 
         static const zu64 NODE_SIZE = (7 + 1 + 4 + 8 + 8 + 8 + 8 + ZUID_SIZE + 4);
 
@@ -328,16 +995,17 @@ private:
         // 4 byte crc
 
     private:
-        ZBlockAccessor *const file;
+        ZParcel *const parcel;
         const zu64 offset;
     };
 
 private:
     class ParcelTreeNode {
     public:
-        ParcelTreeNode(ZParcel *parcel, zu64 addr) : file(parcel->_file), offset(addr){}
+        ParcelTreeNode(ZParcel *parcel, zu64 addr) : parcel(parcel), offset(addr){}
 
-        parcelerror read();
+        //! Read node, from the node pool if \a pool is set.
+        parcelerror read(bool pool = false);
         parcelerror write();
 
         static const zu64 NODE_SIZE = (4 + ZUID_SIZE + 8 + 8 + 1 + 1 + 4 + 16);
@@ -359,14 +1027,14 @@ private:
 
 
     private:
-        ZBlockAccessor *const file;
+        ZParcel *const parcel;
         const zu64 offset;
     };
 
 private:
     class ParcelFreeNode {
     public:
-        ParcelFreeNode(ZParcel *parcel, zu64 addr) : file(parcel->_file), offset(addr){}
+        ParcelFreeNode(ZParcel *parcel, zu64 addr) : parcel(parcel), offset(addr){}
 
         parcelerror read();
         parcelerror write();
@@ -378,15 +1046,254 @@ private:
         zu64 size;
 
     private:
-        ZBlockAccessor *const file;
+        ZParcel *const parcel;
+        const zu64 offset;
+    };
+
+private:
+    //! Heads of the size class bins, stored after the header in OPT_SIZE_CLASSES parcels.
+    class ParcelBinTable {
+    public:
+        ParcelBinTable(ZParcel *parcel, zu64 addr) : offset(addr), parcel(parcel){}
+
+        parcelerror read();
+        parcelerror write();
+
+        //! Get the bin for nodes of \a size. Bin n holds nodes of size [2^n, 2^(n+1)).
+        static zu8 bin(zu64 size);
+
+        static const zu8 BINS = 64;
+        static const zu64 NODE_SIZE = (4 + BINS * 8 + 4);
+
+    public:
+        // 4 byte magic
+        zu64 head[BINS];
+        // 4 byte crc
+
+        const zu64 offset;
+
+    private:
+        ZParcel *const parcel;
+    };
+
+private:
+    /*! Free node in a size class bin.
+     *  The size of the node is repeated in the last 8 bytes of the node, so the node
+     *  can be found from its right neighbor.
+     */
+    class ParcelBinNode {
+    public:
+        ParcelBinNode(ZParcel *parcel, zu64 addr) : offset(addr), parcel(parcel){}
+
+        parcelerror read();
+        //! Write node and size footer.
+        parcelerror write();
+
+        static const zu64 NODE_SIZE = (4 + 8 + 8 + 8 + 4);
+        static const zu64 FOOT_SIZE = 8;
+        static const zu64 MIN_SIZE = NODE_SIZE + FOOT_SIZE;
+
+    public:
+        // 4 byte magic
+        zu64 next;
+        zu64 prev;
+        zu64 size;
+        // 4 byte crc
+
         const zu64 offset;
+
+    private:
+        ZParcel *const parcel;
+    };
+
+private:
+    /*! B+tree page. Leaf pages (level 0) hold object entries sorted by UUID and are linked in order.
+     *  Inner pages hold child page offsets separated by the first UUID of each child.
+     */
+    class ParcelPage {
+    public:
+        ParcelPage(ZParcel *parcel, zu64 addr) : offset(addr), parcel(parcel){}
+
+        //! Read page, from the node pool if \a pool is set and the page is an inner page.
+        parcelerror read(bool pool = false);
+        parcelerror write();
+
+        //! Reset to an empty page at \a lvl.
+        void init(zu8 lvl);
+        bool full() const {
+            return count >= (level ? INNER_MAX : LEAF_MAX);
+        }
+
+        /*! Search page for \a id.
+         *  For leaf pages, returns the index of the first entry not less than \a id, and sets \a found.
+         *  For inner pages, returns the index of the child that may contain \a id.
+         */
+        zu16 search(const ZUID &id, bool *found);
+
+        // Leaf entries: 16 byte uid, 1 byte type, 1 byte extra, 16 byte payload
+        zbyte *entry(zu16 i){
+            return buff + HEAD_SIZE + (zu64)i * LEAF_SIZE;
+        }
+        void insertEntry(zu16 i, const zbyte *ent);
+        void removeEntry(zu16 i);
+
+        // Inner entries: 8 byte first child, then 16 byte key and 8 byte child for keys 1 to count
+        zbyte *key(zu16 i){
+            return buff + HEAD_SIZE + 8 + (zu64)(i - 1) * INNER_SIZE;
+        }
+        zu64 child(zu16 i){
+            return ZBinary::decbeu64(i ? key(i) + ZUID_SIZE : buff + HEAD_SIZE);
+        }
+        void setChild(zu16 i, zu64 addr){
+            ZBinary::encbeu64(i ? key(i) + ZUID_SIZE : buff + HEAD_SIZE, addr);
+        }
+        void insertChild(zu16 i, const zbyte *k, zu64 addr);
+
+        /*! Move the upper part of this page into empty page \a right.
+         *  Leaf pages keep \a at entries. Inner pages keep \a at - 1 keys, and the key at \a at is copied to \a sep.
+         */
+        void split(ParcelPage *right, zu16 at, zbyte *sep);
+
+        static const zu64 PAGE_SIZE = 4096;
+        static const zu64 HEAD_SIZE = (4 + 1 + 1 + 2 + 8 + 4);
+        static const zu64 LEAF_SIZE = (ZUID_SIZE + 1 + 1 + 16);
+        static const zu64 INNER_SIZE = (ZUID_SIZE + 8);
+        static const zu16 LEAF_MAX = (PAGE_SIZE - HEAD_SIZE) / LEAF_SIZE;
+        static const zu16 INNER_MAX = (PAGE_SIZE - HEAD_SIZE - 8) / INNER_SIZE;
+        //! Leaf entry flag: payload holds the object data, with its length in the low bits.
+        static const zu8 ENTRY_INLINE = 0x80;
+        //! Leaf entry flag: data node holds compressed chunks.
+        static const zu8 ENTRY_COMPRESSED = 0x40;
+        //! Mask of the inline length in the entry flags.
+        static const zu8 ENTRY_LENGTH = 0x1f;
+        //! Longest blob, string or list data kept in the entry payload.
+        static const zu8 INLINE_MAX = 16;
+
+    public:
+        // 4 byte magic
+        zu8 level;
+        zu8 flags;
+        zu16 count;
+        zu64 next;
+        // 4 byte crc
+
+        zu64 offset;
+
+    private:
+        ZParcel *const parcel;
+        // Page contents, so pages on the stack need no allocation
+        zbyte buff[PAGE_SIZE];
+    };
+
+private:
+    //! Reader for a compressed data node, decoding one chunk at a time.
+    class ParcelCompressedAccessor : public ZBlockAccessor {
+    public:
+        ParcelCompressedAccessor(ZParcel *parcel, zu64 offset, zu64 size);
+
+        // ZReader interface
+        zu64 available() const {
+            return _size - _pos;
+        }
+        zu64 read(zbyte *dest, zu64 size);
+
+        // ZWriter interface
+        zu64 write(const zbyte *, zu64){
+            return 0;
+        }
+
+        // ZPosition interface
+        zu64 tell() const {
+            return _pos;
+        }
+        zu64 seek(zu64 pos){
+            _pos = MIN(pos, _size);
+            return _pos;
+        }
+        bool atEnd() const {
+            return (_pos == _size);
+        }
+
+    private:
+        //! Read and decode the chunk after the buffered one.
+        bool _next();
+
+    private:
+        ZParcel *const _parcel;
+        const zu64 _base;   // First chunk offset
+        const zu64 _end;    // End of data node
+        zu64 _size;         // Decoded size
+        zu64 _pos;
+        zu64 _coff;         // Offset of the chunk after the buffered one
+        zu64 _cstart;       // Decoded position of the buffered chunk
+        ZBinary _chunk;
+    };
+
+    //! Read-only accessor over the mapping of a mapped parcel.
+    class ParcelMapAccessor : public ZBlockAccessor {
+    public:
+        ParcelMapAccessor(ZParcel *parcel) : _parcel(parcel), _pos(0){}
+
+        // ZReader interface
+        zu64 available() const {
+            return (_pos < _parcel->_mapsize ? _parcel->_mapsize - _pos : 0);
+        }
+        zu64 read(zbyte *dest, zu64 size);
+
+        // ZWriter interface
+        zu64 write(const zbyte *, zu64){
+            return 0;
+        }
+
+        // ZPosition interface
+        zu64 tell() const {
+            return _pos;
+        }
+        zu64 seek(zu64 pos){
+            _pos = MIN(pos, _parcel->_mapsize);
+            return _pos;
+        }
+        bool atEnd() const {
+            return (_pos == _parcel->_mapsize);
+        }
+
+    private:
+        ZParcel *const _parcel;
+        zu64 _pos;
     };
 
 private:
     parcelstate _state;
     ZBlockAccessor *_file;
     ParcelHeader *_header;
-    ZMap<ZUID, ObjectInfo> _cache;
+    ParcelBinTable *_bins;
+    ParcelFreeMap *_free;
+    ParcelInfoCache *_cache;
+    ParcelNodePool *_pool;
+    ParcelBatch *_batch;
+    ParcelBuild *_build;
+    ParcelLock *_lock;
+    ParcelIOPool *_io;
+    ParcelIndex *_index;
+    //! Mask of enabled indextype.
+    int _indexes;
+    ParcelDedup *_dedup;
+    ParcelJournal *_wal;
+    ParcelPack *_pack;
+    ParcelStats *_stats;
+    bool _readonly;
+    //! Descriptor for positional I/O, or -1 to use \a _file.
+    int _fd;
+    //! Largest compressed size kept, as percent of the data size. Zero to not compress.
+    zu8 _compresspct;
+    zu64 _compressmin;
+    verifymode _verify;
+
+    // Mapped parcel
+    int _mapfd;
+    const zbyte *_map;
+    zu64 _mapsize;
+    ParcelMapAccessor *_mapfile;
 };
 
 } // namespace LibChaos
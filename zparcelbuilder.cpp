@@ -0,0 +1,38 @@
+/*******************************************************************************
+**                                  LibChaos                                  **
+**                             zparcelbuilder.cpp                             **
+**                          See COPYRIGHT and LICENSE                         **
+*******************************************************************************/
+#include "zparcelbuilder.h"
+#include "zexception.h"
+
+namespace LibChaos {
+
+ZParcel::parcelerror ZParcelBuilder::create(ZBlockAccessor *file, ZParcel::parcelopt opt){
+    ZParcel::parcelerror err = _parcel.create(file, opt, ZParcel::VERSION2);
+    if(err != ZParcel::OK)
+        return err;
+    return _parcel._buildBegin();
+}
+
+ZParcel::parcelerror ZParcelBuilder::create(ZPath path, ZParcel::parcelopt opt){
+    ZParcel::parcelerror err = _parcel.create(path, opt, ZParcel::VERSION2);
+    if(err != ZParcel::OK)
+        return err;
+    return _parcel._buildBegin();
+}
+
+zu64 ZParcelBuilder::count() const {
+    return (_parcel._build ? _parcel._buildCount() : 0);
+}
+
+ZParcel::parcelerror ZParcelBuilder::finish(){
+    if(!_parcel._build)
+        throw ZException("ZParcelBuilder::finish: build not started");
+
+    ZParcel::parcelerror err = _parcel._buildFinish();
+    _parcel.close();
+    return err;
+}
+
+} // namespace LibChaos
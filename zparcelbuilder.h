@@ -0,0 +1,55 @@
+/*******************************************************************************
+**                                  LibChaos                                  **
+**                              zparcelbuilder.h                              **
+**                          See COPYRIGHT and LICENSE                         **
+*******************************************************************************/
+#ifndef ZPARCELBUILDER_H
+#define ZPARCELBUILDER_H
+
+#include "zparcel.h"
+
+namespace LibChaos {
+
+/*! Bulk builder for new VERSION2 parcels.
+ *  Object payloads are written sequentially as they are stored, in any key order.
+ *  finish() sorts the objects in memory and writes a balanced index bottom-up in one pass.
+ *  Objects cannot be fetched until the build is finished.
+ */
+class ZParcelBuilder {
+public:
+    /*! Create new parcel file and start building it.
+     *  This will overwrite an existing file.
+     */
+    ZParcel::parcelerror create(ZBlockAccessor *file, ZParcel::parcelopt opt = ZParcel::OPT_TAIL_EXTEND);
+    //! Create new parcel file at \a path and start building it, with positional I/O.
+    ZParcel::parcelerror create(ZPath path, ZParcel::parcelopt opt = ZParcel::OPT_TAIL_EXTEND);
+
+    ZParcel::parcelerror storeNull(ZUID id){ return _parcel.storeNull(id); }
+    ZParcel::parcelerror storeBool(ZUID id, bool bl){ return _parcel.storeBool(id, bl); }
+    ZParcel::parcelerror storeUint(ZUID id, zu64 num){ return _parcel.storeUint(id, num); }
+    ZParcel::parcelerror storeSint(ZUID id, zs64 num){ return _parcel.storeSint(id, num); }
+    ZParcel::parcelerror storeFloat(ZUID id, double num){ return _parcel.storeFloat(id, num); }
+    ZParcel::parcelerror storeZUID(ZUID id, ZUID uid){ return _parcel.storeZUID(id, uid); }
+    ZParcel::parcelerror storeBlob(ZUID id, ZBinary blob){ return _parcel.storeBlob(id, blob); }
+    ZParcel::parcelerror storeString(ZUID id, ZString str){ return _parcel.storeString(id, str); }
+    ZParcel::parcelerror storeList(ZUID id, ZList<ZUID> list){ return _parcel.storeList(id, list); }
+    ZParcel::parcelerror storeFile(ZUID id, ZPath path){ return _parcel.storeFile(id, path); }
+    ZParcel::parcelerror setRoot(ZUID id){ return _parcel.setRoot(id); }
+    void setCompression(zu8 percent, zu64 minsize = 256){ _parcel.setCompression(percent, minsize); }
+
+    //! Number of objects stored so far.
+    zu64 count() const;
+
+    /*! Write the index and header, and close the parcel.
+     *  Returns ERR_EXISTS if the same UUID was stored twice; the parcel is then left empty.
+     *  \exception ZException Build not started.
+     */
+    ZParcel::parcelerror finish();
+
+private:
+    ZParcel _parcel;
+};
+
+} // namespace LibChaos
+
+#endif // ZPARCELBUILDER_H
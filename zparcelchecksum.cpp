@@ -0,0 +1,168 @@
+/*******************************************************************************
+**                                  LibChaos                                  **
+**                            zparcelchecksum.cpp                             **
+**                          See COPYRIGHT and LICENSE                         **
+*******************************************************************************/
+#include "zparcelchecksum.h"
+
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    #define ZPARCEL_CRC_SSE42 1
+    #include <nmmintrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+    #define ZPARCEL_CRC_ARMV8 1
+    #include <arm_acle.h>
+#endif
+
+//! Reflected CRC32C polynomial.
+#define CRC32C_POLY 0x82f63b78
+
+namespace LibChaos {
+
+typedef zu32 (*crcfunc)(zu32 crc, const zbyte *data, zu64 size);
+
+//! Slice-by-8 tables, built on first use.
+struct CrcTable {
+    CrcTable(){
+        for(zu32 i = 0; i < 256; ++i){
+            zu32 crc = i;
+            for(int j = 0; j < 8; ++j)
+                crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLY : 0);
+            table[0][i] = crc;
+        }
+        for(zu32 i = 0; i < 256; ++i){
+            for(int k = 1; k < 8; ++k)
+                table[k][i] = (table[k-1][i] >> 8) ^ table[0][table[k-1][i] & 0xff];
+        }
+    }
+    zu32 table[8][256];
+};
+
+static zu32 crcSoft(zu32 crc, const zbyte *data, zu64 size){
+    static const CrcTable tab;
+    const zu32 (*t)[256] = tab.table;
+    for(; size >= 8; size -= 8, data += 8){
+        const zu32 lo = crc ^ ((zu32)data[0] | ((zu32)data[1] << 8) | ((zu32)data[2] << 16) | ((zu32)data[3] << 24));
+        crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^ t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24] ^
+              t[3][data[4]] ^ t[2][data[5]] ^ t[1][data[6]] ^ t[0][data[7]];
+    }
+    for(; size; --size)
+        crc = (crc >> 8) ^ t[0][(crc ^ *data++) & 0xff];
+    return crc;
+}
+
+#if ZPARCEL_CRC_SSE42
+
+__attribute__((target("sse4.2")))
+static zu32 crcHard(zu32 crc, const zbyte *data, zu64 size){
+#if defined(__x86_64__)
+    for(; size >= 8; size -= 8, data += 8){
+        zu64 word;
+        memcpy(&word, data, 8);
+        crc = (zu32)_mm_crc32_u64(crc, word);
+    }
+#endif
+    for(; size >= 4; size -= 4, data += 4){
+        zu32 word;
+        memcpy(&word, data, 4);
+        crc = _mm_crc32_u32(crc, word);
+    }
+    for(; size; --size)
+        crc = _mm_crc32_u8(crc, *data++);
+    return crc;
+}
+
+static crcfunc crcSelect(){
+    return __builtin_cpu_supports("sse4.2") ? crcHard : crcSoft;
+}
+
+#elif ZPARCEL_CRC_ARMV8
+
+static zu32 crcHard(zu32 crc, const zbyte *data, zu64 size){
+    for(; size >= 8; size -= 8, data += 8){
+        zu64 word;
+        memcpy(&word, data, 8);
+        crc = __crc32cd(crc, word);
+    }
+    for(; size; --size)
+        crc = __crc32cb(crc, *data++);
+    return crc;
+}
+
+static crcfunc crcSelect(){
+    // Compiled for a CPU that has the CRC extension
+    return crcHard;
+}
+
+#else
+
+static crcfunc crcSelect(){
+    return crcSoft;
+}
+
+#endif
+
+static crcfunc crcImpl(){
+    static const crcfunc func = crcSelect();
+    return func;
+}
+
+zu32 ZParcelChecksum::crc32c(const zbyte *data, zu64 size, zu32 crc){
+    return ~crcImpl()(~crc, data, size);
+}
+
+zu32 ZParcelChecksum::node(const zbyte *data, zu64 size, zu64 field){
+    static const zbyte zero[4] = { 0, 0, 0, 0 };
+    const crcfunc func = crcImpl();
+    zu32 crc = func(0xffffffff, data, field);
+    crc = func(crc, zero, 4);
+    crc = func(crc, data + field + 4, size - field - 4);
+    return ~crc;
+}
+
+//! Product of \a a and \a b modulo the polynomial, in the reflected bit order. \a a must not be zero.
+static zu32 multModP(zu32 a, zu32 b){
+    zu32 m = (zu32)1 << 31;
+    zu32 p = 0;
+    for(;;){
+        if(a & m){
+            p ^= b;
+            if((a & (m - 1)) == 0)
+                break;
+        }
+        m >>= 1;
+        b = (b & 1) ? (b >> 1) ^ CRC32C_POLY : (b >> 1);
+    }
+    return p;
+}
+
+//! Powers x^(2^k) modulo the polynomial.
+struct CrcPowers {
+    CrcPowers(){
+        zu32 p = (zu32)1 << 30;
+        for(int k = 0; k < 64; ++k){
+            power[k] = p;
+            p = multModP(p, p);
+        }
+    }
+    zu32 power[64];
+};
+
+zu32 ZParcelChecksum::zeros(zu32 crc, zu64 size){
+    static const CrcPowers tab;
+    // Each zero byte multiplies the register by x^8
+    zu32 op = (zu32)1 << 31;
+    int k = 3;
+    for(zu64 n = size; n; n >>= 1, ++k){
+        if(n & 1)
+            op = multModP(tab.power[k], op);
+    }
+    return ~multModP(op, ~crc);
+}
+
+bool ZParcelChecksum::hardware(){
+    return crcImpl() != crcSoft;
+}
+
+} // namespace LibChaos
@@ -0,0 +1,32 @@
+/*******************************************************************************
+**                                  LibChaos                                  **
+**                             zparcelchecksum.h                              **
+**                          See COPYRIGHT and LICENSE                         **
+*******************************************************************************/
+#ifndef ZPARCELCHECKSUM_H
+#define ZPARCELCHECKSUM_H
+
+#include "ztypes.h"
+
+namespace LibChaos {
+
+/*! CRC32C (Castagnoli) checksums for parcel nodes.
+ *  Uses the SSE4.2 or ARMv8 CRC instructions when the CPU has them, and a table otherwise.
+ */
+class ZParcelChecksum {
+public:
+    //! CRC32C of \a size bytes at \a data, continuing from a previous result \a crc.
+    static zu32 crc32c(const zbyte *data, zu64 size, zu32 crc = 0);
+    /*! CRC32C of a node of \a size bytes with the 4-byte checksum field at \a field counted as zero.
+     *  The node is checked in place, without clearing the field.
+     */
+    static zu32 node(const zbyte *data, zu64 size, zu64 field);
+    //! CRC32C of \a size zero bytes continuing from \a crc, in time logarithmic in \a size.
+    static zu32 zeros(zu32 crc, zu64 size);
+    //! True if crc32c() uses CPU instructions.
+    static bool hardware();
+};
+
+} // namespace LibChaos
+
+#endif // ZPARCELCHECKSUM_H
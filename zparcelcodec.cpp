@@ -0,0 +1,164 @@
+/*******************************************************************************
+**                                  LibChaos                                  **
+**                              zparcelcodec.cpp                              **
+**                          See COPYRIGHT and LICENSE                         **
+*******************************************************************************/
+#include "zparcelcodec.h"
+
+#include <string.h>
+
+// Format limits
+#define MIN_MATCH       4
+#define LAST_LITERALS   5
+#define MATCH_LIMIT     12
+#define MAX_DISTANCE    65535
+
+#define HASH_BITS       12
+
+namespace LibChaos {
+
+static inline zu32 read32(const zbyte *ptr){
+    zu32 val;
+    memcpy(&val, ptr, 4);
+    return val;
+}
+
+static inline zu32 hash32(zu32 val){
+    return (val * 2654435761U) >> (32 - HASH_BITS);
+}
+
+//! Write length beyond the 4-bit token field as a run of 255s and a remainder.
+static inline zbyte *writeLength(zbyte *op, zu64 len){
+    for(; len >= 255; len -= 255)
+        *op++ = 255;
+    *op++ = (zbyte)len;
+    return op;
+}
+
+zu64 ZParcelCodec::bound(zu64 size){
+    return size + size / 255 + 16;
+}
+
+zu64 ZParcelCodec::compress(const zbyte *src, zu64 size, zbyte *dest){
+    zu32 table[1 << HASH_BITS];
+    memset(table, 0, sizeof(table));
+
+    zbyte *op = dest;
+    zu64 anchor = 0;
+
+    if(size > MATCH_LIMIT){
+        const zu64 limit = size - MATCH_LIMIT;
+        const zu64 mlimit = size - LAST_LITERALS;
+        zu64 ip = 0;
+        while(ip < limit){
+            const zu32 seq = read32(src + ip);
+            const zu32 h = hash32(seq);
+            const zu64 ref = table[h];
+            table[h] = (zu32)ip;
+
+            if(ref >= ip || ip - ref > MAX_DISTANCE || read32(src + ref) != seq){
+                ++ip;
+                continue;
+            }
+
+            zu64 mlen = MIN_MATCH;
+            while(ip + mlen < mlimit && src[ref + mlen] == src[ip + mlen])
+                ++mlen;
+
+            // Token, literals, offset, match length
+            const zu64 llen = ip - anchor;
+            zbyte *token = op++;
+            *token = (zbyte)((llen >= 15 ? 15 : llen) << 4);
+            if(llen >= 15)
+                op = writeLength(op, llen - 15);
+            memcpy(op, src + anchor, llen);
+            op += llen;
+
+            const zu64 dist = ip - ref;
+            *op++ = (zbyte)dist;
+            *op++ = (zbyte)(dist >> 8);
+
+            const zu64 ml = mlen - MIN_MATCH;
+            *token |= (zbyte)(ml >= 15 ? 15 : ml);
+            if(ml >= 15)
+                op = writeLength(op, ml - 15);
+
+            ip += mlen;
+            anchor = ip;
+            if(ip < limit)
+                table[hash32(read32(src + ip - 2))] = (zu32)(ip - 2);
+        }
+    }
+
+    // Last literals
+    const zu64 llen = size - anchor;
+    *op++ = (zbyte)((llen >= 15 ? 15 : llen) << 4);
+    if(llen >= 15)
+        op = writeLength(op, llen - 15);
+    if(llen)
+        memcpy(op, src + anchor, llen);
+    op += llen;
+
+    return (zu64)(op - dest);
+}
+
+zu64 ZParcelCodec::decompress(const zbyte *src, zu64 size, zbyte *dest, zu64 dsize){
+    zu64 ip = 0;
+    zu64 op = 0;
+    while(ip < size){
+        const zbyte token = src[ip++];
+
+        // Literals
+        zu64 llen = token >> 4;
+        if(llen == 15){
+            zbyte b;
+            do {
+                if(ip >= size)
+                    return ZU64_MAX;
+                b = src[ip++];
+                llen += b;
+            } while(b == 255);
+        }
+        if(llen > size - ip || llen > dsize - op)
+            return ZU64_MAX;
+        memcpy(dest + op, src + ip, llen);
+        ip += llen;
+        op += llen;
+
+        // The last sequence has no match
+        if(ip == size)
+            break;
+
+        // Match
+        if(size - ip < 2)
+            return ZU64_MAX;
+        const zu64 dist = src[ip] | ((zu64)src[ip + 1] << 8);
+        ip += 2;
+        if(dist == 0 || dist > op)
+            return ZU64_MAX;
+
+        zu64 mlen = token & 15;
+        if(mlen == 15){
+            zbyte b;
+            do {
+                if(ip >= size)
+                    return ZU64_MAX;
+                b = src[ip++];
+                mlen += b;
+            } while(b == 255);
+        }
+        mlen += MIN_MATCH;
+        if(mlen > dsize - op)
+            return ZU64_MAX;
+
+        // Matches may overlap their own output
+        const zbyte *from = dest + op - dist;
+        zbyte *to = dest + op;
+        for(zu64 i = 0; i < mlen; ++i)
+            to[i] = from[i];
+        op += mlen;
+    }
+    return op;
+}
+
+} // namespace LibChaos
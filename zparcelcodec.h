@@ -0,0 +1,34 @@
+/*******************************************************************************
+**                                  LibChaos                                  **
+**                               zparcelcodec.h                               **
+**                          See COPYRIGHT and LICENSE                         **
+*******************************************************************************/
+#ifndef ZPARCELCODEC_H
+#define ZPARCELCODEC_H
+
+#include "ztypes.h"
+
+namespace LibChaos {
+
+/*! Fast LZ77 block codec for parcel payloads, in the LZ4 block format.
+ *  Blocks are independent, so large payloads can be compressed and decoded in chunks.
+ */
+class ZParcelCodec {
+public:
+    //! Largest compressed size of \a size bytes.
+    static zu64 bound(zu64 size);
+
+    /*! Compress \a size bytes from \a src into \a dest, which must hold bound(\a size) bytes.
+     *  \return Compressed size.
+     */
+    static zu64 compress(const zbyte *src, zu64 size, zbyte *dest);
+
+    /*! Decompress block of \a size bytes from \a src into at most \a dsize bytes at \a dest.
+     *  \return Decompressed size, or ZU64_MAX if the block is corrupt or does not fit.
+     */
+    static zu64 decompress(const zbyte *src, zu64 size, zbyte *dest, zu64 dsize);
+};
+
+} // namespace LibChaos
+
+#endif // ZPARCELCODEC_H